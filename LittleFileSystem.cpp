@@ -101,7 +101,8 @@ static int lfs_bd_erase(const struct lfs_config *c, lfs_block_t block) {
 }
 
 static int lfs_bd_sync(const struct lfs_config *c) {
-    return 0;
+    BlockDevice *bd = (BlockDevice *)c->context;
+    return bd->sync();
 }
 
 
@@ -160,6 +161,14 @@ int LittleFileSystem::mount(BlockDevice *bd) {
     if (_config.lookahead > _lookahead) {
         _config.lookahead = _lookahead;
     }
+    _config.read_lines = MBED_LFS_READ_LINES;
+    _config.lookup_cache = MBED_LFS_LOOKUP_CACHE;
+    _config.erase_ahead = MBED_LFS_ERASE_AHEAD;
+    _config.erase_map = MBED_LFS_ERASE_MAP;
+    _config.group_commit = MBED_LFS_GROUP_COMMIT;
+    _config.inline_size = MBED_LFS_INLINE_SIZE;
+    _config.pack_size = MBED_LFS_PACK_SIZE;
+    _config.span_reads = true;
 
     err = lfs_mount(&_lfs, &_config);
     LFS_INFO("mount -> %d", lfs_toerror(err));
@@ -230,6 +239,14 @@ int LittleFileSystem::format(BlockDevice *bd,
     if (_config.lookahead > lookahead) {
         _config.lookahead = lookahead;
     }
+    _config.read_lines = MBED_LFS_READ_LINES;
+    _config.lookup_cache = MBED_LFS_LOOKUP_CACHE;
+    _config.erase_ahead = MBED_LFS_ERASE_AHEAD;
+    _config.erase_map = MBED_LFS_ERASE_MAP;
+    _config.group_commit = MBED_LFS_GROUP_COMMIT;
+    _config.inline_size = MBED_LFS_INLINE_SIZE;
+    _config.pack_size = MBED_LFS_PACK_SIZE;
+    _config.span_reads = true;
 
     err = lfs_format(&_lfs, &_config);
     if (err) {
@@ -328,6 +345,60 @@ int LittleFileSystem::stat(const char *name, struct stat *st) {
     return lfs_toerror(err);
 }
 
+int LittleFileSystem::cache_stats(lfs_cache_stats_t *read,
+        lfs_cache_stats_t *lookup) {
+    _mutex.lock();
+    LFS_INFO("cache_stats(%p, %p)", read, lookup);
+    if (!_bd) {
+        LFS_INFO("cache_stats -> %d", -EINVAL);
+        _mutex.unlock();
+        return -EINVAL;
+    }
+
+    if (read) {
+        *read = _lfs.rstats;
+    }
+
+    if (lookup) {
+        *lookup = _lfs.lstats;
+    }
+
+    LFS_INFO("cache_stats -> %d", 0);
+    _mutex.unlock();
+    return 0;
+}
+
+int LittleFileSystem::erase_stats(lfs_erase_stats_t *stats) {
+    _mutex.lock();
+    LFS_INFO("erase_stats(%p)", stats);
+    if (!_bd) {
+        LFS_INFO("erase_stats -> %d", -EINVAL);
+        _mutex.unlock();
+        return -EINVAL;
+    }
+
+    *stats = _lfs.estats;
+
+    LFS_INFO("erase_stats -> %d", 0);
+    _mutex.unlock();
+    return 0;
+}
+
+int LittleFileSystem::gc_step(lfs_size_t budget) {
+    _mutex.lock();
+    LFS_INFO("gc_step(%ld)", budget);
+    if (!_bd) {
+        LFS_INFO("gc_step -> %d", -EINVAL);
+        _mutex.unlock();
+        return -EINVAL;
+    }
+
+    int res = lfs_gc_step(&_lfs, budget);
+    LFS_INFO("gc_step -> %d", lfs_toerror(res));
+    _mutex.unlock();
+    return lfs_toerror(res);
+}
+
 
 ////// File operations //////
 int LittleFileSystem::file_open(fs_file_t *file, const char *path, int flags) {
@@ -345,6 +416,12 @@ int LittleFileSystem::file_close(fs_file_t file) {
     lfs_file_t *f = (lfs_file_t *)file;
     _mutex.lock();
     LFS_INFO("file_close(%p)", file);
+    if (_config.group_commit) {
+        // give other syncs a chance to take us along in their commit
+        lfs_file_marksync(&_lfs, f);
+        _mutex.unlock();
+        _mutex.lock();
+    }
     int err = lfs_file_close(&_lfs, f);
     LFS_INFO("file_close -> %d", lfs_toerror(err));
     _mutex.unlock();
@@ -376,6 +453,12 @@ int LittleFileSystem::file_sync(fs_file_t file) {
     lfs_file_t *f = (lfs_file_t *)file;
     _mutex.lock();
     LFS_INFO("file_sync(%p)", file);
+    if (_config.group_commit) {
+        // give other syncs a chance to take us along in their commit
+        lfs_file_marksync(&_lfs, f);
+        _mutex.unlock();
+        _mutex.lock();
+    }
     int err = lfs_file_sync(&_lfs, f);
     LFS_INFO("file_sync -> %d", lfs_toerror(err));
     _mutex.unlock();
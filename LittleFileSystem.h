@@ -52,12 +52,15 @@ public:
      *  @param block_size
      *      Size of an erasable block. This does not impact ram consumption and
      *      may be larger than the physical erase size. However, this should be
-     *      kept small as each file currently takes up an entire block.
+     *      kept small as each file larger than the inline and pack sizes
+     *      takes up at least an entire block.
      *  @param lookahead
      *      Number of blocks to lookahead during block allocation. A larger
      *      lookahead reduces the number of passes required to allocate a block.
      *      The lookahead buffer requires only 1 bit per block so it can be quite
-     *      large with little ram impact. Should be a multiple of 32.
+     *      large with little ram impact. Should be a multiple of 32. If the
+     *      lookahead covers every block on the device, it is kept as a free
+     *      map that is only rebuilt from the filesystem when mounted.
      */
     LittleFileSystem(const char *name=NULL, BlockDevice *bd=NULL,
             lfs_size_t read_size=MBED_LFS_READ_SIZE,
@@ -82,12 +85,15 @@ public:
      *  @param block_size
      *      Size of an erasable block. This does not impact ram consumption and
      *      may be larger than the physical erase size. However, this should be
-     *      kept small as each file currently takes up an entire block.
+     *      kept small as each file larger than the inline and pack sizes
+     *      takes up at least an entire block.
      *  @param lookahead
      *      Number of blocks to lookahead during block allocation. A larger
      *      lookahead reduces the number of passes required to allocate a block.
      *      The lookahead buffer requires only 1 bit per block so it can be quite
-     *      large with little ram impact. Should be a multiple of 32.
+     *      large with little ram impact. Should be a multiple of 32. If the
+     *      lookahead covers every block on the device, it is kept as a free
+     *      map that is only rebuilt from the filesystem when mounted.
      */
     static int format(BlockDevice *bd,
         lfs_size_t read_size=MBED_LFS_READ_SIZE,
@@ -151,6 +157,42 @@ public:
      */
     virtual int mkdir(const char *path, mode_t mode);
 
+    /** Get the hit and miss counts of the filesystem's caches
+     *
+     *  Counts accumulate from when the filesystem is mounted.
+     *
+     *  @param read     Destination for the read cache counts, may be NULL
+     *  @param lookup   Destination for the path lookup cache counts, may be NULL
+     *  @return         0 on success, negative error code on failure
+     */
+    int cache_stats(lfs_cache_stats_t *read, lfs_cache_stats_t *lookup);
+
+    /** Get the number of block erases done and skipped
+     *
+     *  Erases are skipped for blocks that are known to still be erased,
+     *  see the erase_map and erase_ahead config options. Counts accumulate
+     *  from when the filesystem is mounted.
+     *
+     *  @param stats    Destination for the erase counts
+     *  @return         0 on success, negative error code on failure
+     */
+    int erase_stats(lfs_erase_stats_t *stats);
+
+    /** Do a bounded slice of the filesystem's background work
+     *
+     *  Deorphaning after power-loss and filling the block allocator's
+     *  lookahead are done a few metadata pairs at a time, so this can be
+     *  called from an idle thread or EventQueue to keep the work out of
+     *  foreground calls. Once that's done, this keeps the erase-ahead
+     *  pool topped up, see the erase_ahead config option.
+     *
+     *  @param budget   Number of metadata pairs to visit or blocks to
+     *                  erase at most
+     *  @return         1 if there is more work to do, 0 if there is none,
+     *                  negative error code on failure
+     */
+    int gc_step(lfs_size_t budget);
+
 protected:
     /** Open a file on the filesystem
      *
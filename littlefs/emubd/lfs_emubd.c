@@ -15,6 +15,7 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#define _POSIX_C_SOURCE 199309L
 #include "emubd/lfs_emubd.h"
 
 #include <errno.h>
@@ -27,8 +28,26 @@
 #include <unistd.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <time.h>
 
 
+// Simulated latency
+static uint64_t lfs_emubd_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static void lfs_emubd_sleep(uint64_t until) {
+    uint64_t now = lfs_emubd_now();
+    if (until > now) {
+        struct timespec ts;
+        ts.tv_sec = (until - now) / 1000000;
+        ts.tv_nsec = ((until - now) % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+    }
+}
+
 // Block device emulated on existing filesystem
 int lfs_emubd_create(const struct lfs_config *cfg, const char *path) {
     lfs_emubd_t *emu = cfg->context;
@@ -36,6 +55,11 @@ int lfs_emubd_create(const struct lfs_config *cfg, const char *path) {
     emu->cfg.prog_size   = cfg->prog_size;
     emu->cfg.block_size  = cfg->block_size;
     emu->cfg.block_count = cfg->block_count;
+    emu->latency.read    = LFS_EMUBD_READ_LATENCY;
+    emu->latency.prog    = LFS_EMUBD_PROG_LATENCY;
+    emu->latency.erase   = LFS_EMUBD_ERASE_LATENCY;
+    emu->busy = 0;
+    emu->pending = 0;
 
     // Allocate buffer for creating children files
     size_t pathlen = strlen(path);
@@ -76,6 +100,7 @@ int lfs_emubd_create(const struct lfs_config *cfg, const char *path) {
 }
 
 void lfs_emubd_destroy(const struct lfs_config *cfg) {
+    lfs_emubd_wait(cfg);
     lfs_emubd_sync(cfg);
 
     lfs_emubd_t *emu = cfg->context;
@@ -91,41 +116,67 @@ int lfs_emubd_read(const struct lfs_config *cfg, lfs_block_t block,
     assert(off  % cfg->read_size == 0);
     assert(size % cfg->read_size == 0);
     assert(block < cfg->block_count);
+    assert(off + size <= cfg->block_size || cfg->span_reads);
+    assert(!emu->pending);
 
     // Zero out buffer for debugging
     memset(data, 0, size);
 
-    // Read data
-    snprintf(emu->child, LFS_NAME_MAX, "%x", block);
+    // Read data, running on into the following blocks if asked to
+    while (size > 0) {
+        lfs_size_t diff = size;
+        if (off + diff > cfg->block_size) {
+            diff = cfg->block_size - off;
+        }
 
-    FILE *f = fopen(emu->path, "rb");
-    if (!f && errno != ENOENT) {
-        return -errno;
-    }
+        assert(block < cfg->block_count);
+        snprintf(emu->child, LFS_NAME_MAX, "%x", block);
 
-    if (f) {
-        int err = fseek(f, off, SEEK_SET);
-        if (err) {
+        FILE *f = fopen(emu->path, "rb");
+        if (!f && errno != ENOENT) {
             return -errno;
         }
 
-        size_t res = fread(data, 1, size, f);
-        if (res < size && !feof(f)) {
-            return -errno;
+        if (f) {
+            int err = fseek(f, off, SEEK_SET);
+            if (err) {
+                return -errno;
+            }
+
+            size_t res = fread(data, 1, diff, f);
+            if (res < diff && !feof(f)) {
+                return -errno;
+            }
+
+            err = fclose(f);
+            if (err) {
+                return -errno;
+            }
         }
 
-        err = fclose(f);
-        if (err) {
-            return -errno;
-        }
+        block += 1;
+        off = 0;
+        data += diff;
+        size -= diff;
     }
 
     emu->stats.read_count += 1;
+    lfs_emubd_sleep(lfs_emubd_now() + emu->latency.read);
     return 0;
 }
 
 int lfs_emubd_prog(const struct lfs_config *cfg, lfs_block_t block,
         lfs_off_t off, const void *buffer, lfs_size_t size) {
+    int err = lfs_emubd_prog_async(cfg, block, off, buffer, size);
+    if (err) {
+        return err;
+    }
+
+    return lfs_emubd_wait(cfg);
+}
+
+int lfs_emubd_prog_async(const struct lfs_config *cfg, lfs_block_t block,
+        lfs_off_t off, const void *buffer, lfs_size_t size) {
     lfs_emubd_t *emu = cfg->context;
     const uint8_t *data = buffer;
 
@@ -172,6 +223,21 @@ int lfs_emubd_prog(const struct lfs_config *cfg, lfs_block_t block,
     }
 
     emu->stats.prog_count += 1;
+    uint64_t now = lfs_emubd_now();
+    emu->busy = (emu->busy > now ? emu->busy : now) + emu->latency.prog;
+    emu->pending += 1;
+    return 0;
+}
+
+int lfs_emubd_wait(const struct lfs_config *cfg) {
+    lfs_emubd_t *emu = cfg->context;
+
+    // Finish off the latency left of the oldest program
+    if (emu->pending) {
+        emu->pending -= 1;
+        lfs_emubd_sleep(emu->busy - emu->pending*emu->latency.prog);
+    }
+
     return 0;
 }
 
@@ -180,6 +246,7 @@ int lfs_emubd_erase(const struct lfs_config *cfg, lfs_block_t block) {
 
     // Check if erase is valid
     assert(block < cfg->block_count);
+    assert(!emu->pending);
 
     // Erase the block
     snprintf(emu->child, LFS_NAME_MAX, "%x", block);
@@ -209,11 +276,13 @@ int lfs_emubd_erase(const struct lfs_config *cfg, lfs_block_t block) {
     }
 
     emu->stats.erase_count += 1;
+    lfs_emubd_sleep(lfs_emubd_now() + emu->latency.erase);
     return 0;
 }
 
 int lfs_emubd_sync(const struct lfs_config *cfg) {
     lfs_emubd_t *emu = cfg->context;
+    assert(!emu->pending);
 
     // Just write out info/stats for later lookup
     snprintf(emu->child, LFS_NAME_MAX, "config");
@@ -39,6 +39,19 @@
 #define LFS_EMUBD_TOTAL_SIZE 524288
 #endif
 
+// Simulated latency of each operation in microseconds
+#ifndef LFS_EMUBD_READ_LATENCY
+#define LFS_EMUBD_READ_LATENCY 0
+#endif
+
+#ifndef LFS_EMUBD_PROG_LATENCY
+#define LFS_EMUBD_PROG_LATENCY 0
+#endif
+
+#ifndef LFS_EMUBD_ERASE_LATENCY
+#define LFS_EMUBD_ERASE_LATENCY 0
+#endif
+
 
 // The emu bd state
 typedef struct lfs_emubd {
@@ -57,6 +70,15 @@ typedef struct lfs_emubd {
         uint32_t block_size;
         uint32_t block_count;
     } cfg;
+
+    struct {
+        uint32_t read;
+        uint32_t prog;
+        uint32_t erase;
+    } latency;
+
+    uint64_t busy;
+    uint32_t pending;
 } lfs_emubd_t;
 
 
@@ -67,6 +89,8 @@ int lfs_emubd_create(const struct lfs_config *cfg, const char *path);
 void lfs_emubd_destroy(const struct lfs_config *cfg);
 
 // Read a block
+//
+// With span_reads, the read may run on into the blocks that follow.
 int lfs_emubd_read(const struct lfs_config *cfg, lfs_block_t block,
         lfs_off_t off, void *buffer, lfs_size_t size);
 
@@ -76,6 +100,17 @@ int lfs_emubd_read(const struct lfs_config *cfg, lfs_block_t block,
 int lfs_emubd_prog(const struct lfs_config *cfg, lfs_block_t block,
         lfs_off_t off, const void *buffer, lfs_size_t size);
 
+// Start programming a block
+//
+// Returns as soon as the data is taken, the program latency is
+// spent in the background until lfs_emubd_wait is called. Programs
+// started back to back are queued one after another.
+int lfs_emubd_prog_async(const struct lfs_config *cfg, lfs_block_t block,
+        lfs_off_t off, const void *buffer, lfs_size_t size);
+
+// Wait for the oldest program started with lfs_emubd_prog_async
+int lfs_emubd_wait(const struct lfs_config *cfg);
+
 // Erase a block
 //
 // A block must be erased before being programmed. The
@@ -24,6 +24,137 @@
 
 
 /// Caching block device operations ///
+static void lfs_async_wait(lfs_t *lfs);
+
+static inline bool lfs_cache_hit(lfs_t *lfs, const lfs_cache_t *rcache,
+        lfs_block_t block, lfs_off_t off) {
+    return block == rcache->block && off >= rcache->off &&
+            off < rcache->off + lfs->cfg->read_size;
+}
+
+static int lfs_cache_fetch(lfs_t *lfs, lfs_cache_t *rcache,
+        lfs_block_t block, lfs_off_t off) {
+    if (lfs_cache_hit(lfs, rcache, block, off)) {
+        if (rcache == &lfs->rcache) {
+            lfs->rstats.hit_count += 1;
+        }
+        return 0;
+    }
+
+    if (rcache == &lfs->rcache && lfs->cfg->read_lines > 1) {
+        // look through the other lines, most recently used first,
+        // falling back to evicting the least recently used line
+        lfs_size_t i = 0;
+        while (i < lfs->cfg->read_lines-2 &&
+                !lfs_cache_hit(lfs, &lfs->rlines[i], block, off)) {
+            i += 1;
+        }
+
+        lfs_cache_t line = lfs->rlines[i];
+        memmove(&lfs->rlines[1], &lfs->rlines[0], i*sizeof(lfs_cache_t));
+        lfs->rlines[0] = *rcache;
+        *rcache = line;
+
+        if (lfs_cache_hit(lfs, rcache, block, off)) {
+            lfs->rstats.hit_count += 1;
+            return 0;
+        }
+    }
+
+    if (rcache == &lfs->rcache) {
+        lfs->rstats.miss_count += 1;
+    }
+
+    // load to cache
+    lfs_async_wait(lfs);
+    rcache->block = block;
+    rcache->off = off - (off % lfs->cfg->read_size);
+    int err = lfs->cfg->read(lfs->cfg, rcache->block,
+            rcache->off, rcache->buffer, lfs->cfg->read_size);
+    if (err) {
+        rcache->block = 0xffffffff;
+        return err;
+    }
+
+    return 0;
+}
+
+static void lfs_cache_drop(lfs_t *lfs,
+        lfs_block_t block, lfs_off_t off, lfs_size_t size) {
+    // drop any read cache lines that are about to go stale
+    for (lfs_size_t i = 0; i < lfs_max(lfs->cfg->read_lines, 1); i++) {
+        lfs_cache_t *rcache = (i == 0) ? &lfs->rcache : &lfs->rlines[i-1];
+        if (block == rcache->block && off < rcache->off +
+                lfs->cfg->read_size && rcache->off < off + size) {
+            rcache->block = 0xffffffff;
+        }
+    }
+}
+
+static inline bool lfs_emap_test(lfs_t *lfs, lfs_block_t block) {
+    return lfs->emap && (lfs->emap[block / 32] & (1U << (block % 32)));
+}
+
+static inline void lfs_emap_mark(lfs_t *lfs, lfs_block_t block, bool erased) {
+    if (lfs->emap) {
+        if (erased) {
+            lfs->emap[block / 32] |= 1U << (block % 32);
+        } else {
+            lfs->emap[block / 32] &= ~(1U << (block % 32));
+        }
+    }
+}
+
+static inline bool lfs_cache_holds(lfs_t *lfs, const lfs_cache_t *pcache,
+        lfs_block_t block, lfs_off_t off) {
+    return block == pcache->block && off >= pcache->off &&
+            off < pcache->off + lfs->cfg->prog_size;
+}
+
+static const lfs_cache_t *lfs_cache_dirty(lfs_t *lfs,
+        const lfs_cache_t *pcache, lfs_block_t block, lfs_off_t off) {
+    // find the program line holding off, lines still in flight count
+    // as part of the pcache they were written through
+    if (!pcache) {
+        return NULL;
+    }
+
+    if (lfs_cache_holds(lfs, pcache, block, off)) {
+        return pcache;
+    }
+
+    for (lfs_line_t *line = lfs->lines; line; line = line->next) {
+        if (line->owner == pcache &&
+                lfs_cache_holds(lfs, &line->cache, block, off)) {
+            return &line->cache;
+        }
+    }
+
+    return NULL;
+}
+
+static lfs_size_t lfs_cache_clip(lfs_t *lfs,
+        const lfs_cache_t *pcache, lfs_block_t block,
+        lfs_off_t off, lfs_size_t size) {
+    // don't run into any program lines after off
+    if (!pcache) {
+        return size;
+    }
+
+    if (block == pcache->block && off < pcache->off) {
+        size = lfs_min(size, pcache->off - off);
+    }
+
+    for (lfs_line_t *line = lfs->lines; line; line = line->next) {
+        if (line->owner == pcache &&
+                block == line->cache.block && off < line->cache.off) {
+            size = lfs_min(size, line->cache.off - off);
+        }
+    }
+
+    return size;
+}
+
 static int lfs_cache_read(lfs_t *lfs, lfs_cache_t *rcache,
         const lfs_cache_t *pcache, lfs_block_t block,
         lfs_off_t off, void *buffer, lfs_size_t size) {
@@ -31,25 +162,12 @@ static int lfs_cache_read(lfs_t *lfs, lfs_cache_t *rcache,
     assert(block < lfs->cfg->block_count);
 
     while (size > 0) {
-        if (pcache && block == pcache->block && off >= pcache->off &&
-                off < pcache->off + lfs->cfg->prog_size) {
+        const lfs_cache_t *dcache = lfs_cache_dirty(lfs, pcache, block, off);
+        if (dcache) {
             // is already in pcache?
             lfs_size_t diff = lfs_min(size,
-                    lfs->cfg->prog_size - (off-pcache->off));
-            memcpy(data, &pcache->buffer[off-pcache->off], diff);
-
-            data += diff;
-            off += diff;
-            size -= diff;
-            continue;
-        }
-
-        if (block == rcache->block && off >= rcache->off &&
-                off < rcache->off + lfs->cfg->read_size) {
-            // is already in rcache?
-            lfs_size_t diff = lfs_min(size,
-                    lfs->cfg->read_size - (off-rcache->off));
-            memcpy(data, &rcache->buffer[off-rcache->off], diff);
+                    lfs->cfg->prog_size - (off-dcache->off));
+            memcpy(data, &dcache->buffer[off-dcache->off], diff);
 
             data += diff;
             off += diff;
@@ -57,9 +175,12 @@ static int lfs_cache_read(lfs_t *lfs, lfs_cache_t *rcache,
             continue;
         }
 
-        if (off % lfs->cfg->read_size == 0 && size >= lfs->cfg->read_size) {
+        lfs_size_t diff = lfs_cache_clip(lfs, pcache, block, off, size);
+        diff -= diff % lfs->cfg->read_size;
+        if (off % lfs->cfg->read_size == 0 && diff > 0 &&
+                !lfs_cache_hit(lfs, rcache, block, off)) {
             // bypass cache?
-            lfs_size_t diff = size - (size % lfs->cfg->read_size);
+            lfs_async_wait(lfs);
             int err = lfs->cfg->read(lfs->cfg, block, off, data, diff);
             if (err) {
                 return err;
@@ -71,35 +192,84 @@ static int lfs_cache_read(lfs_t *lfs, lfs_cache_t *rcache,
             continue;
         }
 
-        // load to cache, first condition can no longer fail
-        rcache->block = block;
-        rcache->off = off - (off % lfs->cfg->read_size);
-        int err = lfs->cfg->read(lfs->cfg, rcache->block,
-                rcache->off, rcache->buffer, lfs->cfg->read_size);
+        // is already in rcache? otherwise load to cache
+        int err = lfs_cache_fetch(lfs, rcache, block, off);
         if (err) {
             return err;
         }
+
+        diff = lfs_min(size, lfs->cfg->read_size - (off-rcache->off));
+        memcpy(data, &rcache->buffer[off-rcache->off], diff);
+
+        data += diff;
+        off += diff;
+        size -= diff;
+    }
+
+    return 0;
+}
+
+static int lfs_cache_span(lfs_t *lfs, lfs_cache_t *rcache,
+        const lfs_cache_t *pcache, lfs_block_t block,
+        lfs_off_t off, lfs_size_t size,
+        const uint8_t **data, lfs_size_t *diff) {
+    assert(block < lfs->cfg->block_count);
+
+    const lfs_cache_t *dcache = lfs_cache_dirty(lfs, pcache, block, off);
+    if (dcache) {
+        // is already in pcache?
+        *data = &dcache->buffer[off-dcache->off];
+        *diff = lfs_min(size, lfs->cfg->prog_size - (off-dcache->off));
+        return 0;
+    }
+
+    // is already in rcache? otherwise load to cache
+    int err = lfs_cache_fetch(lfs, rcache, block, off);
+    if (err) {
+        return err;
     }
 
+    *data = &rcache->buffer[off-rcache->off];
+    *diff = lfs_min(size, lfs->cfg->read_size - (off-rcache->off));
+
+    // don't run into pcache
+    *diff = lfs_cache_clip(lfs, pcache, block, off, *diff);
     return 0;
 }
 
+static bool lfs_cache_overlaps(lfs_t *lfs, const lfs_cache_t *pcache,
+        lfs_block_t block, lfs_off_t off, lfs_size_t size) {
+    return lfs_cache_dirty(lfs, pcache, block, off) ||
+            lfs_cache_clip(lfs, pcache, block, off, size) < size;
+}
+
 static int lfs_cache_cmp(lfs_t *lfs, lfs_cache_t *rcache,
         const lfs_cache_t *pcache, lfs_block_t block,
         lfs_off_t off, const void *buffer, lfs_size_t size) {
     const uint8_t *data = buffer;
 
-    for (lfs_off_t i = 0; i < size; i++) {
-        uint8_t c;
-        int err = lfs_cache_read(lfs, rcache, pcache,
-                block, off+i, &c, 1);
+    if (lfs->cfg->cmp && !lfs_cache_overlaps(lfs, pcache, block, off, size)) {
+        // let the block device compare
+        lfs_async_wait(lfs);
+        return lfs->cfg->cmp(lfs->cfg, block, off, data, size);
+    }
+
+    while (size > 0) {
+        const uint8_t *span;
+        lfs_size_t diff;
+        int err = lfs_cache_span(lfs, rcache, pcache,
+                block, off, size, &span, &diff);
         if (err) {
             return err;
         }
 
-        if (c != data[i]) {
+        if (memcmp(span, data, diff) != 0) {
             return false;
         }
+
+        data += diff;
+        off += diff;
+        size -= diff;
     }
 
     return true;
@@ -108,24 +278,108 @@ static int lfs_cache_cmp(lfs_t *lfs, lfs_cache_t *rcache,
 static int lfs_cache_crc(lfs_t *lfs, lfs_cache_t *rcache,
         const lfs_cache_t *pcache, lfs_block_t block,
         lfs_off_t off, lfs_size_t size, uint32_t *crc) {
-    for (lfs_off_t i = 0; i < size; i++) {
-        uint8_t c;
-        int err = lfs_cache_read(lfs, rcache, pcache,
-                block, off+i, &c, 1);
+    if (lfs->cfg->crc && !lfs_cache_overlaps(lfs, pcache, block, off, size)) {
+        // let the block device crc
+        lfs_async_wait(lfs);
+        return lfs->cfg->crc(lfs->cfg, block, off, size, crc);
+    }
+
+    while (size > 0) {
+        const uint8_t *span;
+        lfs_size_t diff;
+        int err = lfs_cache_span(lfs, rcache, pcache,
+                block, off, size, &span, &diff);
         if (err) {
             return err;
         }
 
-        lfs_crc(crc, &c, 1);
+        lfs_crc(crc, span, diff);
+
+        off += diff;
+        size -= diff;
     }
 
     return 0;
 }
 
+static void lfs_async_wait(lfs_t *lfs) {
+    while (lfs->abusy > 0) {
+        // programs finish in the order they were started
+        lfs_line_t *line = lfs->lines;
+        while (!line->busy || line->seq != lfs->aseq - lfs->abusy) {
+            line = line->next;
+        }
+
+        line->busy = false;
+        lfs->abusy -= 1;
+        int err = lfs->cfg->wait(lfs->cfg);
+        if (!err && line->rcache) {
+            // verify if the writer asked to, this finishes off
+            // anything else in flight before reading
+            int res = lfs_cache_cmp(lfs, line->rcache, NULL,
+                    line->cache.block, line->cache.off,
+                    line->cache.buffer, lfs->cfg->prog_size);
+            err = (res < 0) ? res : (!res) ? LFS_ERR_CORRUPT : 0;
+        }
+
+        if (err) {
+            // hold onto the error until the writer settles, writers that
+            // verify also need the line to relocate what they've written
+            line->err = err;
+            if (!line->rcache) {
+                line->cache.block = 0xffffffff;
+            }
+            continue;
+        }
+
+        line->cache.block = 0xffffffff;
+    }
+}
+
+static void lfs_async_drop(lfs_t *lfs, lfs_block_t block) {
+    // forget failed lines once nothing will read them back
+    for (lfs_line_t *line = lfs->lines; line; line = line->next) {
+        if (!line->busy && line->cache.block == block) {
+            line->cache.block = 0xffffffff;
+            line->err = 0;
+        }
+    }
+}
+
+static int lfs_cache_report(lfs_t *lfs, const lfs_cache_t *pcache) {
+    // report the first error from any of pcache's finished lines
+    int err = 0;
+    for (lfs_line_t *line = lfs->lines; line; line = line->next) {
+        if (line->owner == pcache && line->err) {
+            err = err ? err : line->err;
+            line->err = 0;
+            if (pcache == &lfs->pcache) {
+                // metadata and relocations start over from scratch
+                line->cache.block = 0xffffffff;
+            }
+        }
+    }
+
+    return err;
+}
+
+static int lfs_cache_settle(lfs_t *lfs, const lfs_cache_t *pcache) {
+    // wait for anything pcache has in flight and report how it went
+    lfs_async_wait(lfs);
+    return lfs_cache_report(lfs, pcache);
+}
+
 static int lfs_cache_flush(lfs_t *lfs,
         lfs_cache_t *pcache, lfs_cache_t *rcache) {
+    int err = lfs_cache_settle(lfs, pcache);
+    if (err) {
+        return err;
+    }
+
     if (pcache->block != 0xffffffff) {
-        int err = lfs->cfg->prog(lfs->cfg, pcache->block,
+        lfs_cache_drop(lfs, pcache->block, pcache->off, lfs->cfg->prog_size);
+        lfs_emap_mark(lfs, pcache->block, false);
+        err = lfs->cfg->prog(lfs->cfg, pcache->block,
                 pcache->off, pcache->buffer, lfs->cfg->prog_size);
         if (err) {
             return err;
@@ -149,6 +403,128 @@ static int lfs_cache_flush(lfs_t *lfs,
     return 0;
 }
 
+static int lfs_cache_pipe(lfs_t *lfs,
+        lfs_cache_t *pcache, lfs_cache_t *rcache) {
+    if (!lfs->cfg->prog_async ||
+            pcache->off + lfs->cfg->prog_size >= lfs->cfg->block_size) {
+        // the last line of a block is never left in flight, so errors
+        // turn up before the writer moves on to another block
+        return lfs_cache_flush(lfs, pcache, rcache);
+    }
+
+    // find the line we've been filling and a free one to fill next,
+    // waiting on the device if all of them are still in flight
+    lfs_line_t *fill = NULL;
+    lfs_line_t *next = NULL;
+    for (int i = 0; i < 2 && !next; i++) {
+        int err = lfs_cache_report(lfs, pcache);
+        if (err) {
+            return err;
+        }
+
+        for (lfs_line_t *line = lfs->lines; line; line = line->next) {
+            if (line->owner != pcache) {
+                continue;
+            } else if (line->cache.buffer == pcache->buffer) {
+                fill = line;
+            } else if (!line->busy && line->cache.block == 0xffffffff) {
+                next = line;
+            }
+        }
+
+        if (!next) {
+            lfs_async_wait(lfs);
+        }
+    }
+
+    if (!fill || !next) {
+        // no lines, or still holding onto failed ones
+        return lfs_cache_flush(lfs, pcache, rcache);
+    }
+
+    // hand the line off to the block device and start on the next one
+    lfs_cache_drop(lfs, pcache->block, pcache->off, lfs->cfg->prog_size);
+    lfs_emap_mark(lfs, pcache->block, false);
+    int err = lfs->cfg->prog_async(lfs->cfg, pcache->block,
+            pcache->off, pcache->buffer, lfs->cfg->prog_size);
+    if (err) {
+        return err;
+    }
+
+    fill->cache.block = pcache->block;
+    fill->cache.off = pcache->off;
+    fill->rcache = rcache;
+    fill->seq = lfs->aseq;
+    fill->busy = true;
+    lfs->aseq += 1;
+    lfs->abusy += 1;
+
+    pcache->block = 0xffffffff;
+    pcache->buffer = next->cache.buffer;
+    return 0;
+}
+
+static void lfs_cache_pipedeinit(lfs_t *lfs, lfs_cache_t *pcache,
+        lfs_line_t *lines, bool freebuffers);
+
+static int lfs_cache_pipeinit(lfs_t *lfs, lfs_cache_t *pcache,
+        lfs_line_t **lines, uint8_t *buffer) {
+    // the line pcache starts with is the first of its lines, the rest
+    // come from buffer if provided
+    lfs_size_t count = lfs->cfg->prog_lines ? lfs->cfg->prog_lines : 2;
+    *lines = calloc(count, sizeof(lfs_line_t));
+    if (!*lines) {
+        return LFS_ERR_NOMEM;
+    }
+
+    for (lfs_size_t i = 0; i < count; i++) {
+        lfs_line_t *line = &(*lines)[i];
+        line->cache.block = 0xffffffff;
+        if (i == 0) {
+            line->cache.buffer = pcache->buffer;
+        } else if (buffer) {
+            line->cache.buffer = &buffer[(i-1)*lfs->cfg->prog_size];
+        } else {
+            line->cache.buffer = malloc(lfs->cfg->prog_size);
+            if (!line->cache.buffer) {
+                // give back the lines we've set up so far
+                lfs_cache_pipedeinit(lfs, pcache, *lines, true);
+                *lines = NULL;
+                return LFS_ERR_NOMEM;
+            }
+        }
+
+        line->owner = pcache;
+        line->next = lfs->lines;
+        lfs->lines = line;
+    }
+
+    return 0;
+}
+
+static void lfs_cache_pipedeinit(lfs_t *lfs, lfs_cache_t *pcache,
+        lfs_line_t *lines, bool freebuffers) {
+    // the block device may still be reading from our lines
+    lfs_async_wait(lfs);
+
+    for (lfs_line_t **p = &lfs->lines; *p;) {
+        if ((*p)->owner == pcache) {
+            *p = (*p)->next;
+        } else {
+            p = &(*p)->next;
+        }
+    }
+
+    // give pcache back the line it started with
+    lfs_size_t count = lfs->cfg->prog_lines ? lfs->cfg->prog_lines : 2;
+    pcache->buffer = lines[0].cache.buffer;
+    for (lfs_size_t i = 1; freebuffers && i < count; i++) {
+        free(lines[i].cache.buffer);
+    }
+
+    free(lines);
+}
+
 static int lfs_cache_prog(lfs_t *lfs, lfs_cache_t *pcache,
         lfs_cache_t *rcache, lfs_block_t block,
         lfs_off_t off, const void *buffer, lfs_size_t size) {
@@ -169,7 +545,7 @@ static int lfs_cache_prog(lfs_t *lfs, lfs_cache_t *pcache,
 
             if (off % lfs->cfg->prog_size == 0) {
                 // eagerly flush out pcache if we fill up
-                int err = lfs_cache_flush(lfs, pcache, rcache);
+                int err = lfs_cache_pipe(lfs, pcache, rcache);
                 if (err) {
                     return err;
                 }
@@ -186,7 +562,14 @@ static int lfs_cache_prog(lfs_t *lfs, lfs_cache_t *pcache,
                 size >= lfs->cfg->prog_size) {
             // bypass pcache?
             lfs_size_t diff = size - (size % lfs->cfg->prog_size);
-            int err = lfs->cfg->prog(lfs->cfg, block, off, data, diff);
+            int err = lfs_cache_settle(lfs, pcache);
+            if (err) {
+                return err;
+            }
+
+            lfs_cache_drop(lfs, block, off, diff);
+            lfs_emap_mark(lfs, block, false);
+            err = lfs->cfg->prog(lfs->cfg, block, off, data, diff);
             if (err) {
                 return err;
             }
@@ -217,6 +600,115 @@ static int lfs_cache_prog(lfs_t *lfs, lfs_cache_t *pcache,
     return 0;
 }
 
+static int lfs_cache_copy(lfs_t *lfs, lfs_cache_t *pcache,
+        lfs_cache_t *rcache, lfs_block_t block, lfs_off_t off,
+        lfs_cache_t *srcache, const lfs_cache_t *spcache,
+        lfs_block_t sblock, lfs_off_t soff,
+        lfs_size_t size, uint32_t *crc) {
+    assert(block < lfs->cfg->block_count);
+
+    while (size > 0) {
+        if (lfs->cfg->copy && pcache->block == 0xffffffff &&
+                off % lfs->cfg->prog_size == 0 &&
+                soff % lfs->cfg->prog_size == 0 &&
+                size >= lfs->cfg->prog_size) {
+            // let the block device copy whole program lines, up to
+            // anything that hasn't made it to the source block yet
+            lfs_size_t diff = 0;
+            if (!lfs_cache_dirty(lfs, spcache, sblock, soff)) {
+                diff = lfs_cache_clip(lfs, spcache, sblock, soff, size);
+                diff -= diff % lfs->cfg->prog_size;
+            }
+
+            if (diff > 0) {
+                int err = lfs_cache_settle(lfs, pcache);
+                if (err) {
+                    return err;
+                }
+
+                // crc the source, to hand back and to check the copy
+                uint32_t scrc = crc ? *crc : 0xffffffff;
+                if (crc || rcache) {
+                    err = lfs_cache_crc(lfs, srcache, spcache,
+                            sblock, soff, diff, &scrc);
+                    if (err) {
+                        return (err == LFS_ERR_CORRUPT) ? LFS_ERR_IO : err;
+                    }
+                }
+
+                lfs_cache_drop(lfs, block, off, diff);
+                lfs_emap_mark(lfs, block, false);
+                err = lfs->cfg->copy(lfs->cfg,
+                        block, off, sblock, soff, diff);
+                if (err) {
+                    return err;
+                }
+
+                if (rcache) {
+                    // verify the copy the same way we verify progs
+                    uint32_t dcrc = crc ? *crc : 0xffffffff;
+                    err = lfs_cache_crc(lfs, rcache, NULL,
+                            block, off, diff, &dcrc);
+                    if (err) {
+                        return err;
+                    }
+
+                    if (dcrc != scrc) {
+                        return LFS_ERR_CORRUPT;
+                    }
+                }
+
+                if (crc) {
+                    *crc = scrc;
+                }
+
+                off += diff;
+                soff += diff;
+                size -= diff;
+                continue;
+            }
+        }
+
+        if (!(block == pcache->block && off >= pcache->off &&
+                off < pcache->off + lfs->cfg->prog_size)) {
+            // pcache must have been flushed, prepare pcache
+            assert(pcache->block == 0xffffffff);
+            pcache->block = block;
+            pcache->off = off - (off % lfs->cfg->prog_size);
+        }
+
+        // copy as much as fits from the source caches straight into pcache
+        const uint8_t *data;
+        lfs_size_t diff;
+        int err = lfs_cache_span(lfs, srcache, spcache,
+                sblock, soff, size, &data, &diff);
+        if (err) {
+            // a bad source isn't fixed by relocating what we're writing
+            return (err == LFS_ERR_CORRUPT) ? LFS_ERR_IO : err;
+        }
+
+        diff = lfs_min(diff, lfs->cfg->prog_size - (off-pcache->off));
+        memcpy(&pcache->buffer[off-pcache->off], data, diff);
+        if (crc) {
+            lfs_crc(crc, data, diff);
+        }
+
+        off += diff;
+        soff += diff;
+        size -= diff;
+
+        if (off % lfs->cfg->prog_size == 0) {
+            // eagerly flush out pcache if we fill up
+            int err = lfs_cache_pipe(lfs, pcache, rcache);
+            if (err) {
+                return err;
+            }
+        }
+    }
+
+    return 0;
+}
+
 
 /// General lfs block device operations ///
 static int lfs_bd_read(lfs_t *lfs, lfs_block_t block,
@@ -243,41 +735,86 @@ static int lfs_bd_crc(lfs_t *lfs, lfs_block_t block,
     return lfs_cache_crc(lfs, &lfs->rcache, NULL, block, off, size, crc);
 }
 
+static int lfs_bd_copy(lfs_t *lfs, lfs_block_t block, lfs_off_t off,
+        lfs_block_t sblock, lfs_off_t soff, lfs_size_t size, uint32_t *crc) {
+    return lfs_cache_copy(lfs, &lfs->pcache, NULL, block, off,
+            &lfs->rcache, NULL, sblock, soff, size, crc);
+}
+
+static bool lfs_alloc_iserased(lfs_t *lfs, lfs_block_t block);
+static void lfs_log_drop(lfs_t *lfs, lfs_block_t block);
+
 static int lfs_bd_erase(lfs_t *lfs, lfs_block_t block) {
-    return lfs->cfg->erase(lfs->cfg, block);
+    // whatever was appended to the block is about to be gone
+    lfs_log_drop(lfs, block);
+
+    // nothing to do if the block hasn't been programmed since its last erase
+    if (lfs_alloc_iserased(lfs, block) || lfs_emap_test(lfs, block)) {
+        lfs->estats.skip_count += 1;
+        return 0;
+    }
+
+    lfs_async_wait(lfs);
+    lfs_async_drop(lfs, block);
+    lfs_cache_drop(lfs, block, 0, lfs->cfg->block_size);
+    lfs->estats.erase_count += 1;
+    int err = lfs->cfg->erase(lfs->cfg, block);
+    if (err) {
+        return err;
+    }
+
+    lfs_emap_mark(lfs, block, true);
+    return 0;
 }
 
 static int lfs_bd_sync(lfs_t *lfs) {
-    lfs->rcache.block = 0xffffffff;
-
     int err = lfs_cache_flush(lfs, &lfs->pcache, NULL);
     if (err) {
         return err;
     }
 
+    lfs_async_wait(lfs);
     return lfs->cfg->sync(lfs->cfg);
 }
 
 
 /// Internal operations predeclared here ///
 int lfs_traverse(lfs_t *lfs, int (*cb)(void*, lfs_block_t), void *data);
+static int lfs_traverse_files(lfs_t *lfs,
+        int (*cb)(void*, lfs_block_t), void *data);
+static int lfs_ctz_traverse(lfs_t *lfs,
+        lfs_cache_t *rcache, const lfs_cache_t *pcache,
+        lfs_block_t head, lfs_size_t size,
+        int (*cb)(void*, lfs_block_t), void *data);
 static int lfs_pred(lfs_t *lfs, const lfs_block_t dir[2], lfs_dir_t *pdir);
 static int lfs_parent(lfs_t *lfs, const lfs_block_t dir[2],
         lfs_dir_t *parent, lfs_entry_t *entry);
 static int lfs_moved(lfs_t *lfs, const void *e);
 static int lfs_relocate(lfs_t *lfs,
         const lfs_block_t oldpair[2], const lfs_block_t newpair[2]);
+static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file);
+static int lfs_file_unextent(lfs_t *lfs, lfs_file_t *file, bool resume);
 int lfs_deorphan(lfs_t *lfs);
+static int lfs_checkpoint_clear(lfs_t *lfs);
 
 
 /// Block allocator ///
-static int lfs_alloc_lookahead(void *p, lfs_block_t block) {
-    lfs_t *lfs = p;
+static inline bool lfs_alloc_ismap(lfs_t *lfs) {
+    // a lookahead that covers the entire device is kept around as a
+    // persistent free map instead of being rebuilt every pass
+    return lfs->cfg->lookahead >= lfs->cfg->block_count;
+}
 
-    lfs_block_t off = (((lfs_soff_t)(block - lfs->free.begin)
+static inline lfs_block_t lfs_alloc_off(lfs_t *lfs, lfs_block_t block) {
+    return (((lfs_soff_t)(block - lfs->free.begin)
                 % (lfs_soff_t)(lfs->cfg->block_count))
             + lfs->cfg->block_count) % lfs->cfg->block_count;
+}
 
+static int lfs_alloc_lookahead(void *p, lfs_block_t block) {
+    lfs_t *lfs = p;
+
+    lfs_block_t off = lfs_alloc_off(lfs, block);
     if (off < lfs->cfg->lookahead) {
         lfs->free.buffer[off / 32] |= 1U << (off % 32);
     }
@@ -285,26 +822,144 @@ static int lfs_alloc_lookahead(void *p, lfs_block_t block) {
     return 0;
 }
 
-static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
-    while (true) {
-        while (true) {
-            // check if we have looked at all blocks since last ack
-            if (lfs->free.begin + lfs->free.off == lfs->free.end) {
-                LFS_WARN("No more free space %ld", lfs->free.end);
-                return LFS_ERR_NOSPC;
-            }
+static int lfs_alloc_free(void *p, lfs_block_t block) {
+    lfs_t *lfs = p;
 
-            if (lfs->free.off >= lfs_min(
-                    lfs->cfg->lookahead, lfs->cfg->block_count)) {
-                break;
-            }
+    lfs_block_t off = lfs_alloc_off(lfs, block);
+    if (off < lfs->cfg->lookahead) {
+        lfs->free.buffer[off / 32] &= ~(1U << (off % 32));
+    }
 
-            lfs_block_t off = lfs->free.off;
-            lfs->free.off += 1;
+    return 0;
+}
 
-            if (!(lfs->free.buffer[off / 32] & (1U << (off % 32)))) {
-                // found a free block
-                *block = (lfs->free.begin + off) % lfs->cfg->block_count;
+static lfs_block_t lfs_alloc_find(lfs_t *lfs,
+        lfs_block_t off, lfs_block_t size) {
+    // find the first free block in [off, size), a word at a time
+    while (off < size) {
+        uint32_t mask = ~lfs->free.buffer[off / 32]
+                & (0xffffffff << (off % 32));
+        if (mask) {
+            return lfs_min(off - (off % 32) + lfs_ctz(mask), size);
+        }
+
+        off += 32 - (off % 32);
+    }
+
+    return size;
+}
+
+static lfs_size_t lfs_alloc_count(lfs_t *lfs,
+        lfs_block_t off, lfs_block_t size) {
+    // count free blocks in [off, size)
+    lfs_size_t count = 0;
+    while (off < size) {
+        uint32_t mask = ~lfs->free.buffer[off / 32]
+                & (0xffffffff << (off % 32));
+        if (size - (off - (off % 32)) < 32) {
+            mask &= (1U << (size % 32)) - 1;
+        }
+
+        count += lfs_popc(mask);
+        off += 32 - (off % 32);
+    }
+
+    return count;
+}
+
+static void lfs_alloc_scanned(lfs_t *lfs) {
+    // anything allocated since the last ack is not in the tree yet
+    for (lfs_block_t i = lfs->free.pending[0];
+            i != lfs->free.pending[1]; i++) {
+        lfs_alloc_lookahead(lfs, i % lfs->cfg->block_count);
+    }
+
+    // and neither is anything from the erase-ahead pool
+    for (lfs_size_t i = 0; i < lfs->free.ecount; i++) {
+        lfs_alloc_lookahead(lfs, lfs->free.erased[i]);
+    }
+
+    lfs->free.mapped = lfs_alloc_ismap(lfs);
+}
+
+static int lfs_alloc_scan(lfs_t *lfs) {
+    // find mask of free blocks from tree
+    memset(lfs->free.buffer, 0, lfs->cfg->lookahead/8);
+    int err = lfs_traverse(lfs, lfs_alloc_lookahead, lfs);
+    if (err) {
+        return err;
+    }
+
+    lfs_alloc_scanned(lfs);
+    return 0;
+}
+
+static int lfs_alloc_next(lfs_t *lfs, lfs_block_t *block) {
+    // a lookahead that is only partially filled can't be trusted yet
+    if (lfs->gc.state == LFS_GC_SCAN) {
+        int err = lfs_alloc_scan(lfs);
+        if (err) {
+            return err;
+        }
+
+        lfs->gc.state = LFS_GC_IDLE;
+    }
+
+    bool rescanned = false;
+
+    while (true) {
+        while (true) {
+            // check if we have looked at all blocks since last ack
+            if (lfs->free.begin + lfs->free.off == lfs->free.end) {
+                if (!lfs->free.mapped || rescanned) {
+                    LFS_WARN("No more free space %ld", lfs->free.end);
+                    return LFS_ERR_NOSPC;
+                }
+
+                // the free map may be missing frees we did not track,
+                // rebuild it before giving up
+                int err = lfs_alloc_scan(lfs);
+                if (err) {
+                    return err;
+                }
+
+                lfs_size_t count = lfs_alloc_count(lfs,
+                        0, lfs->cfg->block_count);
+                LFS_DEBUG("Rescanned free map, %ld free", count);
+                if (count == 0) {
+                    LFS_WARN("No more free space %ld", lfs->free.end);
+                    return LFS_ERR_NOSPC;
+                }
+
+                lfs->free.end = lfs->free.begin + lfs->free.off
+                        + lfs->cfg->block_count;
+                rescanned = true;
+            }
+
+            if (lfs->free.off >= lfs_min(
+                    lfs->cfg->lookahead, lfs->cfg->block_count)) {
+                break;
+            }
+
+            // don't look past the last ack
+            lfs_block_t size = lfs_min(
+                    lfs_min(lfs->cfg->lookahead, lfs->cfg->block_count),
+                    lfs->free.end - lfs->free.begin);
+            lfs_block_t off = lfs_alloc_find(lfs, lfs->free.off, size);
+            lfs->free.off = lfs_min(off + 1, size);
+
+            if (off < size) {
+                // found a free block
+                if (lfs->free.mapped) {
+                    lfs->free.buffer[off / 32] |= 1U << (off % 32);
+                }
+
+                if (lfs->free.pending[0] == lfs->free.pending[1]) {
+                    lfs->free.pending[0] = lfs->free.begin + off;
+                }
+                lfs->free.pending[1] = lfs->free.begin + off + 1;
+
+                *block = (lfs->free.begin + off) % lfs->cfg->block_count;
                 return 0;
             }
         }
@@ -312,17 +967,143 @@ static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
         lfs->free.begin += lfs_min(lfs->cfg->lookahead, lfs->cfg->block_count);
         lfs->free.off = 0;
 
-        // find mask of free blocks from tree
-        memset(lfs->free.buffer, 0, lfs->cfg->lookahead/8);
-        int err = lfs_traverse(lfs, lfs_alloc_lookahead, lfs);
+        // a free map only needs to wrap around
+        if (lfs->free.mapped) {
+            continue;
+        }
+
+        int err = lfs_alloc_scan(lfs);
         if (err) {
             return err;
         }
     }
 }
 
+static int lfs_alloc_after(lfs_t *lfs, lfs_block_t prev,
+        lfs_block_t *block) {
+    // a checkpoint may vouch for erased blocks, which only holds until we
+    // start programming them, so it has to go before anything is written
+    if (lfs->checkpointed && lfs->emap) {
+        int err = lfs_checkpoint_clear(lfs);
+        if (err) {
+            return err;
+        }
+    }
+
+    if (prev != 0xffffffff) {
+        // extents want the block right after prev, which is usually what
+        // the lookahead finds next, so only take it from the pool if the
+        // pool happens to hold it
+        lfs_block_t next = (prev + 1) % lfs->cfg->block_count;
+        for (lfs_size_t i = 0; i < lfs->free.eready; i++) {
+            if (lfs->free.erased[i] == next) {
+                lfs->free.erased[i] =
+                        lfs->free.erased[lfs->free.eready-1];
+                lfs->free.erased[lfs->free.eready-1] = next;
+                break;
+            }
+        }
+
+        if (lfs->free.eready == 0 ||
+                lfs->free.erased[lfs->free.eready-1] != next) {
+            int err = lfs_alloc_next(lfs, block);
+            if (err != LFS_ERR_NOSPC || lfs->free.eready == 0) {
+                return err;
+            }
+        }
+    }
+
+    // hand out blocks we've already erased first, the erase-ahead pool
+    // is kept as [ready | handed out, still erased | handed out] blocks,
+    // everything handed out is remembered until the next ack
+    if (lfs->free.eready > 0) {
+        lfs->free.eready -= 1;
+        *block = lfs->free.erased[lfs->free.eready];
+        return 0;
+    }
+
+    return lfs_alloc_next(lfs, block);
+}
+
+static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
+    return lfs_alloc_after(lfs, 0xffffffff, block);
+}
+
+static bool lfs_alloc_iserased(lfs_t *lfs, lfs_block_t block) {
+    for (lfs_size_t i = lfs->free.eready; i < lfs->free.eclean; i++) {
+        if (lfs->free.erased[i] == block) {
+            lfs->free.eclean -= 1;
+            lfs->free.erased[i] = lfs->free.erased[lfs->free.eclean];
+            lfs->free.erased[lfs->free.eclean] = block;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool lfs_alloc_canerase(lfs_t *lfs) {
+    // room in the erase-ahead pool and free blocks to fill it with
+    return lfs->free.eready < lfs->cfg->erase_ahead &&
+            lfs->free.ecount < 2*lfs->cfg->erase_ahead &&
+            lfs->free.begin + lfs->free.off != lfs->free.end;
+}
+
+static int lfs_alloc_erase(lfs_t *lfs) {
+    // erase a free block ahead of time for the erase-ahead pool
+    lfs_block_t block;
+    int err = lfs_alloc_next(lfs, &block);
+    if (err) {
+        return err;
+    }
+
+    err = lfs_bd_erase(lfs, block);
+    if (err) {
+        // leave bad blocks for whoever finds them next
+        return (err == LFS_ERR_CORRUPT) ? 0 : err;
+    }
+
+    lfs_block_t *erased = lfs->free.erased;
+    erased[lfs->free.ecount] = erased[lfs->free.eclean];
+    erased[lfs->free.eclean] = erased[lfs->free.eready];
+    erased[lfs->free.eready] = block;
+    lfs->free.eready += 1;
+    lfs->free.eclean += 1;
+    lfs->free.ecount += 1;
+    return 0;
+}
+
 static void lfs_alloc_ack(lfs_t *lfs) {
     lfs->free.end = lfs->free.begin + lfs->free.off + lfs->cfg->block_count;
+    lfs->free.pending[0] = lfs->free.begin + lfs->free.off;
+    lfs->free.pending[1] = lfs->free.begin + lfs->free.off;
+    lfs->free.eclean = lfs->free.eready;
+    lfs->free.ecount = lfs->free.eready;
+}
+
+static int lfs_alloc_release(lfs_t *lfs, const lfs_entry_t *entry) {
+    // blocks we know are no longer referenced can go right back into
+    // the free map, otherwise they're found on the next scan, as are
+    // pack blocks, which other files may still share, and extents,
+    // which are no longer around once their entry is gone
+    if (!lfs->free.mapped) {
+        return 0;
+    }
+
+    if ((0x70 & entry->d.type) == (0x70 & LFS_TYPE_REG)) {
+        int err = lfs_ctz_traverse(lfs, &lfs->rcache, NULL,
+                entry->d.u.file.head, entry->d.u.file.size,
+                lfs_alloc_free, lfs);
+        if (err) {
+            return err;
+        }
+    } else if ((0x70 & entry->d.type) == (0x70 & LFS_TYPE_DIR)) {
+        lfs_alloc_free(lfs, entry->d.u.dir[0]);
+        lfs_alloc_free(lfs, entry->d.u.dir[1]);
+    }
+
+    // open files may still share some of these blocks
+    return lfs_traverse_files(lfs, lfs_alloc_lookahead, lfs);
 }
 
 
@@ -355,162 +1136,672 @@ static inline lfs_size_t lfs_entry_size(const lfs_entry_t *entry) {
     return 4 + entry->d.elen + entry->d.alen + entry->d.nlen;
 }
 
-static int lfs_dir_alloc(lfs_t *lfs, lfs_dir_t *dir) {
-    // allocate pair of dir blocks
-    for (int i = 0; i < 2; i++) {
-        int err = lfs_alloc(lfs, &dir->pair[i]);
-        if (err) {
-            return err;
+static inline lfs_off_t lfs_entry_name(const lfs_entry_t *entry) {
+    return entry->off + 4+entry->d.elen+entry->d.alen;
+}
+
+static inline lfs_size_t lfs_entry_isize(const lfs_entry_t *entry) {
+    // size of any inline data or pack offset following the file struct
+    return entry->d.elen - (sizeof(entry->d)-4);
+}
+
+static uint32_t lfs_name_hash(const void *name, lfs_size_t len) {
+    uint32_t hash = 0xffffffff;
+    lfs_crc(&hash, name, len);
+    return hash;
+}
+
+static void lfs_log_mark(lfs_t *lfs, lfs_block_t block, lfs_off_t end) {
+    // remember where we stopped writing to a block, most recent first
+    int i = 0;
+    while (i < LFS_LOGS-1 && lfs->logs[i].block != block) {
+        i += 1;
+    }
+
+    memmove(&lfs->logs[1], &lfs->logs[0], i*sizeof(lfs_log_t));
+    lfs->logs[0].block = block;
+    lfs->logs[0].end = end;
+}
+
+static void lfs_log_drop(lfs_t *lfs, lfs_block_t block) {
+    for (int i = 0; i < LFS_LOGS; i++) {
+        if (lfs->logs[i].block == block) {
+            lfs->logs[i].block = 0xffffffff;
+        }
+    }
+}
+
+static bool lfs_log_isclean(lfs_t *lfs, lfs_block_t block, lfs_off_t end) {
+    // only space we erased and haven't written to since can take a
+    // commit, anything past the last commit after a remount may have
+    // been partially programmed when power was lost
+    for (int i = 0; i < LFS_LOGS; i++) {
+        if (lfs->logs[i].block == block) {
+            return lfs->logs[i].end == end;
         }
     }
 
-    // rather than clobbering one of the blocks we just pretend
-    // the revision may be valid
-    int err = lfs_bd_read(lfs, dir->pair[0], 0, &dir->d.rev, 4);
+    return false;
+}
+
+static inline lfs_off_t lfs_log_align(lfs_t *lfs, lfs_off_t off) {
+    // commits start on a fresh program line, the rest of the line
+    // before them is programmed along with whatever came before
+    return off + (lfs->cfg->prog_size - (off % lfs->cfg->prog_size))
+            % lfs->cfg->prog_size;
+}
+
+static int lfs_dir_scan(lfs_t *lfs, lfs_block_t block,
+        struct lfs_disk_dir *d, lfs_off_t *end, uint32_t *crc) {
+    // returns true if the block holds a valid dir, along with the dir's
+    // state after any commits appended to it
+    int err = lfs_bd_read(lfs, block, 0, d, sizeof(*d));
     if (err) {
         return err;
     }
 
-    // set defaults
-    dir->d.rev += 1;
-    dir->d.size = sizeof(dir->d)+4;
-    dir->d.tail[0] = 0xffffffff;
-    dir->d.tail[1] = 0xffffffff;
-    dir->off = sizeof(dir->d);
+    lfs_size_t size = 0x7fffffff & d->size;
+    if (size < sizeof(*d)+4 || size > lfs->cfg->block_size) {
+        return false;
+    }
 
-    // don't write out yet, let caller take care of that
-    return 0;
-}
+    *crc = 0xffffffff;
+    lfs_crc(crc, d, sizeof(*d));
+    err = lfs_bd_crc(lfs, block, sizeof(*d), size - sizeof(*d), crc);
+    if (err) {
+        return err;
+    }
 
-static int lfs_dir_fetch(lfs_t *lfs,
-        lfs_dir_t *dir, const lfs_block_t pair[2]) {
-    // copy out pair, otherwise may be aliasing dir
-    const lfs_block_t tpair[2] = {pair[0], pair[1]};
-    bool valid = false;
+    if (*crc != 0) {
+        return false;
+    }
 
-    // check both blocks for the most recent revision
-    for (int i = 0; i < 2; i++) {
-        struct lfs_disk_dir test;
-        int err = lfs_bd_read(lfs, tpair[i], 0, &test, sizeof(test));
-        if (err) {
-            return err;
+    // the stored crc seeds the first appended commit
+    err = lfs_bd_read(lfs, block, size-4, crc, 4);
+    if (err) {
+        return err;
+    }
+
+    *end = size;
+    while (true) {
+        struct lfs_disk_delta delta;
+        lfs_off_t off = lfs_log_align(lfs, *end);
+        if (off + sizeof(delta)+4 > lfs->cfg->block_size) {
+            return true;
         }
 
-        if (valid && lfs_scmp(test.rev, dir->d.rev) < 0) {
-            continue;
+        err = lfs_bd_read(lfs, block, off, &delta, sizeof(delta));
+        if (err) {
+            return err;
         }
 
-        if ((0x7fffffff & test.size) < sizeof(test)+4 ||
-            (0x7fffffff & test.size) > lfs->cfg->block_size) {
-            continue;
+        // the log ends at the first commit that doesn't follow on
+        if (delta.rev != d->rev + 1 ||
+                (0x7fffffff & delta.size) != size ||
+                delta.len < sizeof(delta)+4 ||
+                delta.len > lfs->cfg->block_size - off) {
+            return true;
         }
 
-        uint32_t crc = 0xffffffff;
-        lfs_crc(&crc, &test, sizeof(test));
-        err = lfs_bd_crc(lfs, tpair[i], sizeof(test),
-                (0x7fffffff & test.size) - sizeof(test), &crc);
+        uint32_t dcrc = *crc;
+        lfs_crc(&dcrc, &delta, sizeof(delta));
+        err = lfs_bd_crc(lfs, block, off + sizeof(delta),
+                delta.len - sizeof(delta), &dcrc);
         if (err) {
             return err;
         }
 
-        if (crc != 0) {
-            continue;
+        if (dcrc != 0) {
+            return true;
         }
 
-        valid = true;
-
-        // setup dir in case it's valid
-        dir->pair[0] = tpair[(i+0) % 2];
-        dir->pair[1] = tpair[(i+1) % 2];
-        dir->off = sizeof(dir->d);
-        dir->d = test;
-    }
+        err = lfs_bd_read(lfs, block, off + delta.len-4, crc, 4);
+        if (err) {
+            return err;
+        }
 
-    if (!valid) {
-        LFS_ERROR("Corrupted dir pair at %ld %ld", tpair[0], tpair[1]);
-        return LFS_ERR_CORRUPT;
+        d->rev = delta.rev;
+        d->size = delta.size;
+        d->tail[0] = delta.tail[0];
+        d->tail[1] = delta.tail[1];
+        *end = off + delta.len;
     }
-
-    return 0;
 }
 
-struct lfs_region {
-    lfs_off_t oldoff;
-    lfs_size_t oldlen;
-    const void *newdata;
-    lfs_size_t newlen;
-};
-
-static int lfs_dir_commit(lfs_t *lfs, lfs_dir_t *dir,
-        const struct lfs_region *regions, int count) {
-    // increment revision count
-    dir->d.rev += 1;
+static inline bool lfs_dir_haslog(const lfs_dir_t *dir) {
+    return dir->lend > (0x7fffffff & dir->d.size);
+}
 
-    // keep pairs in order such that pair[0] is most recent
-    lfs_pairswap(dir->pair);
-    for (int i = 0; i < count; i++) {
-        dir->d.size += regions[i].newlen - regions[i].oldlen;
+static int lfs_dir_patch(lfs_t *lfs, const lfs_dir_t *dir,
+        lfs_off_t off, lfs_size_t size, uint8_t *buffer, lfs_off_t *next) {
+    // replay the patches of appended commits over a region, later patches
+    // land on top of earlier ones, next is set to the first patched offset
+    // at or after off
+    if (next) {
+        *next = lfs->cfg->block_size;
     }
 
-    const lfs_block_t oldpair[2] = {dir->pair[0], dir->pair[1]};
-    bool relocated = false;
+    lfs_off_t doff = 0x7fffffff & dir->d.size;
+    while (doff < dir->lend) {
+        struct lfs_disk_delta delta;
+        doff = lfs_log_align(lfs, doff);
+        int err = lfs_bd_read(lfs, dir->pair[0], doff, &delta, sizeof(delta));
+        if (err) {
+            return err;
+        }
 
-    while (true) {
-        if (true) {
-            int err = lfs_bd_erase(lfs, dir->pair[0]);
+        lfs_off_t poff = doff + sizeof(delta);
+        while (poff < doff + delta.len-4) {
+            struct lfs_disk_patch patch;
+            int err = lfs_bd_read(lfs, dir->pair[0], poff,
+                    &patch, sizeof(patch));
             if (err) {
-                if (err == LFS_ERR_CORRUPT) {
-                    goto relocate;
-                }
                 return err;
             }
+            poff += sizeof(patch);
 
-            uint32_t crc = 0xffffffff;
-            lfs_crc(&crc, &dir->d, sizeof(dir->d));
-            err = lfs_bd_prog(lfs, dir->pair[0], 0, &dir->d, sizeof(dir->d));
-            if (err) {
-                if (err == LFS_ERR_CORRUPT) {
-                    goto relocate;
+            if (next && patch.off + patch.len > off) {
+                *next = lfs_min(*next, lfs_max(patch.off, off));
+            }
+
+            lfs_off_t begin = lfs_max(patch.off, off);
+            lfs_off_t end = lfs_min(patch.off + patch.len, off + size);
+            if (buffer && begin < end) {
+                int err = lfs_bd_read(lfs, dir->pair[0],
+                        poff + (begin - patch.off),
+                        &buffer[begin - off], end - begin);
+                if (err) {
+                    return err;
                 }
-                return err;
             }
 
-            int i = 0;
-            lfs_off_t oldoff = sizeof(dir->d);
-            lfs_off_t newoff = sizeof(dir->d);
-            while (newoff < (0x7fffffff & dir->d.size)-4) {
-                if (i < count && regions[i].oldoff == oldoff) {
-                    lfs_crc(&crc, regions[i].newdata, regions[i].newlen);
-                    int err = lfs_bd_prog(lfs, dir->pair[0],
-                            newoff, regions[i].newdata, regions[i].newlen);
-                    if (err) {
-                        if (err == LFS_ERR_CORRUPT) {
-                            goto relocate;
-                        }
-                        return err;
-                    }
+            poff += patch.len;
+        }
 
-                    oldoff += regions[i].oldlen;
-                    newoff += regions[i].newlen;
-                    i += 1;
-                } else {
-                    uint8_t data;
-                    int err = lfs_bd_read(lfs, oldpair[1], oldoff, &data, 1);
-                    if (err) {
-                        return err;
-                    }
+        doff += delta.len;
+    }
 
-                    lfs_crc(&crc, &data, 1);
-                    err = lfs_bd_prog(lfs, dir->pair[0], newoff, &data, 1);
-                    if (err) {
+    return 0;
+}
+
+static int lfs_dir_get(lfs_t *lfs, const lfs_dir_t *dir,
+        lfs_off_t off, void *buffer, lfs_size_t size) {
+    int err = lfs_bd_read(lfs, dir->pair[0], off, buffer, size);
+    if (err || !lfs_dir_haslog(dir)) {
+        return err;
+    }
+
+    return lfs_dir_patch(lfs, dir, off, size, buffer, NULL);
+}
+
+static int lfs_dir_cmp(lfs_t *lfs, const lfs_dir_t *dir,
+        lfs_off_t off, const void *buffer, lfs_size_t size) {
+    if (!lfs_dir_haslog(dir)) {
+        return lfs_bd_cmp(lfs, dir->pair[0], off, buffer, size);
+    }
+
+    // compare a chunk at a time with any patches applied
+    const uint8_t *data = buffer;
+    while (size > 0) {
+        uint8_t dat[32];
+        lfs_size_t diff = lfs_min(size, sizeof(dat));
+        int err = lfs_dir_get(lfs, dir, off, dat, diff);
+        if (err) {
+            return err;
+        }
+
+        if (memcmp(dat, data, diff) != 0) {
+            return false;
+        }
+
+        data += diff;
+        off += diff;
+        size -= diff;
+    }
+
+    return true;
+}
+
+static int lfs_entry_hash(lfs_t *lfs, const lfs_dir_t *dir,
+        const lfs_entry_t *entry, uint32_t *hash) {
+    // entries written since v1.2 lead their attributes with the lower
+    // 16 bits of their name's hash, older entries have no attributes
+    if (entry->d.alen < 3) {
+        return false;
+    }
+
+    uint8_t attr[3];
+    int err = lfs_dir_get(lfs, dir, entry->off + 4+entry->d.elen,
+            attr, sizeof(attr));
+    if (err) {
+        return err;
+    }
+
+    if (attr[0] != LFS_ATTR_HASH) {
+        return false;
+    }
+
+    *hash = attr[1] | ((uint32_t)attr[2] << 8);
+    return true;
+}
+
+static int lfs_dir_alloc(lfs_t *lfs, lfs_dir_t *dir) {
+    // allocate pair of dir blocks
+    for (int i = 0; i < 2; i++) {
+        int err = lfs_alloc(lfs, &dir->pair[i]);
+        if (err) {
+            return err;
+        }
+    }
+
+    // rather than clobbering one of the blocks we just pretend
+    // the revision may be valid, counting any commits appended to it
+    lfs_off_t end;
+    uint32_t crc;
+    int res = lfs_dir_scan(lfs, dir->pair[0], &dir->d, &end, &crc);
+    if (res < 0) {
+        return res;
+    }
+
+    // set defaults
+    dir->d.rev += 1;
+    dir->d.size = sizeof(dir->d)+4;
+    dir->d.tail[0] = 0xffffffff;
+    dir->d.tail[1] = 0xffffffff;
+    dir->off = sizeof(dir->d);
+    dir->lend = 0;
+
+    // don't write out yet, let caller take care of that
+    return 0;
+}
+
+static int lfs_dir_fetch(lfs_t *lfs,
+        lfs_dir_t *dir, const lfs_block_t pair[2]) {
+    // copy out pair, otherwise may be aliasing dir
+    const lfs_block_t tpair[2] = {pair[0], pair[1]};
+    bool valid = false;
+
+    // check both blocks for the most recent revision
+    for (int i = 0; i < 2; i++) {
+        struct lfs_disk_dir test;
+        lfs_off_t end;
+        uint32_t crc;
+        int res = lfs_dir_scan(lfs, tpair[i], &test, &end, &crc);
+        if (res < 0) {
+            return res;
+        }
+
+        if (!res || (valid && lfs_scmp(test.rev, dir->d.rev) < 0)) {
+            continue;
+        }
+
+        valid = true;
+
+        // setup dir in case it's valid
+        dir->pair[0] = tpair[(i+0) % 2];
+        dir->pair[1] = tpair[(i+1) % 2];
+        dir->off = sizeof(dir->d);
+        dir->lend = end;
+        dir->lcrc = crc;
+        dir->d = test;
+    }
+
+    if (!valid) {
+        LFS_ERROR("Corrupted dir pair at %ld %ld", tpair[0], tpair[1]);
+        return LFS_ERR_CORRUPT;
+    }
+
+    return 0;
+}
+
+struct lfs_region {
+    lfs_off_t oldoff;
+    lfs_size_t oldlen;
+    const void *newdata;
+    lfs_size_t newlen;
+};
+
+static int lfs_lookup_find(lfs_t *lfs, const lfs_block_t parent[2],
+        const char *name, lfs_size_t len, uint32_t hash,
+        lfs_dir_t *dir, lfs_entry_t *entry) {
+    for (lfs_size_t i = 0; i < lfs->lcount; i++) {
+        lfs_lookup_t *l = &lfs->lookups[i];
+        if (l->hash != hash || l->entry.d.nlen != len ||
+                l->dir.off == 0 || lfs_paircmp(l->parent, parent) != 0) {
+            continue;
+        }
+
+        // hashes can collide, confirm the name on disk
+        int res = lfs_dir_cmp(lfs, &l->dir,
+                lfs_entry_name(&l->entry), name, len);
+        if (res < 0) {
+            return res;
+        }
+
+        if (res) {
+            // move to front
+            lfs_lookup_t found = *l;
+            memmove(&lfs->lookups[1], &lfs->lookups[0], i*sizeof(*l));
+            lfs->lookups[0] = found;
+
+            *dir = found.dir;
+            *entry = found.entry;
+            lfs->lstats.hit_count += 1;
+            return true;
+        }
+    }
+
+    lfs->lstats.miss_count += 1;
+    return false;
+}
+
+static void lfs_lookup_insert(lfs_t *lfs, const lfs_block_t parent[2],
+        uint32_t hash, const lfs_dir_t *dir, const lfs_entry_t *entry) {
+    if (!lfs->cfg->lookup_cache) {
+        return;
+    }
+
+    // evict least recently used if full
+    if (lfs->lcount < lfs->cfg->lookup_cache) {
+        lfs->lcount += 1;
+    }
+
+    memmove(&lfs->lookups[1], &lfs->lookups[0],
+            (lfs->lcount-1)*sizeof(lfs_lookup_t));
+    lfs->lookups[0] = (lfs_lookup_t){
+        .parent = {parent[0], parent[1]},
+        .hash = hash,
+        .dir = *dir,
+        .entry = *entry,
+    };
+}
+
+static void lfs_lookup_drop(lfs_t *lfs, const lfs_block_t pair[2]) {
+    lfs_size_t j = 0;
+    for (lfs_size_t i = 0; i < lfs->lcount; i++) {
+        if (lfs_paircmp(lfs->lookups[i].dir.pair, pair) != 0) {
+            lfs->lookups[j++] = lfs->lookups[i];
+        }
+    }
+
+    lfs->lcount = j;
+}
+
+static void lfs_lookup_stage(lfs_t *lfs, const lfs_block_t pair[2]) {
+    // hide lookups into a dir while it is being committed, they
+    // are only brought back once the commit is known to be good
+    for (lfs_size_t i = 0; i < lfs->lcount; i++) {
+        if (lfs_paircmp(lfs->lookups[i].dir.pair, pair) == 0) {
+            lfs->lookups[i].dir.off = 0;
+        }
+    }
+}
+
+static void lfs_lookup_commit(lfs_t *lfs, const lfs_dir_t *dir,
+        const struct lfs_region *regions, int count) {
+    lfs_size_t j = 0;
+    for (lfs_size_t i = 0; i < lfs->lcount; i++) {
+        lfs_lookup_t *l = &lfs->lookups[i];
+        if (l->dir.off != 0 || lfs_paircmp(l->dir.pair, dir->pair) != 0) {
+            lfs->lookups[j++] = *l;
+            continue;
+        }
+
+        // shift entry over any regions before it, an update that
+        // rewrites only the entry itself is applied in place, any
+        // other change to the entry drops it
+        lfs_off_t off = l->entry.off;
+        lfs_size_t size = lfs_entry_size(&l->entry);
+        bool valid = true;
+        for (int k = 0; k < count && valid; k++) {
+            const struct lfs_region *r = &regions[k];
+            if (r->oldoff == l->entry.off &&
+                    r->oldlen == sizeof(l->entry.d) &&
+                    r->newlen == sizeof(l->entry.d)) {
+                memcpy(&l->entry.d, r->newdata, sizeof(l->entry.d));
+                valid = (!(l->entry.d.type & 0x80) &&
+                        lfs_entry_size(&l->entry) == size);
+            } else if (r->oldlen == r->newlen &&
+                    r->oldoff >= l->entry.off + sizeof(l->entry.d) &&
+                    r->oldoff + r->oldlen <= l->entry.off+4 + l->entry.d.elen) {
+                // inline data rewritten in place, nothing cached changes
+            } else if (r->oldoff + r->oldlen <= l->entry.off) {
+                off += r->newlen - r->oldlen;
+            } else if (r->oldoff < l->entry.off + size) {
+                valid = false;
+            }
+        }
+
+        if (valid) {
+            l->entry.off = off;
+            l->dir.pair[0] = dir->pair[0];
+            l->dir.pair[1] = dir->pair[1];
+            l->dir.d = dir->d;
+            l->dir.lend = dir->lend;
+            l->dir.lcrc = dir->lcrc;
+            l->dir.off = off + size;
+            lfs->lookups[j++] = *l;
+        }
+    }
+
+    lfs->lcount = j;
+}
+
+static int lfs_dir_delta(lfs_t *lfs, lfs_dir_t *dir,
+        const struct lfs_region *regions, int count) {
+    // appends a commit to the end of the current block, returns true if
+    // the commit was appended, or false if the pair needs rewriting
+    if (lfs->version < 0x00020000 || !dir->lend ||
+            !lfs_log_isclean(lfs, dir->pair[0], dir->lend)) {
+        return false;
+    }
+
+    // only regions that overwrite bytes in place can be patched
+    struct lfs_disk_delta delta = {
+        .rev = dir->d.rev + 1,
+        .size = dir->d.size,
+        .tail = {dir->d.tail[0], dir->d.tail[1]},
+        .len = sizeof(delta)+4,
+    };
+    for (int i = 0; i < count; i++) {
+        if (regions[i].oldlen != regions[i].newlen) {
+            return false;
+        }
+
+        if (regions[i].newlen) {
+            delta.len += sizeof(struct lfs_disk_patch) + regions[i].newlen;
+        }
+    }
+
+    lfs_off_t off = lfs_log_align(lfs, dir->lend);
+    if (off + delta.len > lfs->cfg->block_size) {
+        return false;
+    }
+
+    uint32_t crc = dir->lcrc;
+    lfs_crc(&crc, &delta, sizeof(delta));
+    int err = lfs_bd_prog(lfs, dir->pair[0], off, &delta, sizeof(delta));
+    lfs_off_t poff = off + sizeof(delta);
+    for (int i = 0; i < count && !err; i++) {
+        if (!regions[i].newlen) {
+            continue;
+        }
+
+        struct lfs_disk_patch patch = {regions[i].oldoff, regions[i].newlen};
+        lfs_crc(&crc, &patch, sizeof(patch));
+        lfs_crc(&crc, regions[i].newdata, regions[i].newlen);
+        err = lfs_bd_prog(lfs, dir->pair[0], poff, &patch, sizeof(patch));
+        if (!err) {
+            err = lfs_bd_prog(lfs, dir->pair[0], poff + sizeof(patch),
+                    regions[i].newdata, regions[i].newlen);
+        }
+
+        poff += sizeof(patch) + regions[i].newlen;
+    }
+
+    if (!err) {
+        err = lfs_bd_prog(lfs, dir->pair[0], poff, &crc, 4);
+    }
+
+    if (!err) {
+        err = lfs_bd_sync(lfs);
+    }
+
+    // make sure the commit made it
+    uint32_t check = dir->lcrc;
+    if (!err) {
+        err = lfs_bd_crc(lfs, dir->pair[0], off, delta.len, &check);
+    }
+
+    if (err || check != 0) {
+        // whatever we wrote is in the way of further commits, anything
+        // but a bad block is reported, otherwise fall back to rewriting
+        lfs_log_drop(lfs, dir->pair[0]);
+        lfs->pcache.block = 0xffffffff;
+        return (err && err != LFS_ERR_CORRUPT) ? err : false;
+    }
+
+    dir->d.rev = delta.rev;
+    dir->lend = off + delta.len;
+    dir->lcrc = crc;
+    lfs_log_mark(lfs, dir->pair[0], dir->lend);
+    return true;
+}
+
+static int lfs_dir_commit(lfs_t *lfs, lfs_dir_t *dir,
+        const struct lfs_region *regions, int count) {
+    // a checkpoint no longer holds once anything outside it changes
+    if (lfs->checkpointed &&
+            lfs_paircmp(dir->pair, (const lfs_block_t[2]){0, 1}) != 0) {
+        int err = lfs_checkpoint_clear(lfs);
+        if (err) {
+            return err;
+        }
+    }
+
+    lfs_lookup_stage(lfs, dir->pair);
+    lfs->moves.valid = false;
+    lfs->gen += 1;
+
+    // small in-place updates are appended to the current block
+    int res = lfs_dir_delta(lfs, dir, regions, count);
+    if (res < 0) {
+        return res;
+    }
+
+    if (res) {
+        lfs_lookup_commit(lfs, dir, regions, count);
+        return 0;
+    }
+
+    // otherwise rewrite the pair's other block, patches appended to
+    // the current block are folded in as its contents are copied
+    const lfs_dir_t olddir = *dir;
+
+    // increment revision count
+    dir->d.rev += 1;
+
+    // keep pairs in order such that pair[0] is most recent
+    lfs_pairswap(dir->pair);
+    for (int i = 0; i < count; i++) {
+        dir->d.size += regions[i].newlen - regions[i].oldlen;
+    }
+
+    const lfs_block_t oldpair[2] = {dir->pair[0], dir->pair[1]};
+    bool relocated = false;
+
+    while (true) {
+        if (true) {
+            int err = lfs_bd_erase(lfs, dir->pair[0]);
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+
+            uint32_t crc = 0xffffffff;
+            lfs_crc(&crc, &dir->d, sizeof(dir->d));
+            err = lfs_bd_prog(lfs, dir->pair[0], 0, &dir->d, sizeof(dir->d));
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+
+            int i = 0;
+            lfs_off_t oldoff = sizeof(dir->d);
+            lfs_off_t newoff = sizeof(dir->d);
+            while (newoff < (0x7fffffff & dir->d.size)-4) {
+                if (i < count && regions[i].oldoff == oldoff) {
+                    lfs_crc(&crc, regions[i].newdata, regions[i].newlen);
+                    int err = lfs_bd_prog(lfs, dir->pair[0],
+                            newoff, regions[i].newdata, regions[i].newlen);
+                    if (err) {
+                        if (err == LFS_ERR_CORRUPT) {
+                            goto relocate;
+                        }
+                        return err;
+                    }
+
+                    oldoff += regions[i].oldlen;
+                    newoff += regions[i].newlen;
+                    i += 1;
+                } else {
+                    // copy everything up to the next region as is
+                    lfs_size_t diff = (0x7fffffff & dir->d.size)-4 - newoff;
+                    if (i < count) {
+                        diff = lfs_min(diff, regions[i].oldoff - oldoff);
+                    }
+
+                    if (lfs_dir_haslog(&olddir)) {
+                        // patched bytes go through a buffer
+                        lfs_off_t next;
+                        int err = lfs_dir_patch(lfs, &olddir,
+                                oldoff, 0, NULL, &next);
+                        if (err) {
+                            return err;
+                        }
+
+                        if (next == oldoff) {
+                            uint8_t dat[32];
+                            diff = lfs_min(diff, sizeof(dat));
+                            err = lfs_dir_get(lfs, &olddir,
+                                    oldoff, dat, diff);
+                            if (err) {
+                                return err;
+                            }
+
+                            lfs_crc(&crc, dat, diff);
+                            err = lfs_bd_prog(lfs, dir->pair[0],
+                                    newoff, dat, diff);
+                            if (err) {
+                                if (err == LFS_ERR_CORRUPT) {
+                                    goto relocate;
+                                }
+                                return err;
+                            }
+
+                            oldoff += diff;
+                            newoff += diff;
+                            continue;
+                        }
+
+                        diff = lfs_min(diff, next - oldoff);
+                    }
+
+                    int err = lfs_bd_copy(lfs, dir->pair[0], newoff,
+                            oldpair[1], oldoff, diff, &crc);
+                    if (err) {
                         if (err == LFS_ERR_CORRUPT) {
                             goto relocate;
                         }
                         return err;
                     }
 
-                    oldoff += 1;
-                    newoff += 1;
+                    oldoff += diff;
+                    newoff += diff;
                 }
             }
 
@@ -521,6 +1812,7 @@ static int lfs_dir_commit(lfs_t *lfs, lfs_dir_t *dir,
                 }
                 return err;
             }
+            dir->lcrc = crc;
 
             err = lfs_bd_sync(lfs);
             if (err) {
@@ -539,6 +1831,10 @@ static int lfs_dir_commit(lfs_t *lfs, lfs_dir_t *dir,
             }
 
             if (crc == 0) {
+                // further commits can go after this one
+                dir->lend = 0x7fffffff & dir->d.size;
+                lfs_log_mark(lfs, dir->pair[0], dir->lend);
+                lfs_log_drop(lfs, dir->pair[1]);
                 break;
             }
         }
@@ -571,6 +1867,7 @@ relocate:
         return lfs_relocate(lfs, oldpair, dir->pair);
     }
 
+    lfs_lookup_commit(lfs, dir, regions, count);
     return 0;
 }
 
@@ -578,20 +1875,28 @@ static int lfs_dir_update(lfs_t *lfs, lfs_dir_t *dir,
         const lfs_entry_t *entry, const void *data) {
     return lfs_dir_commit(lfs, dir, (struct lfs_region[]){
             {entry->off, sizeof(entry->d), &entry->d, sizeof(entry->d)},
-            {entry->off+sizeof(entry->d), entry->d.nlen, data, entry->d.nlen}
+            {lfs_entry_name(entry), entry->d.nlen, data, entry->d.nlen}
         }, data ? 2 : 1);
 }
 
 static int lfs_dir_append(lfs_t *lfs, lfs_dir_t *dir,
-        lfs_entry_t *entry, const void *data) {
+        lfs_entry_t *entry, const void *buffer, const void *data) {
+    // tag entry with a hash of its name if the disk version allows it
+    uint32_t hash = lfs_name_hash(data, entry->d.nlen);
+    uint8_t attr[3] = {LFS_ATTR_HASH, 0xff & (hash >> 0),
+                                      0xff & (hash >> 8)};
+    entry->d.alen = (lfs->version >= 0x00010002) ? sizeof(attr) : 0;
+
     // check if we fit, if top bit is set we do not and move on
     while (true) {
         if (dir->d.size + lfs_entry_size(entry) <= lfs->cfg->block_size) {
             entry->off = dir->d.size - 4;
             return lfs_dir_commit(lfs, dir, (struct lfs_region[]){
                     {entry->off, 0, &entry->d, sizeof(entry->d)},
+                    {entry->off, 0, buffer, lfs_entry_isize(entry)},
+                    {entry->off, 0, attr, entry->d.alen},
                     {entry->off, 0, data, entry->d.nlen}
-                }, 2);
+                }, 4);
         }
 
         // we need to allocate a new dir block
@@ -607,8 +1912,10 @@ static int lfs_dir_append(lfs_t *lfs, lfs_dir_t *dir,
             entry->off = newdir.d.size - 4;
             err = lfs_dir_commit(lfs, &newdir, (struct lfs_region[]){
                     {entry->off, 0, &entry->d, sizeof(entry->d)},
+                    {entry->off, 0, buffer, lfs_entry_isize(entry)},
+                    {entry->off, 0, attr, entry->d.alen},
                     {entry->off, 0, data, entry->d.nlen}
-                }, 2);
+                }, 4);
             if (err) {
                 return err;
             }
@@ -616,7 +1923,14 @@ static int lfs_dir_append(lfs_t *lfs, lfs_dir_t *dir,
             dir->d.size |= 0x80000000;
             dir->d.tail[0] = newdir.pair[0];
             dir->d.tail[1] = newdir.pair[1];
-            return lfs_dir_commit(lfs, dir, NULL, 0);
+            err = lfs_dir_commit(lfs, dir, NULL, 0);
+            if (err) {
+                return err;
+            }
+
+            // hand back the block the entry ended up in
+            *dir = newdir;
+            return 0;
         }
 
         int err = lfs_dir_fetch(lfs, dir, dir->d.tail);
@@ -626,6 +1940,16 @@ static int lfs_dir_append(lfs_t *lfs, lfs_dir_t *dir,
     }
 }
 
+static void lfs_dir_shift(lfs_t *lfs, const lfs_block_t pair[2],
+        lfs_off_t off, lfs_ssize_t diff) {
+    // shift over any files whose entries follow an entry that changed size
+    for (lfs_file_t *f = lfs->files; f; f = f->next) {
+        if (lfs_paircmp(f->pair, pair) == 0 && f->poff > off) {
+            f->poff += diff;
+        }
+    }
+}
+
 static int lfs_dir_remove(lfs_t *lfs, lfs_dir_t *dir, lfs_entry_t *entry) {
     // either shift out the one entry or remove the whole dir block
     if ((dir->d.size & 0x7fffffff) == sizeof(dir->d)+4
@@ -644,7 +1968,24 @@ static int lfs_dir_remove(lfs_t *lfs, lfs_dir_t *dir, lfs_entry_t *entry) {
             pdir.d.size &= dir->d.size | 0x7fffffff;
             pdir.d.tail[0] = dir->d.tail[0];
             pdir.d.tail[1] = dir->d.tail[1];
-            return lfs_dir_commit(lfs, &pdir, NULL, 0);
+            int err = lfs_dir_commit(lfs, &pdir, NULL, 0);
+            if (err) {
+                return err;
+            }
+
+            // drop any files that referenced the removed dir block
+            for (lfs_file_t *f = lfs->files; f; f = f->next) {
+                if (lfs_paircmp(f->pair, dir->pair) == 0) {
+                    f->pair[0] = 0xffffffff;
+                    f->pair[1] = 0xffffffff;
+                }
+            }
+
+            lfs_lookup_drop(lfs, dir->pair);
+
+            return lfs_alloc_release(lfs, &(lfs_entry_t){
+                    .d.type = LFS_TYPE_DIR,
+                    .d.u.dir = {dir->pair[0], dir->pair[1]}});
         }
     } else {
         int err = lfs_dir_commit(lfs, dir, (struct lfs_region[]){
@@ -686,7 +2027,7 @@ static int lfs_dir_next(lfs_t *lfs, lfs_dir_t *dir, lfs_entry_t *entry) {
         dir->pos += sizeof(dir->d) + 4;
     }
 
-    int err = lfs_bd_read(lfs, dir->pair[0], dir->off,
+    int err = lfs_dir_get(lfs, dir, dir->off,
             &entry->d, sizeof(entry->d));
     if (err) {
         return err;
@@ -703,6 +2044,9 @@ static int lfs_dir_find(lfs_t *lfs, lfs_dir_t *dir,
     const char *pathname = *path;
     size_t pathlen;
 
+    // dirs are only fetched when a lookup misses, starting at root
+    lfs_block_t parent[2] = {lfs->root[0], lfs->root[1]};
+
     while (true) {
     nextname:
         // skip slashes
@@ -743,40 +2087,71 @@ static int lfs_dir_find(lfs_t *lfs, lfs_dir_t *dir,
         // update what we've found
         *path = pathname;
 
+        // check for a cached lookup
+        uint32_t hash = lfs_name_hash(pathname, pathlen);
+        int res = 0;
+        if (lfs->cfg->lookup_cache) {
+            res = lfs_lookup_find(lfs, parent,
+                    pathname, pathlen, hash, dir, entry);
+            if (res < 0) {
+                return res;
+            }
+        }
+
+        if (!res) {
+            int err = lfs_dir_fetch(lfs, dir, parent);
+            if (err) {
+                return err;
+            }
+        }
+
         // find path
-        while (true) {
+        while (!res) {
             int err = lfs_dir_next(lfs, dir, entry);
             if (err) {
                 return err;
             }
 
             if (((0x7f & entry->d.type) != LFS_TYPE_REG &&
+                 (0x7f & entry->d.type) != LFS_TYPE_INLINE &&
+                 (0x7f & entry->d.type) != LFS_TYPE_PACKED &&
+                 (0x7f & entry->d.type) != LFS_TYPE_EXTENT &&
                  (0x7f & entry->d.type) != LFS_TYPE_DIR) ||
                 entry->d.nlen != pathlen) {
                 continue;
             }
 
-            int res = lfs_bd_cmp(lfs, dir->pair[0],
-                    entry->off + 4+entry->d.elen+entry->d.alen,
-                    pathname, pathlen);
+            // only compare names if the hashes match
+            uint32_t ehash = 0;
+            int hashed = lfs_entry_hash(lfs, dir, entry, &ehash);
+            if (hashed < 0) {
+                return hashed;
+            }
+
+            if (hashed && ehash != (0xffff & hash)) {
+                continue;
+            }
+
+            res = lfs_dir_cmp(lfs, dir,
+                    lfs_entry_name(entry), pathname, pathlen);
             if (res < 0) {
                 return res;
             }
 
             // found match
             if (res) {
-                break;
-            }
-        }
+                // check that entry has not been moved
+                if (entry->d.type & 0x80) {
+                    int moved = lfs_moved(lfs, &entry->d.u);
+                    if (moved < 0 || moved) {
+                        return (moved < 0) ? moved : LFS_ERR_NOENT;
+                    }
 
-        // check that entry has not been moved
-        if (entry->d.type & 0x80) {
-            int moved = lfs_moved(lfs, &entry->d.u);
-            if (moved < 0 || moved) {
-                return (moved < 0) ? moved : LFS_ERR_NOENT;
+                    entry->d.type &= ~0x80;
+                } else {
+                    lfs_lookup_insert(lfs, parent, hash, dir, entry);
+                }
             }
-
-            entry->d.type &= ~0x80;
         }
 
         pathname += pathlen;
@@ -790,10 +2165,8 @@ static int lfs_dir_find(lfs_t *lfs, lfs_dir_t *dir,
             return LFS_ERR_NOTDIR;
         }
 
-        int err = lfs_dir_fetch(lfs, dir, entry->d.u.dir);
-        if (err) {
-            return err;
-        }
+        parent[0] = entry->d.u.dir[0];
+        parent[1] = entry->d.u.dir[1];
     }
 }
 
@@ -808,15 +2181,10 @@ int lfs_mkdir(lfs_t *lfs, const char *path) {
         }
     }
 
-    // fetch parent directory
+    // find parent directory
     lfs_dir_t cwd;
-    int err = lfs_dir_fetch(lfs, &cwd, lfs->root);
-    if (err) {
-        return err;
-    }
-
     lfs_entry_t entry;
-    err = lfs_dir_find(lfs, &cwd, &entry, &path);
+    int err = lfs_dir_find(lfs, &cwd, &entry, &path);
     if (err != LFS_ERR_NOENT || strchr(path, '/') != NULL) {
         return err ? err : LFS_ERR_EXISTS;
     }
@@ -839,7 +2207,6 @@ int lfs_mkdir(lfs_t *lfs, const char *path) {
 
     entry.d.type = LFS_TYPE_DIR;
     entry.d.elen = sizeof(entry.d) - 4;
-    entry.d.alen = 0;
     entry.d.nlen = strlen(path);
     entry.d.u.dir[0] = dir.pair[0];
     entry.d.u.dir[1] = dir.pair[1];
@@ -847,7 +2214,7 @@ int lfs_mkdir(lfs_t *lfs, const char *path) {
     cwd.d.tail[0] = dir.pair[0];
     cwd.d.tail[1] = dir.pair[1];
 
-    err = lfs_dir_append(lfs, &cwd, &entry, path);
+    err = lfs_dir_append(lfs, &cwd, &entry, NULL, path);
     if (err) {
         return err;
     }
@@ -860,13 +2227,13 @@ int lfs_dir_open(lfs_t *lfs, lfs_dir_t *dir, const char *path) {
     dir->pair[0] = lfs->root[0];
     dir->pair[1] = lfs->root[1];
 
-    int err = lfs_dir_fetch(lfs, dir, dir->pair);
-    if (err) {
-        return err;
-    }
-
     // check for root, can only be something like '/././../.'
     if (strspn(path, "/.") == strlen(path)) {
+        int err = lfs_dir_fetch(lfs, dir, dir->pair);
+        if (err) {
+            return err;
+        }
+
         dir->head[0] = dir->pair[0];
         dir->head[1] = dir->pair[1];
         dir->pos = sizeof(dir->d) - 2;
@@ -875,7 +2242,7 @@ int lfs_dir_open(lfs_t *lfs, lfs_dir_t *dir, const char *path) {
     }
 
     lfs_entry_t entry;
-    err = lfs_dir_find(lfs, dir, &entry, &path);
+    int err = lfs_dir_find(lfs, dir, &entry, &path);
     if (err) {
         return err;
     } else if (entry.d.type != LFS_TYPE_DIR) {
@@ -925,6 +2292,9 @@ int lfs_dir_read(lfs_t *lfs, lfs_dir_t *dir, struct lfs_info *info) {
         }
 
         if ((0x7f & entry.d.type) != LFS_TYPE_REG &&
+            (0x7f & entry.d.type) != LFS_TYPE_INLINE &&
+            (0x7f & entry.d.type) != LFS_TYPE_PACKED &&
+            (0x7f & entry.d.type) != LFS_TYPE_EXTENT &&
             (0x7f & entry.d.type) != LFS_TYPE_DIR) {
             continue;
         }
@@ -947,12 +2317,14 @@ int lfs_dir_read(lfs_t *lfs, lfs_dir_t *dir, struct lfs_info *info) {
     }
 
     info->type = entry.d.type;
-    if (info->type == LFS_TYPE_REG) {
+    if (info->type == LFS_TYPE_REG || info->type == LFS_TYPE_INLINE ||
+            info->type == LFS_TYPE_PACKED || info->type == LFS_TYPE_EXTENT) {
+        info->type = LFS_TYPE_REG;
         info->size = entry.d.u.file.size;
     }
 
-    int err = lfs_bd_read(lfs, dir->pair[0],
-            entry.off + 4+entry.d.elen+entry.d.alen,
+    int err = lfs_dir_get(lfs, dir,
+            lfs_entry_name(&entry),
             info->name, entry.d.nlen);
     if (err) {
         return err;
@@ -1018,9 +2390,23 @@ static int lfs_ctz_index(lfs_t *lfs, lfs_off_t *off) {
     return i;
 }
 
+static void lfs_ctz_remember(lfs_ctz_cursor_t *cursor,
+        lfs_off_t index, lfs_block_t block) {
+    // keep the most recently visited entries of the last lookup
+    if (cursor->count == LFS_CTZ_CURSOR) {
+        memmove(&cursor->skips[0], &cursor->skips[1],
+                (LFS_CTZ_CURSOR-1)*sizeof(cursor->skips[0]));
+        cursor->count -= 1;
+    }
+
+    cursor->skips[cursor->count].index = index;
+    cursor->skips[cursor->count].block = block;
+    cursor->count += 1;
+}
+
 static int lfs_ctz_find(lfs_t *lfs,
         lfs_cache_t *rcache, const lfs_cache_t *pcache,
-        lfs_block_t head, lfs_size_t size,
+        lfs_ctz_cursor_t *cursor, lfs_block_t head, lfs_size_t size,
         lfs_size_t pos, lfs_block_t *block, lfs_off_t *off) {
     if (size == 0) {
         *block = 0xffffffff;
@@ -1031,6 +2417,27 @@ static int lfs_ctz_find(lfs_t *lfs,
     lfs_off_t current = lfs_ctz_index(lfs, &(lfs_off_t){size-1});
     lfs_off_t target = lfs_ctz_index(lfs, &pos);
 
+    if (cursor) {
+        if (cursor->head != head) {
+            cursor->head = head;
+            cursor->count = 0;
+        }
+
+        // start from the closest entry we've already visited, the
+        // skip-list only points backwards so it must be at or above
+        // the target
+        for (lfs_size_t i = 0; i < cursor->count; i++) {
+            if (cursor->skips[i].index >= target &&
+                    cursor->skips[i].index < current) {
+                current = cursor->skips[i].index;
+                head = cursor->skips[i].block;
+            }
+        }
+
+        cursor->count = 0;
+        lfs_ctz_remember(cursor, current, head);
+    }
+
     while (current > target) {
         lfs_size_t skip = lfs_min(
                 lfs_npw2(current-target+1) - 1,
@@ -1043,6 +2450,10 @@ static int lfs_ctz_find(lfs_t *lfs,
 
         assert(head >= 2 && head <= lfs->cfg->block_count);
         current -= 1 << skip;
+
+        if (cursor) {
+            lfs_ctz_remember(cursor, current, head);
+        }
     }
 
     *block = head;
@@ -1082,22 +2493,13 @@ static int lfs_ctz_extend(lfs_t *lfs,
 
             // just copy out the last block if it is incomplete
             if (size != lfs->cfg->block_size) {
-                for (lfs_off_t i = 0; i < size; i++) {
-                    uint8_t data;
-                    int err = lfs_cache_read(lfs, rcache, NULL,
-                            head, i, &data, 1);
-                    if (err) {
-                        return err;
-                    }
-
-                    err = lfs_cache_prog(lfs, pcache, rcache,
-                            *block, i, &data, 1);
-                    if (err) {
-                        if (err == LFS_ERR_CORRUPT) {
-                            goto relocate;
-                        }
-                        return err;
+                err = lfs_cache_copy(lfs, pcache, rcache, *block, 0,
+                        rcache, NULL, head, 0, size, NULL);
+                if (err) {
+                    if (err == LFS_ERR_CORRUPT) {
+                        goto relocate;
                     }
+                    return err;
                 }
 
                 *off = size;
@@ -1138,6 +2540,44 @@ relocate:
 
         // just clear cache and try a new block
         pcache->block = 0xffffffff;
+        lfs_async_drop(lfs, *block);
+    }
+}
+
+static int lfs_ctz_write(lfs_t *lfs, const void *buffer,
+        lfs_block_t sblock, lfs_off_t soff,
+        lfs_size_t size, lfs_block_t *head) {
+    // write out a skip-list small enough to fit in its first block,
+    // which holds no pointers, from either a buffer or another block
+    while (true) {
+        lfs_off_t off;
+        lfs_alloc_ack(lfs);
+        int err = lfs_ctz_extend(lfs, &lfs->rcache, &lfs->pcache,
+                0xffffffff, 0, head, &off);
+        if (err) {
+            return err;
+        }
+
+        if (buffer) {
+            err = lfs_cache_prog(lfs, &lfs->pcache, &lfs->rcache,
+                    *head, off, buffer, size);
+        } else {
+            err = lfs_cache_copy(lfs, &lfs->pcache, &lfs->rcache,
+                    *head, off, &lfs->rcache, NULL, sblock, soff, size, NULL);
+        }
+        if (!err) {
+            err = lfs_cache_flush(lfs, &lfs->pcache, &lfs->rcache);
+        }
+
+        if (err != LFS_ERR_CORRUPT) {
+            return err;
+        }
+
+        LFS_DEBUG("Bad block at %ld", *head);
+
+        // just clear cache and try a new block
+        lfs->pcache.block = 0xffffffff;
+        lfs_async_drop(lfs, *head);
     }
 }
 
@@ -1171,7 +2611,279 @@ static int lfs_ctz_traverse(lfs_t *lfs,
 }
 
 
+/// File extent operations ///
+static int lfs_extent_find(lfs_t *lfs,
+        const lfs_extent_t *extents, lfs_size_t count,
+        lfs_size_t pos, lfs_block_t *block, lfs_off_t *off,
+        lfs_size_t *run) {
+    // blocks in an extent are consecutive, so only the extents need to
+    // be walked, also reports how much of the extent is left after pos
+    lfs_off_t index = pos / lfs->cfg->block_size;
+    for (lfs_size_t i = 0; i < count; i++) {
+        if (index < extents[i].count) {
+            *block = extents[i].block + index;
+            *off = pos % lfs->cfg->block_size;
+            *run = (extents[i].count - index)*lfs->cfg->block_size - *off;
+            if (*block < 2 || *block >= lfs->cfg->block_count) {
+                return LFS_ERR_CORRUPT;
+            }
+            return 0;
+        }
+
+        index -= extents[i].count;
+    }
+
+    return LFS_ERR_CORRUPT;
+}
+
+static lfs_size_t lfs_extent_trim(lfs_extent_t *extents,
+        lfs_size_t count, lfs_size_t blocks) {
+    // keep only the first blocks of the extents
+    for (lfs_size_t i = 0; i < count; i++) {
+        if (blocks <= extents[i].count) {
+            extents[i].count = blocks;
+            return blocks ? i+1 : i;
+        }
+
+        blocks -= extents[i].count;
+    }
+
+    return count;
+}
+
+static lfs_block_t lfs_extent_last(const lfs_extent_t *extents,
+        lfs_size_t count) {
+    if (count == 0) {
+        return 0xffffffff;
+    }
+
+    return extents[count-1].block + extents[count-1].count - 1;
+}
+
+static int lfs_extent_push(lfs_t *lfs, lfs_extent_t *extents,
+        lfs_size_t cap, lfs_size_t *count, lfs_block_t block) {
+    // a block right after the last extent just grows it
+    if (*count > 0 && lfs_extent_last(extents, *count) + 1 == block) {
+        extents[*count-1].count += 1;
+        return 0;
+    }
+
+    if (*count == cap) {
+        LFS_DEBUG("No more extents for block %ld", block);
+        return LFS_ERR_NOSPC;
+    }
+
+    extents[*count].block = block;
+    extents[*count].count = 1;
+    *count += 1;
+    return 0;
+}
+
+static void lfs_extent_pop(lfs_extent_t *extents, lfs_size_t *count) {
+    extents[*count-1].count -= 1;
+    if (extents[*count-1].count == 0) {
+        *count -= 1;
+    }
+}
+
+static int lfs_extent_extend(lfs_t *lfs,
+        lfs_cache_t *rcache, lfs_cache_t *pcache,
+        lfs_extent_t *extents, lfs_size_t cap, lfs_size_t *count,
+        lfs_block_t head, lfs_size_t size,
+        lfs_block_t *block, lfs_off_t *off) {
+    while (true) {
+        // go ahead and grab the block after our last one if we can
+        int err = lfs_alloc_after(lfs,
+                lfs_extent_last(extents, *count), block);
+        if (err) {
+            return err;
+        }
+        assert(*block >= 2 && *block <= lfs->cfg->block_count);
+
+        err = lfs_bd_erase(lfs, *block);
+        if (err) {
+            if (err == LFS_ERR_CORRUPT) {
+                goto relocate;
+            }
+            return err;
+        }
+
+        err = lfs_extent_push(lfs, extents, cap, count, *block);
+        if (err) {
+            return err;
+        }
+
+        // there are no pointers to write, just copy out the last block
+        // if it is incomplete
+        *off = size % lfs->cfg->block_size;
+        if (*off != 0) {
+            err = lfs_cache_copy(lfs, pcache, rcache, *block, 0,
+                    rcache, NULL, head, 0, *off, NULL);
+            if (err) {
+                lfs_extent_pop(extents, count);
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+        }
+
+        return 0;
+
+relocate:
+        LFS_DEBUG("Bad block at %ld", *block);
+
+        // just clear cache and try a new block
+        pcache->block = 0xffffffff;
+        lfs_async_drop(lfs, *block);
+    }
+}
+
+static int lfs_extent_traverse(
+        const lfs_extent_t *extents, lfs_size_t count,
+        int (*cb)(void*, lfs_block_t), void *data) {
+    for (lfs_size_t i = 0; i < count; i++) {
+        for (lfs_size_t j = 0; j < extents[i].count; j++) {
+            int err = cb(data, extents[i].block + j);
+            if (err) {
+                return err;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+static int lfs_extent_toctz(lfs_t *lfs, const lfs_cache_t *spcache,
+        const lfs_extent_t *wextents, lfs_size_t wcount, lfs_size_t wsize,
+        const lfs_extent_t *extents, lfs_size_t count, lfs_size_t size,
+        lfs_block_t *head) {
+    // copy extents out into a skip-list of their own, the first wsize
+    // bytes come from wextents and the rest from extents
+    *head = 0xffffffff;
+    lfs_size_t nsize = 0;
+    while (nsize < size) {
+        lfs_block_t nblock;
+        lfs_off_t noff;
+        int err = lfs_ctz_extend(lfs, &lfs->rcache, &lfs->pcache,
+                *head, nsize, &nblock, &noff);
+        if (err) {
+            return err;
+        }
+
+        // fill up the block, either from dirty cache or disk
+        lfs_size_t diff = lfs_min(size - nsize, lfs->cfg->block_size - noff);
+        for (lfs_size_t i = 0; i < diff && !err;) {
+            lfs_off_t pos = nsize + i;
+            lfs_block_t sblock;
+            lfs_off_t soff;
+            lfs_size_t run;
+            int res = (pos < wsize)
+                    ? lfs_extent_find(lfs, wextents, wcount,
+                        pos, &sblock, &soff, &run)
+                    : lfs_extent_find(lfs, extents, count,
+                        pos, &sblock, &soff, &run);
+            if (res) {
+                return res;
+            }
+
+            run = lfs_min(run, lfs_min(diff - i,
+                    lfs->cfg->block_size - soff));
+            if (pos < wsize) {
+                run = lfs_min(run, wsize - pos);
+            }
+
+            err = lfs_cache_copy(lfs, &lfs->pcache, &lfs->rcache,
+                    nblock, noff + i, &lfs->rcache, spcache,
+                    sblock, soff, run, NULL);
+            i += run;
+        }
+
+        if (!err) {
+            err = lfs_cache_flush(lfs, &lfs->pcache, &lfs->rcache);
+        }
+
+        if (err) {
+            if (err != LFS_ERR_CORRUPT) {
+                return err;
+            }
+
+            LFS_DEBUG("Bad block at %ld", nblock);
+            lfs->pcache.block = 0xffffffff;
+            lfs_async_drop(lfs, nblock);
+            continue;
+        }
+
+        *head = nblock;
+        nsize += diff;
+    }
+
+    return 0;
+}
+
+
 /// Top level file operations ///
+static lfs_size_t lfs_inline_size(lfs_t *lfs) {
+    // inline data is limited by the 8-bit entry length, and an inline
+    // entry with the longest name must still fit in an empty dir block
+    lfs_size_t overhead = sizeof(struct lfs_disk_dir)+4
+            + sizeof(struct lfs_disk_entry) + 3 + LFS_NAME_MAX;
+    if (lfs->version < 0x00020001 || lfs->cfg->block_size <= overhead) {
+        return 0;
+    }
+
+    return lfs_min(lfs->cfg->inline_size,
+            lfs_min(0xff - (sizeof(struct lfs_disk_entry)-4),
+                lfs->cfg->block_size - overhead));
+}
+
+static lfs_size_t lfs_pack_size(lfs_t *lfs) {
+    // a packed file must leave room for at least one more program line
+    // in its pack block, otherwise there's nothing to share
+    if (lfs->version < 0x00020002) {
+        return 0;
+    }
+
+    return lfs_min(lfs->cfg->pack_size,
+            lfs->cfg->block_size - lfs->cfg->prog_size);
+}
+
+static lfs_size_t lfs_extent_count(lfs_t *lfs) {
+    // extents are limited by the 8-bit entry length, and an extent entry
+    // with the longest name must still fit in an empty dir block
+    lfs_size_t overhead = sizeof(struct lfs_disk_dir)+4
+            + sizeof(struct lfs_disk_entry) + 3 + LFS_NAME_MAX;
+    if (lfs->version < 0x00020003 || lfs->cfg->block_size <= overhead) {
+        return 0;
+    }
+
+    return lfs_min(LFS_EXTENTS, lfs_min(
+            (0xff - (sizeof(struct lfs_disk_entry)-4)) / sizeof(lfs_extent_t),
+            (lfs->cfg->block_size - overhead) / sizeof(lfs_extent_t)));
+}
+
+static void lfs_pack_done(lfs_t *lfs, lfs_off_t off) {
+    // the next file in the pack starts on a fresh program line, since
+    // the rest of our last line has already been programmed
+    lfs->pack.off = off + (lfs->cfg->prog_size - (off % lfs->cfg->prog_size))
+            % lfs->cfg->prog_size;
+    lfs->pack.busy = false;
+}
+
+static inline lfs_size_t lfs_file_isize(const lfs_file_t *file) {
+    // size of what the file keeps in its entry after the file struct
+    if (file->flags & LFS_F_INLINE) {
+        return file->size;
+    } else if (file->flags & LFS_F_PACKED) {
+        return sizeof(file->hoff);
+    } else if (file->flags & LFS_F_EXTENT) {
+        return file->ecap*sizeof(lfs_extent_t);
+    }
+
+    return 0;
+}
+
 int lfs_file_open(lfs_t *lfs, lfs_file_t *file,
         const char *path, int flags) {
     // deorphan if we haven't yet, needed at most once after poweron
@@ -1184,13 +2896,8 @@ int lfs_file_open(lfs_t *lfs, lfs_file_t *file,
 
     // allocate entry for file if it doesn't exist
     lfs_dir_t cwd;
-    int err = lfs_dir_fetch(lfs, &cwd, lfs->root);
-    if (err) {
-        return err;
-    }
-
     lfs_entry_t entry;
-    err = lfs_dir_find(lfs, &cwd, &entry, &path);
+    int err = lfs_dir_find(lfs, &cwd, &entry, &path);
     if (err && (err != LFS_ERR_NOENT || strchr(path, '/') != NULL)) {
         return err;
     }
@@ -1200,14 +2907,20 @@ int lfs_file_open(lfs_t *lfs, lfs_file_t *file,
             return LFS_ERR_NOENT;
         }
 
-        // create entry to remember name
+        // create entry to remember name, extent files reserve room for
+        // their extents up front so the entry never has to grow
+        lfs_extent_t extents[LFS_EXTENTS] = {{0}};
         entry.d.type = LFS_TYPE_REG;
         entry.d.elen = sizeof(entry.d) - 4;
-        entry.d.alen = 0;
         entry.d.nlen = strlen(path);
         entry.d.u.file.head = 0xffffffff;
         entry.d.u.file.size = 0;
-        err = lfs_dir_append(lfs, &cwd, &entry, path);
+        if ((flags & LFS_O_EXTENT) && lfs_extent_count(lfs) > 0) {
+            entry.d.type = LFS_TYPE_EXTENT;
+            entry.d.elen += lfs_extent_count(lfs)*sizeof(lfs_extent_t);
+        }
+
+        err = lfs_dir_append(lfs, &cwd, &entry, extents, path);
         if (err) {
             return err;
         }
@@ -1225,25 +2938,132 @@ int lfs_file_open(lfs_t *lfs, lfs_file_t *file,
     file->size = entry.d.u.file.size;
     file->flags = flags;
     file->pos = 0;
+    file->cache.buffer = NULL;
+    file->lines = NULL;
+    file->ahead.buffer = NULL;
+    file->idata = NULL;
+    file->extents = NULL;
+    file->wextents = NULL;
 
     if (flags & LFS_O_TRUNC) {
+        if (file->size > 0) {
+            // needs a commit even if nothing gets written
+            file->flags |= LFS_F_DIRTY;
+        }
+
         file->head = 0xffffffff;
         file->size = 0;
     }
 
-    // allocate buffer if needed
-    file->cache.block = 0xffffffff;
-    if (lfs->cfg->file_buffer) {
-        file->cache.buffer = lfs->cfg->file_buffer;
-    } else if ((file->flags & 3) == LFS_O_RDONLY) {
-        file->cache.buffer = malloc(lfs->cfg->read_size);
-        if (!file->cache.buffer) {
-            return LFS_ERR_NOMEM;
+    file->cursor.head = file->head;
+    file->cursor.count = 0;
+
+    // packed files start somewhere in a shared block
+    file->hoff = 0;
+    if (entry.d.type == LFS_TYPE_PACKED && !(flags & LFS_O_TRUNC)) {
+        err = lfs_dir_get(lfs, &cwd, entry.off + sizeof(entry.d),
+                &file->hoff, sizeof(file->hoff));
+        if (err) {
+            goto cleanup;
         }
-    } else {
-        file->cache.buffer = malloc(lfs->cfg->prog_size);
-        if (!file->cache.buffer) {
-            return LFS_ERR_NOMEM;
+
+        file->flags |= LFS_F_PACKED;
+    }
+
+    // extent files keep their extents in memory while open, new or
+    // emptied files opened with LFS_O_EXTENT become extent files
+    if ((entry.d.type == LFS_TYPE_EXTENT && !(flags & LFS_O_TRUNC)) ||
+            (file->size == 0 && (flags & LFS_O_EXTENT) &&
+             (flags & 3) != LFS_O_RDONLY && lfs_extent_count(lfs) > 0)) {
+        file->ecap = (entry.d.type == LFS_TYPE_EXTENT)
+                ? lfs_entry_isize(&entry) / sizeof(lfs_extent_t)
+                : lfs_extent_count(lfs);
+        file->extents = calloc(2*file->ecap, sizeof(lfs_extent_t));
+        if (!file->extents) {
+            err = LFS_ERR_NOMEM;
+            goto cleanup;
+        }
+
+        file->wextents = &file->extents[file->ecap];
+        file->ecount = 0;
+        file->wcount = 0;
+        if (file->size > 0) {
+            err = lfs_dir_get(lfs, &cwd, entry.off + sizeof(entry.d),
+                    file->extents, file->ecap*sizeof(lfs_extent_t));
+            if (err) {
+                goto cleanup;
+            }
+
+            while (file->ecount < file->ecap &&
+                    file->extents[file->ecount].count > 0) {
+                file->ecount += 1;
+            }
+        }
+
+        file->flags |= LFS_F_EXTENT;
+    }
+
+    // small files are kept in memory while open, new or emptied files
+    // start out inline if they can
+    if ((entry.d.type == LFS_TYPE_INLINE && !(flags & LFS_O_TRUNC)) ||
+            (file->size == 0 && (flags & 3) != LFS_O_RDONLY &&
+             !(file->flags & LFS_F_EXTENT) && lfs_inline_size(lfs) > 0)) {
+        file->idata = malloc(lfs_max(lfs->cfg->inline_size, file->size));
+        if (!file->idata) {
+            err = LFS_ERR_NOMEM;
+            goto cleanup;
+        }
+
+        if (file->size > 0) {
+            err = lfs_dir_get(lfs, &cwd, entry.off + sizeof(entry.d),
+                    file->idata, file->size);
+            if (err) {
+                goto cleanup;
+            }
+        }
+
+        file->head = 0xffffffff;
+        file->flags |= LFS_F_INLINE;
+    }
+
+    // allocate buffer if needed
+    file->cache.block = 0xffffffff;
+    if (lfs->cfg->file_buffer) {
+        file->cache.buffer = lfs->cfg->file_buffer;
+    } else if ((file->flags & 3) == LFS_O_RDONLY) {
+        file->cache.buffer = malloc(lfs->cfg->read_size);
+        if (!file->cache.buffer) {
+            err = LFS_ERR_NOMEM;
+            goto cleanup;
+        }
+    } else {
+        file->cache.buffer = malloc(lfs->cfg->prog_size);
+        if (!file->cache.buffer) {
+            err = LFS_ERR_NOMEM;
+            goto cleanup;
+        }
+    }
+
+    // setup program lines if we can pipeline writes
+    if (lfs->cfg->prog_async && (file->flags & 3) != LFS_O_RDONLY) {
+        err = lfs_cache_pipeinit(lfs, &file->cache, &file->lines, NULL);
+        if (err) {
+            goto cleanup;
+        }
+    }
+
+    // allocate read-ahead buffer if requested
+    file->ahead.block = 0xffffffff;
+    file->asize = 0;
+    file->awin = 0;
+    file->apos = 0;
+    if ((file->flags & LFS_O_SEQUENTIAL) &&
+            (file->flags & 3) != LFS_O_WRONLY &&
+            lfs->cfg->read_ahead >= 2*lfs->cfg->read_size) {
+        file->ahead.buffer = malloc(lfs->cfg->read_ahead);
+        if (!file->ahead.buffer) {
+            err = LFS_ERR_NOMEM;
+            goto cleanup;
         }
     }
 
@@ -1252,11 +3072,32 @@ int lfs_file_open(lfs_t *lfs, lfs_file_t *file,
     lfs->files = file;
 
     return 0;
+
+cleanup:
+    // clean up whatever we managed to allocate
+    if (file->lines) {
+        lfs_cache_pipedeinit(lfs, &file->cache, file->lines, true);
+    }
+
+    if (!lfs->cfg->file_buffer) {
+        free(file->cache.buffer);
+    }
+
+    free(file->ahead.buffer);
+    free(file->idata);
+    free(file->extents);
+
+    return err;
 }
 
 int lfs_file_close(lfs_t *lfs, lfs_file_t *file) {
     int err = lfs_file_sync(lfs, file);
 
+    if ((file->flags & LFS_F_PACKED) && (file->flags & LFS_F_WRITING)) {
+        // failed to finish up in the pack, let other files have it
+        lfs_pack_done(lfs, file->off);
+    }
+
     // remove from list of files
     for (lfs_file_t **p = &lfs->files; *p; p = &(*p)->next) {
         if (*p == file) {
@@ -1266,20 +3107,35 @@ int lfs_file_close(lfs_t *lfs, lfs_file_t *file) {
     }
 
     // clean up memory
+    if (file->lines) {
+        lfs_cache_pipedeinit(lfs, &file->cache, file->lines, true);
+    }
+
     if (!lfs->cfg->file_buffer) {
         free(file->cache.buffer);
     }
 
+    free(file->ahead.buffer);
+    free(file->idata);
+    free(file->extents);
+
     return err;
 }
 
 static int lfs_file_relocate(lfs_t *lfs, lfs_file_t *file) {
+    if (file->flags & LFS_F_EXTENT) {
+        // the bad block is always the last of the extents being written
+        lfs_extent_pop(file->wextents, &file->wcount);
+    }
+
 relocate:
     LFS_DEBUG("Bad block at %ld", file->block);
 
     // just relocate what exists into new block
     lfs_block_t nblock;
-    int err = lfs_alloc(lfs, &nblock);
+    int err = lfs_alloc_after(lfs, (file->flags & LFS_F_EXTENT)
+            ? lfs_extent_last(file->wextents, file->wcount) : 0xffffffff,
+            &nblock);
     if (err) {
         return err;
     }
@@ -1293,22 +3149,186 @@ relocate:
     }
 
     // either read from dirty cache or disk
-    for (lfs_off_t i = 0; i < file->off; i++) {
-        uint8_t data;
-        err = lfs_cache_read(lfs, &lfs->rcache, &file->cache,
-                file->block, i, &data, 1);
+    err = lfs_cache_copy(lfs, &lfs->pcache, &lfs->rcache, nblock, 0,
+            &lfs->rcache, &file->cache, file->block, 0, file->off, NULL);
+    if (err) {
+        if (err == LFS_ERR_CORRUPT) {
+            goto relocate;
+        }
+        return err;
+    }
+
+    // nothing can be left in flight under the wrong cache
+    err = lfs_cache_settle(lfs, &lfs->pcache);
+    if (err) {
+        if (err == LFS_ERR_CORRUPT) {
+            goto relocate;
+        }
+        return err;
+    }
+
+    if (file->flags & LFS_F_EXTENT) {
+        err = lfs_extent_push(lfs, file->wextents, file->ecap,
+                &file->wcount, nblock);
         if (err) {
+            // no room for another extent, put back the bad block and
+            // move everything to a skip-list instead
+            lfs->pcache.block = 0xffffffff;
+            lfs_extent_push(lfs, file->wextents, file->ecap,
+                    &file->wcount, file->block);
+            return lfs_file_unextent(lfs, file, true);
+        }
+    }
+
+    // copy over new state of file
+    memcpy(file->cache.buffer, lfs->pcache.buffer, lfs->cfg->prog_size);
+    file->cache.block = lfs->pcache.block;
+    file->cache.off = lfs->pcache.off;
+    lfs->pcache.block = 0xffffffff;
+    lfs_async_drop(lfs, file->block);
+
+    file->block = nblock;
+    return 0;
+}
+
+static int lfs_file_find(lfs_t *lfs, lfs_file_t *file,
+        lfs_cache_t *rcache, lfs_size_t pos,
+        lfs_block_t *block, lfs_off_t *off) {
+    // find pos in the file's committed blocks
+    if (file->flags & LFS_F_EXTENT) {
+        return lfs_extent_find(lfs, file->extents, file->ecount,
+                pos, block, off, &(lfs_size_t){0});
+    }
+
+    return lfs_ctz_find(lfs, rcache, NULL, &file->cursor,
+            file->head, file->size, pos, block, off);
+}
+
+static int lfs_file_extend(lfs_t *lfs, lfs_file_t *file) {
+    // grab a new block for what we're writing after the current one
+    if (file->flags & LFS_F_EXTENT) {
+        lfs_block_t block = file->block;
+        int err = lfs_extent_extend(lfs, &lfs->rcache, &file->cache,
+                file->wextents, file->ecap, &file->wcount,
+                file->block, file->pos, &file->block, &file->off);
+        if (err != LFS_ERR_NOSPC || file->wcount < file->ecap) {
             return err;
         }
 
-        err = lfs_cache_prog(lfs, &lfs->pcache, &lfs->rcache,
-                nblock, i, &data, 1);
+        // out of extents, free space is too fragmented to stay in them
+        file->block = block;
+        return lfs_file_unextent(lfs, file, true);
+    }
+
+    return lfs_ctz_extend(lfs, &lfs->rcache, &file->cache,
+            file->block, file->pos, &file->block, &file->off);
+}
+
+static int lfs_file_unextent(lfs_t *lfs, lfs_file_t *file, bool resume) {
+    // copy an extent file out into a skip-list of its own, what we've
+    // written so far comes from the extents being written and the rest
+    // from the old ones, if resuming we carry on writing from pos
+    bool writing = (file->flags & LFS_F_WRITING);
+    lfs_size_t wsize = writing ? file->pos : 0;
+    lfs_size_t size = lfs_max(wsize, file->size);
+
+    lfs_block_t head;
+    int err = lfs_extent_toctz(lfs, &file->cache,
+            file->wextents, file->wcount, wsize,
+            file->extents, file->ecount, size, &head);
+    if (err) {
+        return err;
+    }
+
+    if (writing) {
+        // what we were writing is left behind, we have its data already
+        lfs_cache_settle(lfs, &file->cache);
+        lfs_async_drop(lfs, file->block);
+    }
+
+    free(file->extents);
+    file->extents = NULL;
+    file->wextents = NULL;
+    file->flags &= ~(LFS_F_EXTENT | LFS_F_WRITING);
+    file->flags |= LFS_F_DIRTY;
+    file->head = head;
+    file->size = size;
+    file->cursor.head = head;
+    file->cursor.count = 0;
+    file->cache.block = 0xffffffff;
+
+    if (!resume) {
+        return 0;
+    }
+
+    // find out which block we're extending from
+    err = lfs_file_find(lfs, file, &lfs->rcache,
+            file->pos-1, &file->block, &file->off);
+    if (err) {
+        return err;
+    }
+
+    err = lfs_ctz_extend(lfs, &lfs->rcache, &file->cache,
+            file->block, file->pos, &file->block, &file->off);
+    if (err) {
+        return err;
+    }
+
+    file->flags |= LFS_F_WRITING;
+    return 0;
+}
+
+static int lfs_file_unpack(lfs_t *lfs, lfs_file_t *file) {
+    // packed data is never rewritten in place, so copy it out into a
+    // skip-list of its own and carry on from where we were in the file,
+    // either mid-write in the pack or somewhere in a packed file
+    bool packing = (file->flags & LFS_F_WRITING);
+    lfs_block_t block = packing ? file->block : file->head;
+    lfs_size_t size = packing ? file->off - file->hoff : file->size;
+    lfs_off_t pos = file->pos;
+    if (!packing) {
+        // may hold reads, which aren't program lines
+        file->cache.block = 0xffffffff;
+    }
+
+    lfs_block_t nblock;
+    while (true) {
+        lfs_off_t noff;
+        lfs_alloc_ack(lfs);
+        int err = lfs_ctz_extend(lfs, &lfs->rcache, &lfs->pcache,
+                0xffffffff, 0, &nblock, &noff);
         if (err) {
-            if (err == LFS_ERR_CORRUPT) {
-                goto relocate;
-            }
             return err;
         }
+
+        // either read from dirty cache or disk
+        err = lfs_cache_copy(lfs, &lfs->pcache, &lfs->rcache, nblock, 0,
+                &lfs->rcache, &file->cache, block, file->hoff, size, NULL);
+        if (!err) {
+            // nothing can be left in flight under the wrong cache
+            err = lfs_cache_settle(lfs, &lfs->pcache);
+        }
+
+        if (err != LFS_ERR_CORRUPT) {
+            if (err) {
+                return err;
+            }
+            break;
+        }
+
+        LFS_DEBUG("Bad block at %ld", nblock);
+        lfs->pcache.block = 0xffffffff;
+        lfs_async_drop(lfs, nblock);
+    }
+
+    if (packing) {
+        // done with the pack, unless what we left in flight failed
+        if (lfs_cache_report(lfs, &file->cache) == LFS_ERR_CORRUPT) {
+            lfs->pack.block = 0xffffffff;
+        }
+
+        lfs_async_drop(lfs, block);
+        lfs_pack_done(lfs, file->off);
     }
 
     // copy over new state of file
@@ -1317,7 +3337,85 @@ relocate:
     file->cache.off = lfs->pcache.off;
     lfs->pcache.block = 0xffffffff;
 
+    file->flags &= ~LFS_F_PACKED;
+    file->flags |= LFS_F_WRITING;
+    file->head = 0xffffffff;
+    file->size = 0;
+    file->cursor.head = 0xffffffff;
+    file->cursor.count = 0;
     file->block = nblock;
+    file->off = size;
+    file->pos = size;
+
+    if (pos != size) {
+        int err = lfs_file_flush(lfs, file);
+        if (err) {
+            return err;
+        }
+
+        file->pos = pos;
+    }
+
+    return 0;
+}
+
+static int lfs_file_pack(lfs_t *lfs, lfs_file_t *file) {
+    // start writing the file into the pack, grabbing a new pack block
+    // if there isn't room left for a whole packed file
+    while (lfs->pack.block == 0xffffffff ||
+            lfs->cfg->block_size - lfs->pack.off < lfs_pack_size(lfs)) {
+        lfs_block_t block;
+        lfs_alloc_ack(lfs);
+        int err = lfs_alloc(lfs, &block);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_bd_erase(lfs, block);
+        if (err) {
+            if (err == LFS_ERR_CORRUPT) {
+                LFS_DEBUG("Bad block at %ld", block);
+                continue;
+            }
+            return err;
+        }
+
+        lfs->pack.block = block;
+        lfs->pack.off = 0;
+    }
+
+    // a packed file being appended to is copied over to the end of the
+    // pack, its old copy is left for the pack block to free
+    uint32_t flags = file->flags;
+    lfs_block_t head = file->head;
+    lfs_off_t hoff = file->hoff;
+    lfs_size_t size = (file->flags & LFS_F_PACKED) ? file->size : 0;
+
+    file->cache.block = 0xffffffff;
+    file->block = lfs->pack.block;
+    file->off = lfs->pack.off;
+    file->hoff = lfs->pack.off;
+    file->flags |= LFS_F_PACKED | LFS_F_WRITING;
+    lfs->pack.busy = true;
+
+    int err = lfs_cache_copy(lfs, &file->cache, &lfs->rcache,
+            file->block, file->off, &lfs->rcache, NULL, head, hoff, size, NULL);
+    if (err) {
+        // bad pack block, leave the file where it was
+        file->cache.block = 0xffffffff;
+        file->flags = flags;
+        file->hoff = hoff;
+        lfs_async_drop(lfs, lfs->pack.block);
+        lfs->pack.block = 0xffffffff;
+        lfs->pack.busy = false;
+        if (err != LFS_ERR_CORRUPT) {
+            return err;
+        }
+
+        return lfs_file_unpack(lfs, file);
+    }
+
+    file->off += size;
     return 0;
 }
 
@@ -1325,41 +3423,88 @@ static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file) {
     if (file->flags & LFS_F_READING) {
         // just drop read cache
         file->cache.block = 0xffffffff;
+        file->ahead.block = 0xffffffff;
         file->flags &= ~LFS_F_READING;
     }
 
+    if ((file->flags & LFS_F_WRITING) && (file->flags & LFS_F_PACKED)) {
+        // write out what we have, later files in the pack go after us
+        int err = lfs_cache_flush(lfs, &file->cache, &lfs->rcache);
+        if (err) {
+            if (err != LFS_ERR_CORRUPT) {
+                return err;
+            }
+
+            // bad pack block, move out and finish up below
+            lfs->pack.block = 0xffffffff;
+            err = lfs_file_unpack(lfs, file);
+            if (err) {
+                return err;
+            }
+        } else {
+            lfs_pack_done(lfs, file->off);
+            file->head = file->block;
+            file->size = file->pos;
+            file->flags &= ~LFS_F_WRITING;
+            file->flags |= LFS_F_DIRTY;
+        }
+    }
+
     if (file->flags & LFS_F_WRITING) {
         lfs_off_t pos = file->pos;
 
-        // copy over anything after current branch
-        lfs_file_t orig = {
-            .head = file->head,
-            .size = file->size,
-            .flags = LFS_O_RDONLY,
-            .pos = file->pos,
-            .cache = lfs->rcache,
-        };
-        lfs->rcache.block = 0xffffffff;
+        // copy over anything after current branch, streaming whole
+        // runs between the old and new skip-lists
+        lfs_block_t oblock = 0;
+        lfs_off_t ooff = lfs->cfg->block_size;
 
         while (file->pos < file->size) {
-            // copy over a byte at a time, leave it up to caching
-            // to make this efficient
-            uint8_t data;
-            lfs_ssize_t res = lfs_file_read(lfs, &orig, &data, 1);
-            if (res < 0) {
-                return res;
+            if (ooff == lfs->cfg->block_size) {
+                int err = lfs_file_find(lfs, file, &lfs->rcache,
+                        file->pos, &oblock, &ooff);
+                if (err) {
+                    return err;
+                }
             }
 
-            res = lfs_file_write(lfs, file, &data, 1);
-            if (res < 0) {
-                return res;
+            if (file->off == lfs->cfg->block_size) {
+                // extend file with new blocks
+                lfs_alloc_ack(lfs);
+                int err = lfs_file_extend(lfs, file);
+                if (err) {
+                    return err;
+                }
             }
 
-            // keep our reference to the rcache in sync
-            if (lfs->rcache.block != 0xffffffff) {
-                orig.cache.block = 0xffffffff;
-                lfs->rcache.block = 0xffffffff;
+            // copy as much as we can between the current blocks
+            lfs_size_t diff;
+            while (true) {
+                diff = lfs_min(file->size - file->pos,
+                        lfs_min(lfs->cfg->block_size - file->off,
+                            lfs->cfg->block_size - ooff));
+                int err = lfs_cache_copy(lfs, &file->cache, &lfs->rcache,
+                        file->block, file->off,
+                        &lfs->rcache, NULL, oblock, ooff, diff, NULL);
+                if (err) {
+                    if (err == LFS_ERR_CORRUPT) {
+                        goto relocate_copy;
+                    }
+                    return err;
+                }
+
+                break;
+relocate_copy:
+                err = lfs_file_relocate(lfs, file);
+                if (err) {
+                    return err;
+                }
             }
+
+            file->pos += diff;
+            file->off += diff;
+            ooff += diff;
+
+            lfs_alloc_ack(lfs);
         }
 
         // write out what we have
@@ -1380,8 +3525,17 @@ relocate:
             }
         }
 
-        // actual file updates
+        // actual file updates, old skip-list entries no longer apply
         file->head = file->block;
+        file->cursor.count = 0;
+        if (file->flags & LFS_F_EXTENT) {
+            memcpy(file->extents, file->wextents,
+                    file->wcount*sizeof(lfs_extent_t));
+            memset(&file->extents[file->wcount], 0,
+                    (file->ecap - file->wcount)*sizeof(lfs_extent_t));
+            file->ecount = file->wcount;
+            file->head = file->extents[0].block;
+        }
         file->size = file->pos;
         file->flags &= ~LFS_F_WRITING;
         file->flags |= LFS_F_DIRTY;
@@ -1392,43 +3546,240 @@ relocate:
     return 0;
 }
 
-int lfs_file_sync(lfs_t *lfs, lfs_file_t *file) {
+static int lfs_file_outline(lfs_t *lfs, lfs_file_t *file) {
+    // move inline data out into a new skip-list, and carry on from
+    // where we were in the file
+    lfs_off_t pos = file->pos;
+    lfs_size_t size = file->size;
+    file->flags &= ~LFS_F_INLINE;
+    file->head = 0xffffffff;
+    file->size = 0;
+    file->pos = 0;
+    file->cursor.head = 0xffffffff;
+    file->cursor.count = 0;
+
+    lfs_ssize_t res = lfs_file_write(lfs, file, file->idata, size);
+    if (res < 0) {
+        // still have everything inline
+        file->flags &= ~LFS_F_WRITING;
+        file->flags |= LFS_F_INLINE;
+        file->size = size;
+        file->pos = pos;
+        return res;
+    }
+
+    if (file->pos != pos) {
+        int err = lfs_file_flush(lfs, file);
+        if (err) {
+            return err;
+        }
+
+        file->pos = pos;
+    }
+
+    free(file->idata);
+    file->idata = NULL;
+    return 0;
+}
+
+static int lfs_file_commit(lfs_t *lfs, lfs_file_t *file) {
     int err = lfs_file_flush(lfs, file);
     if (err) {
         return err;
     }
 
-    if ((file->flags & LFS_F_DIRTY) && !lfs_pairisnull(file->pair)) {
-        // update dir entry
-        lfs_dir_t cwd;
-        int err = lfs_dir_fetch(lfs, &cwd, file->pair);
-        if (err) {
-            return err;
+    if (!(file->flags & LFS_F_DIRTY) || lfs_pairisnull(file->pair)) {
+        return 0;
+    }
+
+    // with group commits, other files waiting on a sync in the same
+    // directory pair are flushed and committed along with this one, files
+    // that haven't asked for a sync must not have their writes show up
+    lfs_file_t *group[LFS_SYNC_GROUP] = {file};
+    lfs_size_t count = 1;
+    for (lfs_file_t *f = lfs->files; lfs->cfg->group_commit &&
+            f && count < LFS_SYNC_GROUP; f = f->next) {
+        if (f == file || !(f->flags & LFS_F_SYNCING) ||
+                !(f->flags & (LFS_F_DIRTY | LFS_F_WRITING)) ||
+                lfs_paircmp(f->pair, file->pair) != 0) {
+            continue;
+        }
+
+        // only one handle can go in an entry, any other handles open on
+        // the same file still commit on their own
+        bool dup = false;
+        for (lfs_size_t i = 0; i < count; i++) {
+            dup = dup || group[i]->poff == f->poff;
+        }
+
+        if (dup) {
+            continue;
+        }
+
+        // leave files that fail to flush for their own sync to report
+        int err = lfs_file_flush(lfs, f);
+        if (err || !(f->flags & LFS_F_DIRTY)) {
+            continue;
         }
 
-        lfs_entry_t entry = {.off = file->poff};
-        err = lfs_bd_read(lfs, cwd.pair[0], entry.off,
+        group[count++] = f;
+    }
+
+    // update dir entries
+    lfs_dir_t cwd;
+    err = lfs_dir_fetch(lfs, &cwd, file->pair);
+    if (err) {
+        return err;
+    }
+
+    // keep regions in order of their offsets
+    for (lfs_size_t i = 1; i < count; i++) {
+        lfs_file_t *f = group[i];
+        lfs_size_t j = i;
+        for (; j > 0 && group[j-1]->poff > f->poff; j--) {
+            group[j] = group[j-1];
+        }
+        group[j] = f;
+    }
+
+    lfs_entry_t entries[LFS_SYNC_GROUP];
+    lfs_entry_t oldentries[LFS_SYNC_GROUP];
+    struct lfs_region regions[2*LFS_SYNC_GROUP];
+    int rcount = 0;
+    lfs_size_t dsize = 0x7fffffff & cwd.d.size;
+    for (lfs_size_t i = 0; i < count; i++) {
+        lfs_file_t *f = group[i];
+        lfs_entry_t entry = {.off = f->poff};
+        int err = lfs_dir_get(lfs, &cwd, entry.off,
                 &entry.d, sizeof(entry.d));
         if (err) {
             return err;
         }
 
-        if (entry.d.type != LFS_TYPE_REG) {
+        if (entry.d.type != LFS_TYPE_REG &&
+                entry.d.type != LFS_TYPE_INLINE &&
+                entry.d.type != LFS_TYPE_PACKED &&
+                entry.d.type != LFS_TYPE_EXTENT) {
             // sanity check valid entry
             return LFS_ERR_INVAL;
         }
 
-        entry.d.u.file.head = file->head;
-        entry.d.u.file.size = file->size;
+        oldentries[i] = entry;
+        lfs_size_t isize = lfs_file_isize(f);
+        while (dsize + isize - lfs_entry_isize(&entry) >
+                lfs->cfg->block_size) {
+            // no room for the entry to grow, move the file out of it,
+            // an outlined file may still end up packed
+            int err = (f->flags & LFS_F_INLINE)
+                    ? lfs_file_outline(lfs, f)
+                    : (f->flags & LFS_F_EXTENT)
+                    ? lfs_file_unextent(lfs, f, false)
+                    : lfs_file_unpack(lfs, f);
+            if (err) {
+                return err;
+            }
+
+            err = lfs_file_flush(lfs, f);
+            if (err) {
+                return err;
+            }
 
-        err = lfs_dir_update(lfs, &cwd, &entry, NULL);
-        if (err) {
-            return err;
+            isize = lfs_file_isize(f);
+        }
+        dsize = dsize + isize - lfs_entry_isize(&entry);
+
+        entry.d.type = (f->flags & LFS_F_PACKED) ? LFS_TYPE_PACKED :
+                (f->flags & LFS_F_EXTENT) ? LFS_TYPE_EXTENT :
+                isize ? LFS_TYPE_INLINE : LFS_TYPE_REG;
+        entry.d.elen = sizeof(entry.d)-4 + isize;
+        entry.d.u.file.head = f->head;
+        entry.d.u.file.size = f->size;
+        entries[i] = entry;
+
+        regions[rcount++] = (struct lfs_region){
+            entry.off, sizeof(entry.d),
+            &entries[i].d, sizeof(entry.d)};
+        if (isize || lfs_entry_isize(&oldentries[i])) {
+            regions[rcount++] = (struct lfs_region){
+                entry.off + sizeof(entry.d), lfs_entry_isize(&oldentries[i]),
+                (f->flags & LFS_F_PACKED) ? (const void*)&f->hoff :
+                (f->flags & LFS_F_EXTENT) ? (const void*)f->extents :
+                f->idata,
+                isize};
         }
-
-        file->flags &= ~LFS_F_DIRTY;
     }
 
+    err = lfs_dir_commit(lfs, &cwd, regions, rcount);
+    if (err) {
+        return err;
+    }
+
+    // entries that changed size move any files after them, going
+    // backwards so each file is compared against its old offset
+    for (lfs_size_t i = count; i > 0; i--) {
+        lfs_dir_shift(lfs, file->pair, entries[i-1].off,
+                lfs_entry_size(&entries[i-1])
+                - lfs_entry_size(&oldentries[i-1]));
+    }
+
+    for (lfs_size_t i = 0; i < count; i++) {
+        // release old blocks while we're still dirty and tracked
+        int err = lfs_alloc_release(lfs, &oldentries[i]);
+        if (err) {
+            return err;
+        }
+
+        group[i]->flags &= ~(LFS_F_DIRTY | LFS_F_SYNCING);
+    }
+
+    return 0;
+}
+
+int lfs_file_sync(lfs_t *lfs, lfs_file_t *file) {
+    // whether or not the commit worked, we're done waiting on it
+    int err = lfs_file_commit(lfs, file);
+    file->flags &= ~LFS_F_SYNCING;
+    return err;
+}
+
+int lfs_file_marksync(lfs_t *lfs, lfs_file_t *file) {
+    file->flags |= LFS_F_SYNCING;
+    return 0;
+}
+
+static int lfs_file_readahead(lfs_t *lfs, lfs_file_t *file,
+        void *buffer, lfs_size_t size) {
+    if (!(file->block == file->ahead.block &&
+            file->off >= file->ahead.off &&
+            file->off + size <= file->ahead.off + file->asize)) {
+        // grow the window while reads stay sequential, fetching the rest
+        // of the current block in one read if the window allows it
+        file->awin = lfs_min(lfs->cfg->read_ahead,
+                lfs_max(2*lfs->cfg->read_size, 2*file->awin));
+
+        lfs_off_t off = file->off - (file->off % lfs->cfg->read_size);
+        lfs_size_t asize = lfs_min(file->awin, lfs->cfg->block_size - off);
+        asize -= asize % lfs->cfg->read_size;
+        if (file->off + size > off + asize) {
+            // doesn't fit, fall back to the normal cache
+            return lfs_cache_read(lfs, &file->cache, NULL,
+                    file->block, file->off, buffer, size);
+        }
+
+        lfs_async_wait(lfs);
+        int err = lfs->cfg->read(lfs->cfg, file->block, off,
+                file->ahead.buffer, asize);
+        if (err) {
+            file->ahead.block = 0xffffffff;
+            return err;
+        }
+
+        file->ahead.block = file->block;
+        file->ahead.off = off;
+        file->asize = asize;
+    }
+
+    memcpy(buffer, &file->ahead.buffer[file->off - file->ahead.off], size);
     return 0;
 }
 
@@ -1457,12 +3808,29 @@ lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
     size = lfs_min(size, file->size - file->pos);
     nsize = size;
 
+    if (file->flags & LFS_F_INLINE) {
+        memcpy(data, &file->idata[file->pos], size);
+        file->pos += size;
+        return size;
+    }
+
+    if (file->flags & LFS_F_PACKED) {
+        int err = lfs_cache_read(lfs, &file->cache, NULL,
+                file->head, file->hoff + file->pos, data, size);
+        if (err) {
+            return err;
+        }
+
+        file->flags |= LFS_F_READING;
+        file->pos += size;
+        return size;
+    }
+
     while (nsize > 0) {
         // check if we need a new block
         if (!(file->flags & LFS_F_READING) ||
                 file->off == lfs->cfg->block_size) {
-            int err = lfs_ctz_find(lfs, &file->cache, NULL,
-                    file->head, file->size,
+            int err = lfs_file_find(lfs, file, &file->cache,
                     file->pos, &file->block, &file->off);
             if (err) {
                 return err;
@@ -1471,10 +3839,51 @@ lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
             file->flags |= LFS_F_READING;
         }
 
+        if ((file->flags & LFS_F_EXTENT) && lfs->cfg->span_reads &&
+                file->off % lfs->cfg->read_size == 0 &&
+                nsize > lfs->cfg->block_size - file->off) {
+            // the rest of the extent is contiguous on the device, so read
+            // as much of it as we can in one go
+            lfs_size_t run;
+            int err = lfs_extent_find(lfs, file->extents, file->ecount,
+                    file->pos, &file->block, &file->off, &run);
+            if (err) {
+                return err;
+            }
+
+            lfs_size_t span = lfs_min(nsize, run);
+            span -= span % lfs->cfg->read_size;
+            if (span > lfs->cfg->block_size - file->off) {
+                lfs_async_wait(lfs);
+                err = lfs->cfg->read(lfs->cfg, file->block, file->off,
+                        data, span);
+                if (err) {
+                    return err;
+                }
+
+                // carry on from the end of the span's last block
+                file->block += (file->off + span - 1) / lfs->cfg->block_size;
+                file->off = (file->off + span - 1) % lfs->cfg->block_size + 1;
+                file->pos += span;
+                data += span;
+                nsize -= span;
+                file->apos = file->pos;
+                continue;
+            }
+        }
+
         // read as much as we can in current block
         lfs_size_t diff = lfs_min(nsize, lfs->cfg->block_size - file->off);
-        int err = lfs_cache_read(lfs, &file->cache, NULL,
-                file->block, file->off, data, diff);
+        int err;
+        if (file->ahead.buffer && file->pos == file->apos &&
+                diff < lfs->cfg->read_ahead) {
+            err = lfs_file_readahead(lfs, file, data, diff);
+        } else {
+            // random access, start over with a small window
+            file->awin = 0;
+            err = lfs_cache_read(lfs, &file->cache, NULL,
+                    file->block, file->off, data, diff);
+        }
         if (err) {
             return err;
         }
@@ -1483,6 +3892,7 @@ lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
         file->off += diff;
         data += diff;
         nsize -= diff;
+        file->apos = file->pos;
     }
 
     return size;
@@ -1509,6 +3919,27 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
         file->pos = file->size;
     }
 
+    if (file->flags & LFS_F_INLINE) {
+        if (file->pos + size <= lfs_inline_size(lfs)) {
+            // still fits inline, any gap is filled with zeros
+            if (file->pos > file->size) {
+                memset(&file->idata[file->size], 0, file->pos - file->size);
+            }
+
+            memcpy(&file->idata[file->pos], data, size);
+            file->pos += size;
+            file->size = lfs_max(file->size, file->pos);
+            file->flags |= LFS_F_DIRTY;
+            return size;
+        }
+
+        // too big to stay inline
+        int err = lfs_file_outline(lfs, file);
+        if (err) {
+            return err;
+        }
+    }
+
     if (!(file->flags & LFS_F_WRITING) && file->pos > file->size) {
         // fill with zeros
         lfs_off_t pos = file->pos;
@@ -1522,14 +3953,65 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
         }
     }
 
+    if (!(file->flags & LFS_F_WRITING) && file->pos == file->size &&
+            (file->size == 0 || (file->flags & LFS_F_PACKED)) &&
+            !(file->flags & LFS_F_EXTENT) &&
+            size > 0 && file->pos + size <= lfs_pack_size(lfs) &&
+            !lfs->pack.busy) {
+        // small new or appended files go into the pack, one at a time
+        int err = lfs_file_pack(lfs, file);
+        if (err) {
+            return err;
+        }
+    }
+
+    if ((file->flags & LFS_F_PACKED) && (!(file->flags & LFS_F_WRITING) ||
+            file->pos + size > lfs_pack_size(lfs))) {
+        // otherwise packed files can't be modified in place or grow past
+        // the pack size, move out to blocks of our own
+        int err = lfs_file_unpack(lfs, file);
+        if (err) {
+            return err;
+        }
+    }
+
+    if (file->flags & LFS_F_PACKED) {
+        int err = lfs_cache_prog(lfs, &file->cache, &lfs->rcache,
+                file->block, file->off, data, size);
+        if (!err) {
+            file->pos += size;
+            file->off += size;
+            return size;
+        }
+
+        if (err != LFS_ERR_CORRUPT) {
+            return err;
+        }
+
+        // bad pack block, move out and write to our own blocks instead
+        lfs->pack.block = 0xffffffff;
+        err = lfs_file_unpack(lfs, file);
+        if (err) {
+            return err;
+        }
+    }
+
     while (nsize > 0) {
         // check if we need a new block
         if (!(file->flags & LFS_F_WRITING) ||
                 file->off == lfs->cfg->block_size) {
+            if (!(file->flags & LFS_F_WRITING) &&
+                    (file->flags & LFS_F_EXTENT)) {
+                // new blocks go after the whole blocks we keep
+                memcpy(file->wextents, file->extents,
+                        file->ecount*sizeof(lfs_extent_t));
+                file->wcount = lfs_extent_trim(file->wextents,
+                        file->ecount, file->pos / lfs->cfg->block_size);
+            }
+
             if (!(file->flags & LFS_F_WRITING) && file->pos > 0) {
                 // find out which block we're extending from
-                int err = lfs_ctz_find(lfs, &file->cache, NULL,
-                        file->head, file->size,
+                int err = lfs_file_find(lfs, file, &file->cache,
                         file->pos-1, &file->block, &file->off);
                 if (err) {
                     return err;
@@ -1541,9 +4023,7 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
 
             // extend file with new blocks
             lfs_alloc_ack(lfs);
-            int err = lfs_ctz_extend(lfs, &lfs->rcache, &file->cache,
-                    file->block, file->pos,
-                    &file->block, &file->off);
+            int err = lfs_file_extend(lfs, file);
             if (err) {
                 return err;
             }
@@ -1551,9 +4031,11 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
             file->flags |= LFS_F_WRITING;
         }
 
-        // program as much as we can in current block
-        lfs_size_t diff = lfs_min(nsize, lfs->cfg->block_size - file->off);
+        // program as much as we can in current block, which may move
+        // if relocating takes the file out of its extents
+        lfs_size_t diff;
         while (true) {
+            diff = lfs_min(nsize, lfs->cfg->block_size - file->off);
             int err = lfs_cache_prog(lfs, &file->cache, &lfs->rcache,
                     file->block, file->off, data, diff);
             if (err) {
@@ -1639,25 +4121,22 @@ int lfs_stat(lfs_t *lfs, const char *path, struct lfs_info *info) {
     }
 
     lfs_dir_t cwd;
-    int err = lfs_dir_fetch(lfs, &cwd, lfs->root);
-    if (err) {
-        return err;
-    }
-
     lfs_entry_t entry;
-    err = lfs_dir_find(lfs, &cwd, &entry, &path);
+    int err = lfs_dir_find(lfs, &cwd, &entry, &path);
     if (err) {
         return err;
     }
 
     memset(info, 0, sizeof(*info));
     info->type = entry.d.type;
-    if (info->type == LFS_TYPE_REG) {
+    if (info->type == LFS_TYPE_REG || info->type == LFS_TYPE_INLINE ||
+            info->type == LFS_TYPE_PACKED || info->type == LFS_TYPE_EXTENT) {
+        info->type = LFS_TYPE_REG;
         info->size = entry.d.u.file.size;
     }
 
-    err = lfs_bd_read(lfs, cwd.pair[0],
-            entry.off + 4+entry.d.elen+entry.d.alen,
+    err = lfs_dir_get(lfs, &cwd,
+            lfs_entry_name(&entry),
             info->name, entry.d.nlen);
     if (err) {
         return err;
@@ -1676,13 +4155,8 @@ int lfs_remove(lfs_t *lfs, const char *path) {
     }
 
     lfs_dir_t cwd;
-    int err = lfs_dir_fetch(lfs, &cwd, lfs->root);
-    if (err) {
-        return err;
-    }
-
     lfs_entry_t entry;
-    err = lfs_dir_find(lfs, &cwd, &entry, &path);
+    int err = lfs_dir_find(lfs, &cwd, &entry, &path);
     if (err) {
         return err;
     }
@@ -1723,7 +4197,7 @@ int lfs_remove(lfs_t *lfs, const char *path) {
         }
     }
 
-    return 0;
+    return lfs_alloc_release(lfs, &entry);
 }
 
 int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
@@ -1737,24 +4211,14 @@ int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
 
     // find old entry
     lfs_dir_t oldcwd;
-    int err = lfs_dir_fetch(lfs, &oldcwd, lfs->root);
-    if (err) {
-        return err;
-    }
-
     lfs_entry_t oldentry;
-    err = lfs_dir_find(lfs, &oldcwd, &oldentry, &oldpath);
+    int err = lfs_dir_find(lfs, &oldcwd, &oldentry, &oldpath);
     if (err) {
         return err;
     }
 
     // allocate new entry
     lfs_dir_t newcwd;
-    err = lfs_dir_fetch(lfs, &newcwd, lfs->root);
-    if (err) {
-        return err;
-    }
-
     lfs_entry_t preventry;
     err = lfs_dir_find(lfs, &newcwd, &preventry, &newpath);
     if (err && (err != LFS_ERR_NOENT || strchr(newpath, '/') != NULL)) {
@@ -1764,8 +4228,9 @@ int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
     bool prevexists = (err != LFS_ERR_NOENT);
     bool samepair = (lfs_paircmp(oldcwd.pair, newcwd.pair) == 0);
 
-    // must have same type
-    if (prevexists && preventry.d.type != oldentry.d.type) {
+    // must have same type, inline or not
+    if (prevexists && (preventry.d.type == LFS_TYPE_DIR) !=
+            (oldentry.d.type == LFS_TYPE_DIR)) {
         return LFS_ERR_INVAL;
     }
 
@@ -1782,6 +4247,16 @@ int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
         }
     }
 
+    // inline files take their data with them, packed files their offset
+    // and extent files their extents
+    uint8_t idata[0xff];
+    lfs_size_t isize = lfs_entry_isize(&oldentry);
+    err = lfs_dir_get(lfs, &oldcwd, oldentry.off + sizeof(oldentry.d),
+            idata, isize);
+    if (err) {
+        return err;
+    }
+
     // mark as moving
     oldentry.d.type |= 0x80;
     err = lfs_dir_update(lfs, &oldcwd, &oldentry, NULL);
@@ -1798,23 +4273,78 @@ int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
     lfs_entry_t newentry = preventry;
     newentry.d = oldentry.d;
     newentry.d.type &= ~0x80;
+    newentry.d.alen = preventry.d.alen;
     newentry.d.nlen = strlen(newpath);
 
+    if (prevexists && (0x7fffffff & newcwd.d.size) + isize
+            - lfs_entry_isize(&preventry) > lfs->cfg->block_size) {
+        // no room for the entry to grow, move the data out to a block
+        int err;
+        if (newentry.d.type == LFS_TYPE_PACKED) {
+            lfs_off_t hoff;
+            memcpy(&hoff, idata, sizeof(hoff));
+            err = lfs_ctz_write(lfs, NULL, newentry.d.u.file.head, hoff,
+                    newentry.d.u.file.size, &newentry.d.u.file.head);
+        } else if (newentry.d.type == LFS_TYPE_EXTENT) {
+            lfs_extent_t extents[sizeof(idata) / sizeof(lfs_extent_t)];
+            memcpy(extents, idata, isize);
+            lfs_size_t count = 0;
+            while (count < isize/sizeof(lfs_extent_t) &&
+                    extents[count].count > 0) {
+                count += 1;
+            }
+
+            lfs_alloc_ack(lfs);
+            err = lfs_extent_toctz(lfs, NULL, NULL, 0, 0,
+                    extents, count, newentry.d.u.file.size,
+                    &newentry.d.u.file.head);
+        } else {
+            err = lfs_ctz_write(lfs, idata, 0, 0, isize,
+                    &newentry.d.u.file.head);
+        }
+        if (err) {
+            return err;
+        }
+
+        newentry.d.type = LFS_TYPE_REG;
+        newentry.d.elen = sizeof(newentry.d)-4;
+        isize = 0;
+    }
+
     if (prevexists) {
-        int err = lfs_dir_update(lfs, &newcwd, &newentry, newpath);
+        int err = lfs_dir_commit(lfs, &newcwd, (struct lfs_region[]){
+                {preventry.off, sizeof(preventry.d),
+                    &newentry.d, sizeof(newentry.d)},
+                {preventry.off + sizeof(preventry.d),
+                    lfs_entry_isize(&preventry), idata, isize},
+                {lfs_entry_name(&preventry), preventry.d.nlen,
+                    newpath, newentry.d.nlen}
+            }, 3);
         if (err) {
             return err;
         }
+
+        lfs_ssize_t diff = isize - lfs_entry_isize(&preventry);
+        lfs_dir_shift(lfs, newcwd.pair, preventry.off, diff);
+        if (samepair && oldentry.off > preventry.off) {
+            oldentry.off += diff;
+        }
     } else {
-        int err = lfs_dir_append(lfs, &newcwd, &newentry, newpath);
+        int err = lfs_dir_append(lfs, &newcwd, &newentry, idata, newpath);
         if (err) {
             return err;
         }
     }
 
-    // update pair if newcwd == oldcwd
-    if (samepair) {
+    // update pair if newcwd == oldcwd, a new entry may have ended up in
+    // a later block of the dir though
+    if (samepair && prevexists) {
         oldcwd = newcwd;
+    } else if (samepair) {
+        int err = lfs_dir_fetch(lfs, &oldcwd, oldcwd.pair);
+        if (err) {
+            return err;
+        }
     }
 
     // remove old entry
@@ -1840,6 +4370,174 @@ int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
         }
     }
 
+    if (prevexists) {
+        return lfs_alloc_release(lfs, &preventry);
+    }
+
+    return 0;
+}
+
+
+/// Checkpoint operations ///
+static lfs_size_t lfs_checkpoint_encode(const uint32_t *bits,
+        lfs_block_t count, uint8_t *map, lfs_size_t size) {
+    // encode a bitmap as alternating runs of set and clear bits,
+    // starting with set, each stored as a 7-bit varint
+    lfs_size_t len = 0;
+    bool set = true;
+
+    for (lfs_block_t off = 0; off < count; set = !set) {
+        lfs_block_t run = 0;
+        while (off < count && set == !!(bits[off / 32] & (1U << (off % 32)))) {
+            off += 1;
+            run += 1;
+        }
+
+        do {
+            if (len >= size) {
+                // doesn't fit
+                return 0;
+            }
+
+            map[len++] = (0x7f & run) | (run > 0x7f ? 0x80 : 0x00);
+            run >>= 7;
+        } while (run);
+    }
+
+    return len;
+}
+
+static lfs_size_t lfs_checkpoint_decode(uint32_t *bits,
+        lfs_block_t count, const uint8_t *map, lfs_size_t len) {
+    // returns the number of bytes used, or 0 if the map is bad, bits may
+    // be NULL to just skip over a map
+    lfs_size_t i = 0;
+    lfs_block_t off = 0;
+    bool set = true;
+
+    for (; off < count; set = !set) {
+        lfs_block_t run = 0;
+        for (int shift = 0; true; shift += 7) {
+            if (i >= len || shift >= 32) {
+                return 0;
+            }
+
+            run |= (lfs_block_t)(0x7f & map[i]) << shift;
+            if (!(0x80 & map[i++])) {
+                break;
+            }
+        }
+
+        if (run > count - off) {
+            return 0;
+        }
+
+        for (lfs_block_t j = 0; bits && set && j < run; j++) {
+            bits[(off+j) / 32] |= 1U << ((off+j) % 32);
+        }
+
+        off += run;
+    }
+
+    return i;
+}
+
+static int lfs_checkpoint_load(lfs_t *lfs,
+        lfs_dir_t *dir, const lfs_entry_t *entry) {
+    lfs_checkpoint_t checkpoint = {.off = entry->off};
+    if (entry->d.elen < sizeof(checkpoint.d) - 4) {
+        return 0;
+    }
+
+    int err = lfs_dir_get(lfs, dir, checkpoint.off,
+            &checkpoint.d, sizeof(checkpoint.d));
+    if (err) {
+        return err;
+    }
+
+    if (!(checkpoint.d.flags & LFS_CHECKPOINT_CLEAN)) {
+        return 0;
+    }
+
+    // filesystem was cleanly unmounted, so there is nothing to deorphan
+    lfs->checkpointed = true;
+    lfs->deorphaned = true;
+
+    // the lookahead map comes first, followed by the erased map
+    uint8_t map[0xff];
+    lfs_size_t len = entry->d.elen - (sizeof(checkpoint.d) - 4);
+    err = lfs_dir_get(lfs, dir,
+            checkpoint.off + sizeof(checkpoint.d), map, len);
+    if (err) {
+        return err;
+    }
+
+    // pick up the lookahead if it was saved with the same geometry
+    lfs_size_t off = 0;
+    bool found = false;
+    if (checkpoint.d.lookahead) {
+        lfs_block_t count = lfs_min(
+                checkpoint.d.lookahead, lfs->cfg->block_count);
+        if (checkpoint.d.lookahead == lfs->cfg->lookahead &&
+                checkpoint.d.begin < lfs->cfg->block_count &&
+                checkpoint.d.off <= count) {
+            memset(lfs->free.buffer, 0, lfs->cfg->lookahead/8);
+            off = lfs_checkpoint_decode(lfs->free.buffer, count, map, len);
+            found = off;
+        } else {
+            off = lfs_checkpoint_decode(NULL, count, map, len);
+        }
+    }
+
+    // pick up the erased map if we're tracking erased blocks
+    if ((checkpoint.d.flags & LFS_CHECKPOINT_ERASED) && lfs->emap &&
+            (off || !checkpoint.d.lookahead)) {
+        if (!lfs_checkpoint_decode(lfs->emap,
+                lfs->cfg->block_count, &map[off], len - off)) {
+            memset(lfs->emap, 0,
+                    (lfs->cfg->block_count+31)/32*sizeof(uint32_t));
+        }
+    }
+
+    if (found) {
+        lfs->free.begin = checkpoint.d.begin;
+        lfs->free.off = checkpoint.d.off;
+        lfs->free.mapped = lfs_alloc_ismap(lfs);
+        lfs_alloc_ack(lfs);
+        return 0;
+    }
+
+    // otherwise just resume scanning where we left off
+    lfs->free.begin = checkpoint.d.begin + checkpoint.d.off
+            - lfs->cfg->lookahead;
+    lfs->free.off = lfs->cfg->lookahead;
+    lfs->free.mapped = false;
+    lfs_alloc_ack(lfs);
+    return 0;
+}
+
+static int lfs_checkpoint_clear(lfs_t *lfs) {
+    lfs_dir_t superdir;
+    int err = lfs_dir_fetch(lfs, &superdir, (const lfs_block_t[2]){0, 1});
+    if (err) {
+        return err;
+    }
+
+    // the superblock can't be relocated, but a checkpoint left behind
+    // would have the next mount trust a stale lookahead, so if this fails
+    // so does the write that needed it
+    uint32_t flags = 0;
+    err = lfs_dir_commit(lfs, &superdir, (struct lfs_region[]){
+            {lfs->ckoff+4, sizeof(flags), &flags, sizeof(flags)}
+        }, 1);
+    if (err) {
+        if (err == LFS_ERR_CORRUPT) {
+            LFS_WARN("Failed to clear checkpoint at %ld", superdir.pair[0]);
+        }
+        return err;
+    }
+
+    lfs->checkpointed = false;
     return 0;
 }
 
@@ -1859,6 +4557,44 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
         }
     }
 
+    // setup any additional read cache lines
+    lfs->rlines = NULL;
+    if (lfs->cfg->read_lines > 1) {
+        lfs->rlines = calloc(lfs->cfg->read_lines-1, sizeof(lfs_cache_t));
+        if (!lfs->rlines) {
+            return LFS_ERR_NOMEM;
+        }
+
+        for (lfs_size_t i = 0; i < lfs->cfg->read_lines-1; i++) {
+            lfs->rlines[i].block = 0xffffffff;
+            if (lfs->cfg->read_buffer) {
+                uint8_t *buffer = lfs->cfg->read_buffer;
+                lfs->rlines[i].buffer = &buffer[(i+1)*lfs->cfg->read_size];
+            } else {
+                lfs->rlines[i].buffer = malloc(lfs->cfg->read_size);
+                if (!lfs->rlines[i].buffer) {
+                    return LFS_ERR_NOMEM;
+                }
+            }
+        }
+    }
+
+    lfs->rstats.hit_count = 0;
+    lfs->rstats.miss_count = 0;
+
+    // setup lookup cache
+    lfs->lookups = NULL;
+    if (lfs->cfg->lookup_cache) {
+        lfs->lookups = malloc(lfs->cfg->lookup_cache*sizeof(lfs_lookup_t));
+        if (!lfs->lookups) {
+            return LFS_ERR_NOMEM;
+        }
+    }
+
+    lfs->lcount = 0;
+    lfs->lstats.hit_count = 0;
+    lfs->lstats.miss_count = 0;
+
     // setup program cache
     lfs->pcache.block = 0xffffffff;
     if (lfs->cfg->prog_buffer) {
@@ -1870,6 +4606,43 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
         }
     }
 
+    // setup program lines to cycle through while programs are in flight
+    lfs->lines = NULL;
+    lfs->plines = NULL;
+    lfs->aseq = 0;
+    lfs->abusy = 0;
+    if (lfs->cfg->prog_async) {
+        assert(lfs->cfg->wait);
+        int err = lfs_cache_pipeinit(lfs, &lfs->pcache,
+                &lfs->plines, lfs->cfg->async_buffer);
+        if (err) {
+            return err;
+        }
+    }
+
+    // setup erase-ahead pool, with room to remember what we hand out
+    lfs->free.erased = NULL;
+    lfs->free.eready = 0;
+    lfs->free.eclean = 0;
+    lfs->free.ecount = 0;
+    if (lfs->cfg->erase_ahead) {
+        lfs->free.erased = malloc(2*lfs->cfg->erase_ahead*sizeof(lfs_block_t));
+        if (!lfs->free.erased) {
+            return LFS_ERR_NOMEM;
+        }
+    }
+
+    // setup map of blocks known to be erased
+    lfs->emap = NULL;
+    lfs->estats.erase_count = 0;
+    lfs->estats.skip_count = 0;
+    if (lfs->cfg->erase_map) {
+        lfs->emap = calloc((lfs->cfg->block_count+31)/32, sizeof(uint32_t));
+        if (!lfs->emap) {
+            return LFS_ERR_NOMEM;
+        }
+    }
+
     // setup lookahead, round down to nearest 32-bits
     assert(lfs->cfg->lookahead % 32 == 0);
     assert(lfs->cfg->lookahead > 0);
@@ -1890,6 +4663,19 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
     lfs->root[0] = 0xffffffff;
     lfs->root[1] = 0xffffffff;
     lfs->files = NULL;
+    lfs->moves.valid = false;
+    for (int i = 0; i < LFS_LOGS; i++) {
+        lfs->logs[i].block = 0xffffffff;
+    }
+    lfs->pack.block = 0xffffffff;
+    lfs->pack.off = 0;
+    lfs->pack.busy = false;
+    lfs->gc.state = LFS_GC_IDLE;
+    lfs->gc.pmap.slots = NULL;
+    lfs->gen = 0;
+    lfs->version = LFS_DISK_VERSION;
+    lfs->ckoff = 0;
+    lfs->checkpointed = false;
     lfs->deorphaned = false;
 
     return 0;
@@ -1897,10 +4683,26 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
 
 static int lfs_deinit(lfs_t *lfs) {
     // free allocated memory
+    if (lfs->plines) {
+        lfs_cache_pipedeinit(lfs, &lfs->pcache,
+                lfs->plines, !lfs->cfg->async_buffer);
+    }
+
     if (!lfs->cfg->read_buffer) {
         free(lfs->rcache.buffer);
+
+        for (lfs_size_t i = 0; lfs->rlines &&
+                i < lfs->cfg->read_lines-1; i++) {
+            free(lfs->rlines[i].buffer);
+        }
     }
 
+    free(lfs->rlines);
+    free(lfs->lookups);
+    free(lfs->free.erased);
+    free(lfs->emap);
+    free(lfs->gc.pmap.slots);
+
     if (!lfs->cfg->prog_buffer) {
         free(lfs->pcache.buffer);
     }
@@ -1923,6 +4725,9 @@ int lfs_format(lfs_t *lfs, const struct lfs_config *cfg) {
     lfs->free.begin = 0;
     lfs->free.off = 0;
     lfs->free.end = lfs->free.begin + lfs->free.off + lfs->cfg->block_count;
+    lfs->free.pending[0] = 0;
+    lfs->free.pending[1] = 0;
+    lfs->free.mapped = lfs_alloc_ismap(lfs);
 
     // create superblock dir
     lfs_alloc_ack(lfs);
@@ -1953,7 +4758,7 @@ int lfs_format(lfs_t *lfs, const struct lfs_config *cfg) {
         .d.type = LFS_TYPE_SUPERBLOCK,
         .d.elen = sizeof(superblock.d) - sizeof(superblock.d.magic) - 4,
         .d.nlen = sizeof(superblock.d.magic),
-        .d.version = 0x00010001,
+        .d.version = LFS_DISK_VERSION,
         .d.magic = {"littlefs"},
         .d.block_size  = lfs->cfg->block_size,
         .d.block_count = lfs->cfg->block_count,
@@ -1966,6 +4771,8 @@ int lfs_format(lfs_t *lfs, const struct lfs_config *cfg) {
     // write both pairs to be safe
     bool valid = false;
     for (int i = 0; i < 2; i++) {
+        // rewrite each block rather than appending to the first
+        superdir.lend = 0;
         int err = lfs_dir_commit(lfs, &superdir, (struct lfs_region[]){
                 {sizeof(superdir.d), sizeof(superblock.d),
                  &superblock.d, sizeof(superblock.d)}
@@ -2001,6 +4808,9 @@ int lfs_mount(lfs_t *lfs, const struct lfs_config *cfg) {
     lfs->free.begin = -lfs->cfg->lookahead;
     lfs->free.off = lfs->cfg->lookahead;
     lfs->free.end = lfs->free.begin + lfs->free.off + lfs->cfg->block_count;
+    lfs->free.pending[0] = lfs->free.begin + lfs->free.off;
+    lfs->free.pending[1] = lfs->free.begin + lfs->free.off;
+    lfs->free.mapped = false;
 
     // load superblock
     lfs_dir_t dir;
@@ -2011,7 +4821,7 @@ int lfs_mount(lfs_t *lfs, const struct lfs_config *cfg) {
     }
 
     if (!err) {
-        int err = lfs_bd_read(lfs, dir.pair[0], sizeof(dir.d),
+        int err = lfs_dir_get(lfs, &dir, sizeof(dir.d),
                 &superblock.d, sizeof(superblock.d));
         if (err) {
             return err;
@@ -2026,62 +4836,127 @@ int lfs_mount(lfs_t *lfs, const struct lfs_config *cfg) {
         return LFS_ERR_CORRUPT;
     }
 
-    if (superblock.d.version > (0x00010001 | 0x0000ffff)) {
+    if (superblock.d.version > (LFS_DISK_VERSION | 0x0000ffff)) {
         LFS_ERROR("Invalid version %ld.%ld",
                 0xffff & (superblock.d.version >> 16),
                 0xffff & (superblock.d.version >> 0));
         return LFS_ERR_INVAL;
     }
 
+    lfs->version = superblock.d.version;
+
+    // look for a checkpoint left by a clean unmount, v1 drivers don't
+    // know to clear checkpoints so can't be trusted to have left one
+    dir.off = sizeof(dir.d);
+    while (lfs->version >= 0x00020000) {
+        lfs_entry_t entry;
+        int err = lfs_dir_next(lfs, &dir, &entry);
+        if (err == LFS_ERR_NOENT) {
+            break;
+        } else if (err) {
+            return err;
+        }
+
+        if (entry.d.type == LFS_TYPE_CHECKPOINT) {
+            lfs->ckoff = entry.off;
+            return lfs_checkpoint_load(lfs, &dir, &entry);
+        }
+    }
+
     return 0;
 }
 
 int lfs_unmount(lfs_t *lfs) {
-    return lfs_deinit(lfs);
+    // only write a checkpoint if something changed since the last one,
+    // a filesystem that was never deorphaned isn't known to be consistent
+    int err = 0;
+    if (lfs->deorphaned && !lfs->checkpointed) {
+        err = lfs_checkpoint(lfs);
+    }
+
+    int res = lfs_deinit(lfs);
+    return err ? err : res;
 }
 
 
 /// Littlefs specific operations ///
-int lfs_traverse(lfs_t *lfs, int (*cb)(void*, lfs_block_t), void *data) {
-    if (lfs_pairisnull(lfs->root)) {
-        return 0;
-    }
-
-    // iterate over metadata pairs
-    lfs_dir_t dir;
-    lfs_entry_t entry;
-    lfs_block_t cwd[2] = {0, 1};
-
-    while (true) {
-        for (int i = 0; i < 2; i++) {
-            int err = cb(data, cwd[i]);
-            if (err) {
-                return err;
-            }
+static int lfs_traverse_dir(lfs_t *lfs, lfs_dir_t *dir,
+        int (*cb)(void*, lfs_block_t), void *data) {
+    for (int i = 0; i < 2; i++) {
+        int err = cb(data, dir->pair[i]);
+        if (err) {
+            return err;
         }
+    }
 
-        int err = lfs_dir_fetch(lfs, &dir, cwd);
+    // iterate over contents
+    lfs_entry_t entry;
+    while (dir->off + sizeof(entry.d) <= (0x7fffffff & dir->d.size)-4) {
+        int err = lfs_dir_get(lfs, dir, dir->off,
+                &entry.d, sizeof(entry.d));
         if (err) {
             return err;
         }
 
-        // iterate over contents
-        while (dir.off + sizeof(entry.d) <= (0x7fffffff & dir.d.size)-4) {
-            int err = lfs_bd_read(lfs, dir.pair[0], dir.off,
-                    &entry.d, sizeof(entry.d));
+        lfs_off_t eoff = dir->off + sizeof(entry.d);
+        dir->off += lfs_entry_size(&entry);
+        if ((0x70 & entry.d.type) == (0x70 & LFS_TYPE_REG)) {
+            int err = lfs_ctz_traverse(lfs, &lfs->rcache, NULL,
+                    entry.d.u.file.head, entry.d.u.file.size, cb, data);
             if (err) {
                 return err;
             }
+        } else if ((0x70 & entry.d.type) == (0x70 & LFS_TYPE_PACKED)) {
+            // packed files share their one block with others
+            int err = cb(data, entry.d.u.file.head);
+            if (err) {
+                return err;
+            }
+        } else if ((0x70 & entry.d.type) == (0x70 & LFS_TYPE_EXTENT)) {
+            // extents are stored in the entry, up to the first unused one
+            for (lfs_off_t i = 0; i < lfs_entry_isize(&entry);
+                    i += sizeof(lfs_extent_t)) {
+                lfs_extent_t extent;
+                int err = lfs_dir_get(lfs, dir, eoff + i,
+                        &extent, sizeof(extent));
+                if (err) {
+                    return err;
+                }
+
+                if (extent.count == 0) {
+                    break;
+                }
 
-            dir.off += lfs_entry_size(&entry);
-            if ((0x70 & entry.d.type) == (0x70 & LFS_TYPE_REG)) {
-                int err = lfs_ctz_traverse(lfs, &lfs->rcache, NULL,
-                        entry.d.u.file.head, entry.d.u.file.size, cb, data);
+                err = lfs_extent_traverse(&extent, 1, cb, data);
                 if (err) {
                     return err;
                 }
             }
         }
+    }
+
+    return 0;
+}
+
+int lfs_traverse(lfs_t *lfs, int (*cb)(void*, lfs_block_t), void *data) {
+    if (lfs_pairisnull(lfs->root)) {
+        return 0;
+    }
+
+    // iterate over metadata pairs
+    lfs_dir_t dir;
+    lfs_block_t cwd[2] = {0, 1};
+
+    while (true) {
+        int err = lfs_dir_fetch(lfs, &dir, cwd);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_traverse_dir(lfs, &dir, cb, data);
+        if (err) {
+            return err;
+        }
 
         cwd[0] = dir.d.tail[0];
         cwd[1] = dir.d.tail[1];
@@ -2089,281 +4964,986 @@ int lfs_traverse(lfs_t *lfs, int (*cb)(void*, lfs_block_t), void *data) {
         if (lfs_pairisnull(cwd)) {
             break;
         }
-    }
+    }
+
+    // iterate over any open files
+    return lfs_traverse_files(lfs, cb, data);
+}
+
+static int lfs_traverse_files(lfs_t *lfs,
+        int (*cb)(void*, lfs_block_t), void *data) {
+    if (lfs->pack.block != 0xffffffff) {
+        // the pack block is in use before any file commits to it
+        int err = cb(data, lfs->pack.block);
+        if (err) {
+            return err;
+        }
+    }
+
+    for (lfs_file_t *f = lfs->files; f; f = f->next) {
+        if ((f->flags & LFS_F_DIRTY) && (f->flags & LFS_F_PACKED)) {
+            if (f->size > 0) {
+                int err = cb(data, f->head);
+                if (err) {
+                    return err;
+                }
+            }
+        } else if ((f->flags & LFS_F_DIRTY) && (f->flags & LFS_F_EXTENT)) {
+            int err = lfs_extent_traverse(f->extents, f->ecount, cb, data);
+            if (err) {
+                return err;
+            }
+        } else if ((f->flags & LFS_F_DIRTY) && !(f->flags & LFS_F_INLINE)) {
+            int err = lfs_ctz_traverse(lfs, &lfs->rcache, &f->cache,
+                    f->head, f->size, cb, data);
+            if (err) {
+                return err;
+            }
+        }
+
+        if ((f->flags & LFS_F_WRITING) && (f->flags & LFS_F_EXTENT)) {
+            int err = lfs_extent_traverse(f->wextents, f->wcount, cb, data);
+            if (err) {
+                return err;
+            }
+        } else if ((f->flags & LFS_F_WRITING) &&
+                !(f->flags & LFS_F_PACKED)) {
+            int err = lfs_ctz_traverse(lfs, &lfs->rcache, &f->cache,
+                    f->block, f->pos, cb, data);
+            if (err) {
+                return err;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int lfs_pred(lfs_t *lfs, const lfs_block_t dir[2], lfs_dir_t *pdir) {
+    if (lfs_pairisnull(lfs->root)) {
+        return 0;
+    }
+
+    // iterate over all directory directory entries
+    int err = lfs_dir_fetch(lfs, pdir, (const lfs_block_t[2]){0, 1});
+    if (err) {
+        return err;
+    }
+
+    while (!lfs_pairisnull(pdir->d.tail)) {
+        if (lfs_paircmp(pdir->d.tail, dir) == 0) {
+            return true;
+        }
+
+        int err = lfs_dir_fetch(lfs, pdir, pdir->d.tail);
+        if (err) {
+            return err;
+        }
+    }
+
+    return false;
+}
+
+static int lfs_parent(lfs_t *lfs, const lfs_block_t dir[2],
+        lfs_dir_t *parent, lfs_entry_t *entry) {
+    if (lfs_pairisnull(lfs->root)) {
+        return 0;
+    }
+    
+    parent->d.tail[0] = 0;
+    parent->d.tail[1] = 1;
+
+    // iterate over all directory directory entries
+    while (!lfs_pairisnull(parent->d.tail)) {
+        int err = lfs_dir_fetch(lfs, parent, parent->d.tail);
+        if (err) {
+            return err;
+        }
+
+        while (true) {
+            int err = lfs_dir_next(lfs, parent, entry);
+            if (err && err != LFS_ERR_NOENT) {
+                return err;
+            }
+
+            if (err == LFS_ERR_NOENT) {
+                break;
+            }
+
+            if (((0x70 & entry->d.type) == (0x70 & LFS_TYPE_DIR)) &&
+                 lfs_paircmp(entry->d.u.dir, dir) == 0) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static struct lfs_move *lfs_moves_find(lfs_t *lfs, const void *e) {
+    lfs_block_t u[2];
+    memcpy(u, e, sizeof(u));
+
+    lfs_size_t i = (u[0] ^ u[1]) % LFS_MOVES;
+    for (lfs_size_t j = 0; j < LFS_MOVES; j++) {
+        struct lfs_move *m = &lfs->moves.slots[(i+j) % LFS_MOVES];
+        if (!m->used) {
+            return NULL;
+        }
+
+        if (memcmp(m->u, u, sizeof(u)) == 0) {
+            return m;
+        }
+    }
+
+    return NULL;
+}
+
+static void lfs_moves_add(lfs_t *lfs, const void *e, lfs_size_t seen) {
+    lfs_block_t u[2];
+    memcpy(u, e, sizeof(u));
+
+    if (lfs_moves_find(lfs, u)) {
+        return;
+    }
+
+    if (lfs->moves.count == LFS_MOVES) {
+        lfs->moves.overflow = true;
+        return;
+    }
+
+    lfs_size_t i = (u[0] ^ u[1]) % LFS_MOVES;
+    while (lfs->moves.slots[i].used) {
+        i = (i+1) % LFS_MOVES;
+    }
+
+    lfs->moves.slots[i] = (struct lfs_move){
+        .u = {u[0], u[1]},
+        .seen = seen,
+        .used = true,
+        .moved = false,
+    };
+    lfs->moves.count += 1;
+}
+
+static int lfs_moves_scandir(lfs_t *lfs, lfs_dir_t *cwd,
+        bool collect, lfs_size_t limit, lfs_size_t *n) {
+    // collect moving entries and mark any that have a completed copy
+    // among the entries seen so far
+    lfs_entry_t entry;
+    while (true) {
+        if (*n+1 >= limit) {
+            return 0;
+        }
+
+        int err = lfs_dir_next(lfs, cwd, &entry);
+        if (err && err != LFS_ERR_NOENT) {
+            return err;
+        }
+
+        if (err == LFS_ERR_NOENT) {
+            return 0;
+        }
+
+        *n += 1;
+        if (0x80 & entry.d.type) {
+            if (collect) {
+                lfs_moves_add(lfs, &entry.d.u, *n);
+            }
+        } else {
+            struct lfs_move *m = lfs_moves_find(lfs, &entry.d.u);
+            if (m) {
+                m->moved = true;
+            }
+        }
+    }
+}
+
+static int lfs_moves_scan(lfs_t *lfs, bool collect, lfs_size_t limit) {
+    // skip superblock
+    lfs_dir_t cwd;
+    int err = lfs_dir_fetch(lfs, &cwd, (const lfs_block_t[2]){0, 1});
+    if (err) {
+        return err;
+    }
+
+    // iterate over all directory entries
+    lfs_size_t n = 0;
+    while (!lfs_pairisnull(cwd.d.tail) && n+1 < limit) {
+        int err = lfs_dir_fetch(lfs, &cwd, cwd.d.tail);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_moves_scandir(lfs, &cwd, collect, limit, &n);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static lfs_size_t lfs_moves_limit(lfs_t *lfs) {
+    // a completed copy may come before its moving entry, so a second
+    // scan is needed up to the last moving entry that is still unresolved
+    lfs_size_t limit = 0;
+    for (lfs_size_t i = 0; i < LFS_MOVES; i++) {
+        struct lfs_move *m = &lfs->moves.slots[i];
+        if (m->used && !m->moved) {
+            limit = lfs_max(limit, m->seen);
+        }
+    }
+
+    return limit;
+}
+
+static int lfs_moves_build(lfs_t *lfs) {
+    memset(&lfs->moves, 0, sizeof(lfs->moves));
+    if (lfs_pairisnull(lfs->root)) {
+        lfs->moves.valid = true;
+        return 0;
+    }
+
+    int err = lfs_moves_scan(lfs, true, 0xffffffff);
+    if (err) {
+        return err;
+    }
+
+    // rescan only up to the last unresolved move
+    lfs_size_t limit = lfs_moves_limit(lfs);
+    if (limit > 1) {
+        int err = lfs_moves_scan(lfs, false, limit);
+        if (err) {
+            return err;
+        }
+    }
+
+    lfs->moves.valid = true;
+    return 0;
+}
+
+static int lfs_moved_scan(lfs_t *lfs, const void *e) {
+    if (lfs_pairisnull(lfs->root)) {
+        return 0;
+    }
+
+    // skip superblock
+    lfs_dir_t cwd;
+    int err = lfs_dir_fetch(lfs, &cwd, (const lfs_block_t[2]){0, 1});
+    if (err) {
+        return err;
+    }
+
+    // iterate over all directory directory entries
+    lfs_entry_t entry;
+    while (!lfs_pairisnull(cwd.d.tail)) {
+        int err = lfs_dir_fetch(lfs, &cwd, cwd.d.tail);
+        if (err) {
+            return err;
+        }
+
+        while (true) {
+            int err = lfs_dir_next(lfs, &cwd, &entry);
+            if (err && err != LFS_ERR_NOENT) {
+                return err;
+            }
+
+            if (err == LFS_ERR_NOENT) {
+                break;
+            }
+
+            if (!(0x80 & entry.d.type) && 
+                 memcmp(&entry.d.u, e, sizeof(entry.d.u)) == 0) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static int lfs_moved(lfs_t *lfs, const void *e) {
+    // resolve all pending moves at once the first time one is needed
+    if (!lfs->moves.valid) {
+        int err = lfs_moves_build(lfs);
+        if (err) {
+            return err;
+        }
+    }
+
+    struct lfs_move *m = lfs_moves_find(lfs, e);
+    if (m) {
+        return m->moved;
+    }
+
+    // not indexed, either too many moves or a move in progress
+    return lfs_moved_scan(lfs, e);
+}
+
+static int lfs_relocate(lfs_t *lfs,
+        const lfs_block_t oldpair[2], const lfs_block_t newpair[2]) {
+    // cached lookups may reference the old pair anywhere
+    lfs->lcount = 0;
+
+    // find parent
+    lfs_dir_t parent;
+    lfs_entry_t entry;
+    int res = lfs_parent(lfs, oldpair, &parent, &entry);
+    if (res < 0) {
+        return res;
+    }
+
+    if (res) {
+        // update disk, this creates a desync
+        entry.d.u.dir[0] = newpair[0];
+        entry.d.u.dir[1] = newpair[1];
+
+        int err = lfs_dir_update(lfs, &parent, &entry, NULL);
+        if (err) {
+            return err;
+        }
+
+        // update internal root
+        if (lfs_paircmp(oldpair, lfs->root) == 0) {
+            LFS_DEBUG("Relocating root %ld %ld", newpair[0], newpair[1]);
+            lfs->root[0] = newpair[0];
+            lfs->root[1] = newpair[1];
+        }
+
+        // clean up bad block, which should now be a desync
+        return lfs_deorphan(lfs);
+    }
+
+    // find pred
+    res = lfs_pred(lfs, oldpair, &parent);
+    if (res < 0) {
+        return res;
+    }
+
+    if (res) {
+        // just replace bad pair, no desync can occur
+        parent.d.tail[0] = newpair[0];
+        parent.d.tail[1] = newpair[1];
+
+        return lfs_dir_commit(lfs, &parent, NULL, 0);
+    }
+
+    // couldn't find dir, must be new
+    return 0;
+}
+
+static int lfs_pmap_walkdir(lfs_t *lfs, lfs_pmap_t *pmap,
+        lfs_dir_t *cwd, lfs_size_t *count) {
+    // iterate over the dir's entries
+    lfs_entry_t entry;
+    while (true) {
+        int err = lfs_dir_next(lfs, cwd, &entry);
+        if (err && err != LFS_ERR_NOENT) {
+            return err;
+        }
+
+        if (err == LFS_ERR_NOENT) {
+            return 0;
+        }
+
+        if ((0x70 & entry.d.type) != (0x70 & LFS_TYPE_DIR)) {
+            continue;
+        }
+
+        *count += 1;
+        if (!pmap) {
+            continue;
+        }
+
+        // index dir under both of its blocks, keeping it below
+        // half full so probes stay short
+        if (2*(*count) > pmap->size/2) {
+            pmap->overflow = true;
+            continue;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            lfs_block_t block = entry.d.u.dir[i];
+            lfs_size_t j = block & (pmap->size-1);
+            while (pmap->slots[j].block != 0xffffffff &&
+                    pmap->slots[j].block != block) {
+                j = (j+1) & (pmap->size-1);
+            }
+
+            // first entry wins, same as lfs_parent
+            if (pmap->slots[j].block == 0xffffffff) {
+                pmap->slots[j].block = block;
+                pmap->slots[j].pair[0] = entry.d.u.dir[0];
+                pmap->slots[j].pair[1] = entry.d.u.dir[1];
+            }
+        }
+    }
+}
+
+static int lfs_pmap_walk(lfs_t *lfs, lfs_pmap_t *pmap,
+        lfs_size_t *count) {
+    // iterate over all directory entries
+    lfs_dir_t cwd = {.d.tail[0] = 0, .d.tail[1] = 1};
+    while (!lfs_pairisnull(cwd.d.tail)) {
+        int err = lfs_dir_fetch(lfs, &cwd, cwd.d.tail);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_pmap_walkdir(lfs, pmap, &cwd, count);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static void lfs_pmap_alloc(lfs_pmap_t *pmap, lfs_size_t count) {
+    // if we're short on RAM settle for a smaller map, anything that
+    // doesn't fit falls back to searching for its parent
+    pmap->size = 1 << lfs_npw2(lfs_max(4*count, 8));
+    pmap->overflow = false;
+    pmap->slots = NULL;
+    while (pmap->size >= 8) {
+        pmap->slots = malloc(pmap->size*sizeof(struct lfs_pslot));
+        if (pmap->slots) {
+            break;
+        }
+
+        pmap->size /= 2;
+    }
+
+    if (!pmap->slots) {
+        pmap->size = 0;
+        pmap->overflow = true;
+        return;
+    }
+
+    for (lfs_size_t i = 0; i < pmap->size; i++) {
+        pmap->slots[i].block = 0xffffffff;
+    }
+}
+
+static int lfs_pmap_build(lfs_t *lfs, lfs_pmap_t *pmap) {
+    // count dirs so the map can be sized
+    lfs_size_t count = 0;
+    int err = lfs_pmap_walk(lfs, NULL, &count);
+    if (err) {
+        return err;
+    }
+
+    lfs_pmap_alloc(pmap, count);
+    if (!pmap->slots) {
+        return 0;
+    }
+
+    count = 0;
+    err = lfs_pmap_walk(lfs, pmap, &count);
+    if (err) {
+        free(pmap->slots);
+        pmap->slots = NULL;
+        return err;
+    }
+
+    return 0;
+}
+
+static int lfs_pmap_parent(lfs_t *lfs, const lfs_pmap_t *pmap,
+        const lfs_block_t dir[2], lfs_block_t pair[2]) {
+    for (int i = 0; i < 2 && pmap->size; i++) {
+        lfs_size_t j = dir[i] & (pmap->size-1);
+        while (pmap->slots[j].block != 0xffffffff) {
+            if (pmap->slots[j].block == dir[i]) {
+                pair[0] = pmap->slots[j].pair[0];
+                pair[1] = pmap->slots[j].pair[1];
+                return true;
+            }
+
+            j = (j+1) & (pmap->size-1);
+        }
+    }
+
+    if (!pmap->overflow) {
+        return false;
+    }
+
+    // map is incomplete, search the hard way
+    lfs_dir_t parent;
+    lfs_entry_t entry;
+    int res = lfs_parent(lfs, dir, &parent, &entry);
+    if (res < 0 || !res) {
+        return res;
+    }
+
+    pair[0] = entry.d.u.dir[0];
+    pair[1] = entry.d.u.dir[1];
+    return true;
+}
+
+static int lfs_deorphan_check(lfs_t *lfs, const lfs_pmap_t *pmap,
+        lfs_dir_t *pdir, const lfs_dir_t *cwd) {
+    // check head blocks for orphans
+    if (0x80000000 & pdir->d.size) {
+        return false;
+    }
+
+    // check if we have a parent
+    lfs_block_t pair[2];
+    int res = lfs_pmap_parent(lfs, pmap, pdir->d.tail, pair);
+    if (res < 0) {
+        return res;
+    }
+
+    if (!res) {
+        // we are an orphan
+        LFS_DEBUG("Found orphan %ld %ld",
+                pdir->d.tail[0], pdir->d.tail[1]);
+
+        pdir->d.tail[0] = cwd->d.tail[0];
+        pdir->d.tail[1] = cwd->d.tail[1];
+
+        int err = lfs_dir_commit(lfs, pdir, NULL, 0);
+        return err ? err : true;
+    }
+
+    if (!lfs_pairsync(pair, pdir->d.tail)) {
+        // we have desynced
+        LFS_DEBUG("Found desync %ld %ld", pair[0], pair[1]);
+
+        pdir->d.tail[0] = pair[0];
+        pdir->d.tail[1] = pair[1];
+
+        int err = lfs_dir_commit(lfs, pdir, NULL, 0);
+        return err ? err : true;
+    }
+
+    return false;
+}
+
+static int lfs_deorphan_scan(lfs_t *lfs, const lfs_pmap_t *pmap) {
+    lfs_dir_t pdir = {.d.size = 0x80000000};
+    lfs_dir_t cwd = {.d.tail[0] = 0, .d.tail[1] = 1};
+
+    // iterate over all directory directory entries
+    while (!lfs_pairisnull(cwd.d.tail)) {
+        int err = lfs_dir_fetch(lfs, &cwd, cwd.d.tail);
+        if (err) {
+            return err;
+        }
 
-    // iterate over any open files
-    for (lfs_file_t *f = lfs->files; f; f = f->next) {
-        if (f->flags & LFS_F_DIRTY) {
-            int err = lfs_ctz_traverse(lfs, &lfs->rcache, &f->cache,
-                    f->head, f->size, cb, data);
-            if (err) {
-                return err;
-            }
+        int res = lfs_deorphan_check(lfs, pmap, &pdir, &cwd);
+        if (res) {
+            // only one orphan can exist at a time
+            return res < 0 ? res : 0;
         }
 
-        if (f->flags & LFS_F_WRITING) {
-            int err = lfs_ctz_traverse(lfs, &lfs->rcache, &f->cache,
-                    f->block, f->pos, cb, data);
-            if (err) {
-                return err;
-            }
-        }
+        memcpy(&pdir, &cwd, sizeof(pdir));
     }
-    
+
     return 0;
 }
 
-static int lfs_pred(lfs_t *lfs, const lfs_block_t dir[2], lfs_dir_t *pdir) {
+int lfs_deorphan(lfs_t *lfs) {
+    lfs->deorphaned = true;
+
     if (lfs_pairisnull(lfs->root)) {
         return 0;
     }
 
-    // iterate over all directory directory entries
-    int err = lfs_dir_fetch(lfs, pdir, (const lfs_block_t[2]){0, 1});
+    // map every dir to its parent entry up front, instead of searching
+    // the filesystem for each dir
+    lfs_pmap_t pmap;
+    int err = lfs_pmap_build(lfs, &pmap);
     if (err) {
         return err;
     }
 
-    while (!lfs_pairisnull(pdir->d.tail)) {
-        if (lfs_paircmp(pdir->d.tail, dir) == 0) {
-            return true;
-        }
-
-        int err = lfs_dir_fetch(lfs, pdir, pdir->d.tail);
-        if (err) {
-            return err;
-        }
+    err = lfs_deorphan_scan(lfs, &pmap);
+    free(pmap.slots);
+    if (err) {
+        return err;
     }
 
-    return false;
+    return lfs_deduplicate(lfs);
 }
 
-static int lfs_parent(lfs_t *lfs, const lfs_block_t dir[2],
-        lfs_dir_t *parent, lfs_entry_t *entry) {
+int lfs_deduplicate(lfs_t *lfs) {
     if (lfs_pairisnull(lfs->root)) {
         return 0;
     }
-    
-    parent->d.tail[0] = 0;
-    parent->d.tail[1] = 1;
 
-    // iterate over all directory directory entries
-    while (!lfs_pairisnull(parent->d.tail)) {
-        int err = lfs_dir_fetch(lfs, parent, parent->d.tail);
+    while (true) {
+        // find and resolve all moves in one pass
+        int err = lfs_moves_build(lfs);
         if (err) {
             return err;
         }
 
-        while (true) {
-            int err = lfs_dir_next(lfs, parent, entry);
-            if (err && err != LFS_ERR_NOENT) {
+        if (lfs->moves.count == 0) {
+            return 0;
+        }
+
+        bool overflow = lfs->moves.overflow;
+
+        lfs_dir_t cwd = {.d.tail[0] = 0, .d.tail[1] = 1};
+        while (!lfs_pairisnull(cwd.d.tail)) {
+            int err = lfs_dir_fetch(lfs, &cwd, cwd.d.tail);
+            if (err) {
                 return err;
             }
 
-            if (err == LFS_ERR_NOENT) {
-                break;
-            }
+            lfs_entry_t entry;
+            while (true) {
+                int err = lfs_dir_next(lfs, &cwd, &entry);
+                if (err && err != LFS_ERR_NOENT) {
+                    return err;
+                }
 
-            if (((0x70 & entry->d.type) == (0x70 & LFS_TYPE_DIR)) &&
-                 lfs_paircmp(entry->d.u.dir, dir) == 0) {
-                return true;
+                if (err == LFS_ERR_NOENT) {
+                    break;
+                }
+
+                // found moved entry, moves that didn't fit are left
+                // for another pass
+                struct lfs_move *m = lfs_moves_find(lfs, &entry.d.u);
+                if (!(entry.d.type & 0x80) || !m) {
+                    continue;
+                }
+
+                if (m->moved) {
+                    LFS_DEBUG("Found move %ld %ld",
+                            entry.d.u.dir[0], entry.d.u.dir[1]);
+                    int err = lfs_dir_remove(lfs, &cwd, &entry);
+                    if (err) {
+                        return err;
+                    }
+                } else {
+                    LFS_DEBUG("Found partial move %ld %ld",
+                            entry.d.u.dir[0], entry.d.u.dir[1]);
+                    entry.d.type &= ~0x80;
+                    int err = lfs_dir_update(lfs, &cwd, &entry, NULL);
+                    if (err) {
+                        return err;
+                    }
+                }
             }
         }
-    }
 
-    return false;
+        if (!overflow) {
+            // no moves left on disk
+            memset(&lfs->moves, 0, sizeof(lfs->moves));
+            lfs->moves.valid = true;
+            return 0;
+        }
+    }
 }
 
-static int lfs_moved(lfs_t *lfs, const void *e) {
-    if (lfs_pairisnull(lfs->root)) {
+int lfs_checkpoint(lfs_t *lfs) {
+    // a checkpoint claims there is nothing to deorphan
+    if (!lfs->deorphaned) {
+        int err = lfs_deorphan(lfs);
+        if (err) {
+            return err;
+        }
+    }
+
+    // v1 drivers would write to the filesystem without clearing it
+    if (lfs->checkpointed || lfs->version < 0x00020000) {
         return 0;
     }
 
-    // skip superblock
-    lfs_dir_t cwd;
-    int err = lfs_dir_fetch(lfs, &cwd, (const lfs_block_t[2]){0, 1});
+    lfs_dir_t superdir;
+    int err = lfs_dir_fetch(lfs, &superdir, (const lfs_block_t[2]){0, 1});
     if (err) {
         return err;
     }
 
-    // iterate over all directory directory entries
-    lfs_entry_t entry;
-    while (!lfs_pairisnull(cwd.d.tail)) {
-        int err = lfs_dir_fetch(lfs, &cwd, cwd.d.tail);
+    // replace any previous checkpoint, otherwise append a new one
+    lfs_checkpoint_t checkpoint = {
+        .off = (0x7fffffff & superdir.d.size) - 4,
+    };
+    lfs_size_t oldsize = 0;
+    if (lfs->ckoff) {
+        lfs_entry_t entry;
+        int err = lfs_dir_get(lfs, &superdir, lfs->ckoff,
+                &entry.d, 4);
         if (err) {
             return err;
         }
 
-        while (true) {
-            int err = lfs_dir_next(lfs, &cwd, &entry);
-            if (err && err != LFS_ERR_NOENT) {
-                return err;
-            }
+        checkpoint.off = lfs->ckoff;
+        oldsize = lfs_entry_size(&entry);
+    }
 
-            if (err == LFS_ERR_NOENT) {
-                break;
-            }
+    checkpoint.d.type = LFS_TYPE_CHECKPOINT;
+    checkpoint.d.elen = sizeof(checkpoint.d) - 4;
+    checkpoint.d.alen = 0;
+    checkpoint.d.nlen = 0;
+    checkpoint.d.flags = LFS_CHECKPOINT_CLEAN;
+    checkpoint.d.begin = (((lfs_soff_t)lfs->free.begin
+                % (lfs_soff_t)lfs->cfg->block_count)
+            + lfs->cfg->block_count) % lfs->cfg->block_count;
+    checkpoint.d.off = lfs->free.off;
+    checkpoint.d.lookahead = 0;
+
+    // save the lookahead if it still holds anything useful and fits, maps
+    // only get a quarter of the room left so the checkpoints and clears
+    // that follow can still be appended
+    uint8_t map[0xff - (sizeof(checkpoint.d) - 4)];
+    lfs_size_t len = 0;
+    lfs_size_t size = (0x7fffffff & superdir.d.size)
+            - oldsize + sizeof(checkpoint.d);
+    lfs_size_t room = (size < lfs->cfg->block_size)
+            ? (lfs->cfg->block_size - size) / 4 : 0;
+    if ((lfs->free.mapped || lfs->free.off < lfs_min(
+                lfs->cfg->lookahead, lfs->cfg->block_count)) &&
+            lfs->gc.state != LFS_GC_SCAN && room > 0) {
+        // the erase-ahead pool doesn't survive remounting
+        for (lfs_size_t i = 0; i < lfs->free.eready; i++) {
+            lfs_alloc_free(lfs, lfs->free.erased[i]);
+        }
 
-            if (!(0x80 & entry.d.type) && 
-                 memcmp(&entry.d.u, e, sizeof(entry.d.u)) == 0) {
-                return true;
-            }
+        len = lfs_checkpoint_encode(lfs->free.buffer,
+                lfs_min(lfs->cfg->lookahead, lfs->cfg->block_count),
+                map, lfs_min(sizeof(map), room));
+
+        for (lfs_size_t i = 0; i < lfs->free.eready; i++) {
+            lfs_alloc_lookahead(lfs, lfs->free.erased[i]);
+        }
+        if (len) {
+            checkpoint.d.elen += len;
+            checkpoint.d.lookahead = lfs->cfg->lookahead;
         }
     }
 
-    return false;
-}
+    // save the erased map after it if there's room left, the superblock
+    // pair is about to be written so doesn't count as erased
+    if (lfs->emap && len < room) {
+        lfs_emap_mark(lfs, 0, false);
+        lfs_emap_mark(lfs, 1, false);
+        lfs_size_t elen = lfs_checkpoint_encode(lfs->emap,
+                lfs->cfg->block_count, &map[len],
+                lfs_min(sizeof(map) - len, room - len));
+        if (elen) {
+            len += elen;
+            checkpoint.d.elen += elen;
+            checkpoint.d.flags |= LFS_CHECKPOINT_ERASED;
+        }
+    }
 
-static int lfs_relocate(lfs_t *lfs,
-        const lfs_block_t oldpair[2], const lfs_block_t newpair[2]) {
-    // find parent
-    lfs_dir_t parent;
-    lfs_entry_t entry;
-    int res = lfs_parent(lfs, oldpair, &parent, &entry);
-    if (res < 0) {
-        return res;
+    // keep the room maps get, or the size of the previous checkpoint, so
+    // later checkpoints fit in the same space even as the maps grow, and
+    // only write out what's in use, anything after the maps is ignored,
+    // so the superblock can usually take them as appended commits
+    lfs_size_t slot = lfs_max(oldsize,
+            sizeof(checkpoint.d) + lfs_min(sizeof(map), room));
+    lfs_size_t pad = slot - (sizeof(checkpoint.d) + len);
+    checkpoint.d.elen += pad;
+    if (oldsize < slot) {
+        memset(&map[len], 0, pad);
+        len += pad;
+    }
+
+    lfs_size_t dlen = lfs_min(oldsize, sizeof(checkpoint.d));
+    err = lfs_dir_commit(lfs, &superdir, (struct lfs_region[]){
+            {checkpoint.off, dlen,
+             &checkpoint.d, sizeof(checkpoint.d)},
+            {checkpoint.off + dlen, (oldsize < slot) ? oldsize - dlen : len,
+             map, len},
+        }, 2);
+    if (err == LFS_ERR_CORRUPT) {
+        // a checkpoint is only a hint, if the superblock can't take it
+        // the next mount just falls back to scanning
+        return 0;
+    } else if (err) {
+        return err;
     }
 
-    if (res) {
-        // update disk, this creates a desync
-        entry.d.u.dir[0] = newpair[0];
-        entry.d.u.dir[1] = newpair[1];
+    lfs->ckoff = checkpoint.off;
+    lfs->checkpointed = true;
+    return 0;
+}
 
-        int err = lfs_dir_update(lfs, &parent, &entry, NULL);
-        if (err) {
-            return err;
-        }
+static bool lfs_gc_refill(lfs_t *lfs) {
+    // the next allocation would have to scan for free blocks
+    return !lfs->free.mapped &&
+            lfs->free.off >= lfs_min(
+                lfs->cfg->lookahead, lfs->cfg->block_count) &&
+            lfs->free.begin + lfs->free.off != lfs->free.end;
+}
 
-        // update internal root
-        if (lfs_paircmp(oldpair, lfs->root) == 0) {
-            LFS_DEBUG("Relocating root %ld %ld", newpair[0], newpair[1]);
-            lfs->root[0] = newpair[0];
-            lfs->root[1] = newpair[1];
-        }
+static void lfs_gc_reset(lfs_t *lfs) {
+    free(lfs->gc.pmap.slots);
+    lfs->gc.pmap.slots = NULL;
+    lfs->gc.state = LFS_GC_IDLE;
+}
 
-        // clean up bad block, which should now be a desync
-        return lfs_deorphan(lfs);
-    }
+static void lfs_gc_start(lfs_t *lfs, uint8_t state) {
+    lfs->gc.state = state;
+    lfs->gc.gen = lfs->gen;
+    lfs->gc.cwd = (lfs_dir_t){.d.tail = {0, 1}};
+}
 
-    // find pred
-    res = lfs_pred(lfs, oldpair, &parent);
-    if (res < 0) {
-        return res;
-    }
+static int lfs_gc_finish(lfs_t *lfs) {
+    lfs_gc_t *gc = &lfs->gc;
+    switch (gc->state) {
+        case LFS_GC_COUNT:
+            // size the parent map, and rescan for any copies that came
+            // before their moving entries
+            lfs_pmap_alloc(&gc->pmap, gc->count);
+            gc->count = 0;
+            gc->n = 0;
+            gc->limit = lfs_moves_limit(lfs);
+            lfs_gc_start(lfs, LFS_GC_MAP);
+            return 0;
 
-    if (res) {
-        // just replace bad pair, no desync can occur
-        parent.d.tail[0] = newpair[0];
-        parent.d.tail[1] = newpair[1];
+        case LFS_GC_MAP:
+            lfs->moves.valid = true;
+            gc->pdir = (lfs_dir_t){.d.size = 0x80000000};
+            lfs_gc_start(lfs, LFS_GC_ORPHAN);
+            return 0;
 
-        return lfs_dir_commit(lfs, &parent, NULL, 0);
+        case LFS_GC_ORPHAN:
+            lfs_gc_reset(lfs);
+            lfs->deorphaned = true;
+            if (lfs->moves.count > 0) {
+                // rare, only after power-loss during a move
+                return lfs_deduplicate(lfs);
+            }
+            return 0;
+
+        case LFS_GC_SCAN: {
+            lfs->gc.state = LFS_GC_IDLE;
+            int err = lfs_traverse_files(lfs, lfs_alloc_lookahead, lfs);
+            if (err) {
+                return err;
+            }
+
+            lfs_alloc_scanned(lfs);
+            return 0;
+        }
     }
 
-    // couldn't find dir, must be new
     return 0;
 }
 
-int lfs_deorphan(lfs_t *lfs) {
-    lfs->deorphaned = true;
-
-    if (lfs_pairisnull(lfs->root)) {
-        return 0;
-    }
+static int lfs_gc_visit(lfs_t *lfs) {
+    lfs_gc_t *gc = &lfs->gc;
+    switch (gc->state) {
+        case LFS_GC_COUNT:
+        case LFS_GC_MAP: {
+            lfs_dir_t dir = gc->cwd;
+            int err = lfs_pmap_walkdir(lfs,
+                    (gc->state == LFS_GC_MAP) ? &gc->pmap : NULL,
+                    &gc->cwd, &gc->count);
+            if (err) {
+                return err;
+            }
 
-    lfs_dir_t pdir = {.d.size = 0x80000000};
-    lfs_dir_t cwd = {.d.tail[0] = 0, .d.tail[1] = 1};
+            // moves in the superblock don't exist
+            if (lfs_paircmp(dir.pair, (const lfs_block_t[2]){0, 1}) == 0 ||
+                    (gc->state == LFS_GC_MAP && gc->limit <= 1)) {
+                return 0;
+            }
 
-    // iterate over all directory directory entries
-    while (!lfs_pairisnull(cwd.d.tail)) {
-        int err = lfs_dir_fetch(lfs, &cwd, cwd.d.tail);
-        if (err) {
-            return err;
+            return lfs_moves_scandir(lfs, &dir, gc->state == LFS_GC_COUNT,
+                    (gc->state == LFS_GC_COUNT) ? 0xffffffff : gc->limit,
+                    &gc->n);
         }
 
-        // check head blocks for orphans
-        if (!(0x80000000 & pdir.d.size)) {
-            // check if we have a parent
-            lfs_dir_t parent;
-            lfs_entry_t entry;
-            int res = lfs_parent(lfs, pdir.d.tail, &parent, &entry);
+        case LFS_GC_ORPHAN: {
+            int res = lfs_deorphan_check(lfs, &gc->pmap, &gc->pdir, &gc->cwd);
             if (res < 0) {
                 return res;
             }
 
-            if (!res) {
-                // we are an orphan
-                LFS_DEBUG("Found orphan %ld %ld",
-                        pdir.d.tail[0], pdir.d.tail[1]);
-
-                pdir.d.tail[0] = cwd.d.tail[0];
-                pdir.d.tail[1] = cwd.d.tail[1];
+            if (res) {
+                // fixed an orphan, there can only be one
+                lfs_gc_reset(lfs);
+                lfs->deorphaned = true;
+                return lfs_deduplicate(lfs);
+            }
 
-                err = lfs_dir_commit(lfs, &pdir, NULL, 0);
-                if (err) {
-                    return err;
-                }
+            memcpy(&gc->pdir, &gc->cwd, sizeof(gc->pdir));
+            return 0;
+        }
 
-                break;
-            }
+        case LFS_GC_SCAN:
+            return lfs_traverse_dir(lfs, &gc->cwd, lfs_alloc_lookahead, lfs);
+    }
 
-            if (!lfs_pairsync(entry.d.u.dir, pdir.d.tail)) {
-                // we have desynced
-                LFS_DEBUG("Found desync %ld %ld",
-                        entry.d.u.dir[0], entry.d.u.dir[1]);
+    return 0;
+}
 
-                pdir.d.tail[0] = entry.d.u.dir[0];
-                pdir.d.tail[1] = entry.d.u.dir[1];
+int lfs_gc_step(lfs_t *lfs, lfs_size_t budget) {
+    if (lfs_pairisnull(lfs->root)) {
+        return 0;
+    }
 
-                err = lfs_dir_commit(lfs, &pdir, NULL, 0);
+    // anything found so far is stale if the filesystem changed
+    if (lfs->gc.state == LFS_GC_SCAN && lfs->gc.gen != lfs->gen) {
+        memset(lfs->free.buffer, 0, lfs->cfg->lookahead/8);
+        lfs_gc_start(lfs, LFS_GC_SCAN);
+    } else if (lfs->gc.state != LFS_GC_IDLE &&
+            lfs->gc.state != LFS_GC_SCAN &&
+            (lfs->gc.gen != lfs->gen || lfs->deorphaned)) {
+        lfs_gc_reset(lfs);
+    }
+
+    while (budget > 0) {
+        if (lfs->gc.state == LFS_GC_IDLE) {
+            if (!lfs->deorphaned) {
+                // count dirs so the parent map can be sized, collecting
+                // moves on the way
+                memset(&lfs->moves, 0, sizeof(lfs->moves));
+                lfs->gc.count = 0;
+                lfs->gc.n = 0;
+                lfs_gc_start(lfs, LFS_GC_COUNT);
+            } else if (lfs_gc_refill(lfs)) {
+                // move on to the next window, same as lfs_alloc
+                lfs->free.begin += lfs_min(
+                        lfs->cfg->lookahead, lfs->cfg->block_count);
+                lfs->free.off = 0;
+                memset(lfs->free.buffer, 0, lfs->cfg->lookahead/8);
+                lfs_gc_start(lfs, LFS_GC_SCAN);
+            } else if (lfs_alloc_canerase(lfs)) {
+                // top up the erase-ahead pool, one erase at a time
+                int err = lfs_alloc_erase(lfs);
                 if (err) {
                     return err;
                 }
 
-                break;
+                budget -= 1;
+                continue;
+            } else {
+                return 0;
             }
         }
 
-        // check entries for moves
-        lfs_entry_t entry;
-        while (true) {
-            int err = lfs_dir_next(lfs, &cwd, &entry);
-            if (err && err != LFS_ERR_NOENT) {
+        if (lfs_pairisnull(lfs->gc.cwd.d.tail)) {
+            int err = lfs_gc_finish(lfs);
+            if (err) {
                 return err;
             }
 
-            if (err == LFS_ERR_NOENT) {
-                break;
-            }
+            continue;
+        }
 
-            // found moved entry
-            if (entry.d.type & 0x80) {
-                int moved = lfs_moved(lfs, &entry.d.u);
-                if (moved < 0) {
-                    return moved;
-                }
+        int err = lfs_dir_fetch(lfs, &lfs->gc.cwd, lfs->gc.cwd.d.tail);
+        if (err) {
+            return err;
+        }
 
-                if (moved) {
-                    LFS_DEBUG("Found move %ld %ld",
-                            entry.d.u.dir[0], entry.d.u.dir[1]);
-                    int err = lfs_dir_remove(lfs, &cwd, &entry);
-                    if (err) {
-                        return err;
-                    }
-                } else {
-                    LFS_DEBUG("Found partial move %ld %ld",
-                            entry.d.u.dir[0], entry.d.u.dir[1]);
-                    entry.d.type &= ~0x80;
-                    int err = lfs_dir_update(lfs, &cwd, &entry, NULL);
-                    if (err) {
-                        return err;
-                    }
-                }
-            }
+        err = lfs_gc_visit(lfs);
+        if (err) {
+            return err;
         }
 
-        memcpy(&pdir, &cwd, sizeof(pdir));
+        budget -= 1;
     }
 
-    return 0;
+    return lfs->gc.state != LFS_GC_IDLE || !lfs->deorphaned ||
+            lfs_gc_refill(lfs) || lfs_alloc_canerase(lfs);
 }
-
@@ -24,6 +24,17 @@
 
 /// Definitions ///
 
+// Version of on-disk data structures
+// Major (top 16 bits), incremented on backwards incompatible changes
+// Minor (bottom 16 bits), incremented on feature additions
+// v1.2 adds a name hash attribute to new entries
+// v2.0 appends commits to metadata blocks, which v1 drivers can't read,
+//      and adds checkpoints, which v1 drivers don't know to clear
+// v2.1 adds inline file entries, which v2.0 drivers skip over
+// v2.2 adds packed file entries, which v2.1 drivers skip over
+// v2.3 adds extent file entries, which v2.2 drivers skip over
+#define LFS_DISK_VERSION 0x00020003
+
 // Type definitions
 typedef uint32_t lfs_size_t;
 typedef uint32_t lfs_off_t;
@@ -38,6 +49,37 @@ typedef uint32_t lfs_block_t;
 #define LFS_NAME_MAX 255
 #endif
 
+// Number of skip-list entries each open file remembers, lets file reads
+// and seeks start near where the last lookup ended instead of at the head
+#ifndef LFS_CTZ_CURSOR
+#define LFS_CTZ_CURSOR 4
+#endif
+
+// Number of interrupted moves resolved per pass over the filesystem, any
+// further moves fall back to a pass of their own
+#ifndef LFS_MOVES
+#define LFS_MOVES 4
+#endif
+
+// Number of files that may be committed together by a single sync when
+// group commits are enabled
+#ifndef LFS_SYNC_GROUP
+#define LFS_SYNC_GROUP 8
+#endif
+
+// Number of metadata blocks whose unwritten space is remembered, lets
+// commits to recently written dirs append to the block instead of
+// rewriting the pair
+#ifndef LFS_LOGS
+#define LFS_LOGS 8
+#endif
+
+// Number of extents new extent files have room for, each costs 8 bytes in
+// the file's entry and 16 bytes in every open extent file, limited to 30
+#ifndef LFS_EXTENTS
+#define LFS_EXTENTS 8
+#endif
+
 // Possible error codes, these are negative to allow
 // valid positive return values
 enum lfs_error {
@@ -58,6 +100,21 @@ enum lfs_type {
     LFS_TYPE_REG        = 0x11,
     LFS_TYPE_DIR        = 0x22,
     LFS_TYPE_SUPERBLOCK = 0x2e,
+    LFS_TYPE_CHECKPOINT = 0x3e,
+    LFS_TYPE_INLINE     = 0x41,
+    LFS_TYPE_PACKED     = 0x51,
+    LFS_TYPE_EXTENT     = 0x61,
+};
+
+// Standard entry attribute types
+enum lfs_attr_type {
+    LFS_ATTR_HASH       = 0x01,
+};
+
+// Checkpoint flags
+enum lfs_checkpoint_flags {
+    LFS_CHECKPOINT_CLEAN  = 0x1, // Filesystem was cleanly unmounted
+    LFS_CHECKPOINT_ERASED = 0x2, // Checkpoint holds the erased map
 };
 
 // File open flags
@@ -70,11 +127,17 @@ enum lfs_open_flags {
     LFS_O_EXCL   = 0x0200,   // Fail if a file already exists
     LFS_O_TRUNC  = 0x0400,   // Truncate the existing file to zero size
     LFS_O_APPEND = 0x0800,   // Move to end of file on every write
+    LFS_O_SEQUENTIAL = 0x1000, // Prefetch ahead while reads are sequential
+    LFS_O_EXTENT = 0x2000,   // Lay out a new file in contiguous extents
 
     // internally used flags
     LFS_F_DIRTY   = 0x10000, // File does not match storage
     LFS_F_WRITING = 0x20000, // File has been written since last flush
     LFS_F_READING = 0x40000, // File has been read since last flush
+    LFS_F_INLINE  = 0x80000, // File is stored inline in its entry
+    LFS_F_PACKED  = 0x100000, // File is stored in a shared pack block
+    LFS_F_EXTENT  = 0x200000, // File is stored in extents
+    LFS_F_SYNCING = 0x400000, // File is waiting on a sync
 };
 
 // File seek flags
@@ -112,6 +175,44 @@ struct lfs_config {
     // are propogated to the user.
     int (*sync)(const struct lfs_config *c);
 
+    // Optional, compare a region in a block against a buffer. Returns true
+    // if the region matches, false if it does not, or a negative error
+    // code. If not provided, the region is read and compared in software.
+    int (*cmp)(const struct lfs_config *c, lfs_block_t block,
+            lfs_off_t off, const void *buffer, lfs_size_t size);
+
+    // Optional, update a CRC-32 with a region in a block, using the same
+    // polynomial and conventions as lfs_crc. Negative error codes are
+    // propogated to the user. If not provided, the region is read and
+    // checksummed in software.
+    int (*crc)(const struct lfs_config *c, lfs_block_t block,
+            lfs_off_t off, lfs_size_t size, uint32_t *crc);
+
+    // Optional, copy a region from one block to another on the device,
+    // for devices that support an on-chip page copy. The destination
+    // block has been erased, both offsets and the size are multiples of
+    // the program size. Follows the same rules as prog, including
+    // returning LFS_ERR_CORRUPT if the destination should be considered
+    // bad. If not provided, the region is copied through the caches.
+    int (*copy)(const struct lfs_config *c, lfs_block_t block,
+            lfs_off_t off, lfs_block_t src, lfs_off_t srcoff,
+            lfs_size_t size);
+
+    // Optional, start programming a region in a block without waiting for
+    // it to finish. Follows the same rules as prog, but the buffer is left
+    // untouched until wait is called, so the next program line can be
+    // filled while this one is programmed. May be called again before
+    // waiting, up to prog_lines-1 times per writer. The last line of a
+    // block is always programmed with prog. Requires wait.
+    int (*prog_async)(const struct lfs_config *c, lfs_block_t block,
+            lfs_off_t off, const void *buffer, lfs_size_t size);
+
+    // Optional, wait for the oldest program started by prog_async to
+    // finish and return its result, including LFS_ERR_CORRUPT if the
+    // block should be considered bad. Everything in flight is waited on
+    // before any other block device operation.
+    int (*wait)(const struct lfs_config *c);
+
     // Minimum size of a block read. This determines the size of read buffers.
     // This may be larger than the physical read size to improve performance
     // by caching more of the block device.
@@ -124,7 +225,8 @@ struct lfs_config {
 
     // Size of an erasable block. This does not impact ram consumption and
     // may be larger than the physical erase size. However, this should be
-    // kept small as each file currently takes up an entire block .
+    // kept small as each file larger than both inline_size and pack_size
+    // takes up at least an entire block.
     lfs_size_t block_size;
 
     // Number of erasable blocks on the device.
@@ -133,15 +235,89 @@ struct lfs_config {
     // Number of blocks to lookahead during block allocation. A larger
     // lookahead reduces the number of passes required to allocate a block.
     // The lookahead buffer requires only 1 bit per block so it can be quite
-    // large with little ram impact. Should be a multiple of 32.
+    // large with little ram impact. Should be a multiple of 32. If the
+    // lookahead covers every block on the device, it is kept as a free map
+    // that is only rebuilt from the filesystem when mounted.
     lfs_size_t lookahead;
 
-    // Optional, statically allocated read buffer. Must be read sized.
+    // Number of read_size lines kept in the read cache. Lines are tagged
+    // by block and evicted least recently used first, so metadata that is
+    // revisited often, such as the superblock and root directory, stays
+    // cached. Defaults to a single line if zero.
+    lfs_size_t read_lines;
+
+    // Number of prog_size lines each writer cycles through when prog_async
+    // is provided. One line is filled while the others are programmed, so
+    // each writer, the filesystem's own program cache and each open file,
+    // costs this many program buffers. Defaults to 2 if zero.
+    lfs_size_t prog_lines;
+
+    // Number of free blocks to keep erased ahead of time. The pool is
+    // filled by lfs_gc_step and the allocator hands these blocks out
+    // first, so writes that need a new block don't wait on an erase.
+    // Costs 8 bytes per block. Disabled if zero.
+    lfs_size_t erase_ahead;
+
+    // Track which blocks are known to be erased, so erasing them again
+    // can be skipped, such as the unused half of a new directory pair.
+    // Requires 1 bit per block, and is saved in the checkpoint on unmount
+    // if it fits. Disabled if false.
+    bool erase_map;
+
+    // Commit other files in the same directory that are waiting on a sync
+    // along with a file being synced or closed, so a burst of syncs from
+    // several writers costs a single metadata commit and device sync.
+    // Only files marked with lfs_file_marksync are committed this way,
+    // writes to any other file stay pending until it is synced itself.
+    // Disabled if false.
+    bool group_commit;
+
+    // Maximum number of bytes to prefetch for files opened with
+    // LFS_O_SEQUENTIAL. Should be a multiple of the read size. Each such
+    // file allocates a buffer of this size, prefetching starts small and
+    // ramps up to this size while reads stay sequential. Disabled if zero.
+    lfs_size_t read_ahead;
+
+    // Allow the read function to be asked for a region that runs on past
+    // the end of its block into the blocks that follow. Lets large reads
+    // from files opened with LFS_O_EXTENT, whose blocks are contiguous,
+    // be made in a single read. Disabled if false.
+    bool span_reads;
+
+    // Number of path lookups to cache. Each cached lookup maps a name in a
+    // directory to the location of its entry, letting repeated opens of the
+    // same paths skip fetching and scanning each directory along the way.
+    // Costs about 64 bytes per lookup. Disabled if zero.
+    lfs_size_t lookup_cache;
+
+    // Maximum size of a file stored inline in its directory entry instead
+    // of in blocks of its own. Files start out inline and move to a CTZ
+    // skip-list the first time they grow past this size. Each file opened
+    // inline allocates a buffer of this size. Limited to 247 bytes and to
+    // what fits in a dir block alongside the longest name. Disabled if
+    // zero.
+    lfs_size_t inline_size;
+
+    // Maximum size of a file packed into a shared block along with other
+    // small files instead of taking up a block of its own. New files are
+    // written into the current pack block, and move out to a CTZ skip-list
+    // if they grow past this size or are modified later. Space in a pack
+    // block is reclaimed once none of its files are left. Limited to the
+    // block size less one program size. Disabled if zero.
+    lfs_size_t pack_size;
+
+    // Optional, statically allocated read buffer. Must be read sized times
+    // the number of read lines.
     void *read_buffer;
 
     // Optional, statically allocated program buffer. Must be program sized.
     void *prog_buffer;
 
+    // Optional, statically allocated program lines for the filesystem's
+    // own program cache. Must be program sized times one less than the
+    // number of program lines. Only used with prog_async.
+    void *async_buffer;
+
     // Optional, statically allocated lookahead buffer. Must be 1 bit per
     // lookahead block.
     void *lookahead_buffer;
@@ -190,6 +366,30 @@ typedef struct lfs_cache {
     uint8_t *buffer;
 } lfs_cache_t;
 
+typedef struct lfs_line {
+    struct lfs_line *next;
+    const lfs_cache_t *owner;
+    lfs_cache_t *rcache;
+    lfs_cache_t cache;
+    uint32_t seq;
+    int err;
+    bool busy;
+} lfs_line_t;
+
+typedef struct lfs_ctz_cursor {
+    lfs_block_t head;
+    lfs_size_t count;
+    struct lfs_ctz_skip {
+        lfs_off_t index;
+        lfs_block_t block;
+    } skips[LFS_CTZ_CURSOR];
+} lfs_ctz_cursor_t;
+
+typedef struct lfs_extent {
+    lfs_block_t block;
+    lfs_size_t count;
+} lfs_extent_t;
+
 typedef struct lfs_file {
     struct lfs_file *next;
     lfs_block_t pair[2];
@@ -197,17 +397,35 @@ typedef struct lfs_file {
 
     lfs_block_t head;
     lfs_size_t size;
+    lfs_off_t hoff;
 
     uint32_t flags;
     lfs_off_t pos;
     lfs_block_t block;
     lfs_off_t off;
     lfs_cache_t cache;
+    lfs_line_t *lines;
+    lfs_ctz_cursor_t cursor;
+
+    lfs_cache_t ahead;
+    lfs_size_t asize;
+    lfs_size_t awin;
+    lfs_off_t apos;
+
+    uint8_t *idata;
+
+    lfs_extent_t *extents;
+    lfs_extent_t *wextents;
+    lfs_size_t ecap;
+    lfs_size_t ecount;
+    lfs_size_t wcount;
 } lfs_file_t;
 
 typedef struct lfs_dir {
     lfs_block_t pair[2];
     lfs_off_t off;
+    lfs_off_t lend;
+    uint32_t lcrc;
 
     lfs_block_t head[2];
     lfs_off_t pos;
@@ -219,6 +437,18 @@ typedef struct lfs_dir {
     } d;
 } lfs_dir_t;
 
+struct lfs_disk_delta {
+    uint32_t rev;
+    lfs_size_t size;
+    lfs_block_t tail[2];
+    lfs_size_t len;
+};
+
+struct lfs_disk_patch {
+    lfs_off_t off;
+    lfs_size_t len;
+};
+
 typedef struct lfs_superblock {
     lfs_off_t off;
 
@@ -235,14 +465,105 @@ typedef struct lfs_superblock {
     } d;
 } lfs_superblock_t;
 
+typedef struct lfs_checkpoint {
+    lfs_off_t off;
+
+    struct lfs_disk_checkpoint {
+        uint8_t type;
+        uint8_t elen;
+        uint8_t alen;
+        uint8_t nlen;
+        uint32_t flags;
+        lfs_block_t begin;
+        lfs_block_t off;
+        lfs_size_t lookahead;
+    } d;
+} lfs_checkpoint_t;
+
 typedef struct lfs_free {
     lfs_block_t begin;
     lfs_block_t end;
     lfs_block_t off;
+    lfs_block_t pending[2];
+    bool mapped;
     uint32_t *buffer;
+
+    lfs_block_t *erased;
+    lfs_size_t eready;
+    lfs_size_t eclean;
+    lfs_size_t ecount;
 } lfs_free_t;
 
+typedef struct lfs_moves {
+    bool valid;
+    bool overflow;
+    lfs_size_t count;
+    struct lfs_move {
+        lfs_block_t u[2];
+        lfs_size_t seen;
+        bool used;
+        bool moved;
+    } slots[LFS_MOVES];
+} lfs_moves_t;
+
+typedef struct lfs_pmap {
+    lfs_size_t size;
+    bool overflow;
+    struct lfs_pslot {
+        lfs_block_t block;
+        lfs_block_t pair[2];
+    } *slots;
+} lfs_pmap_t;
+
+// Background work in progress
+enum lfs_gc_state {
+    LFS_GC_IDLE   = 0, // Nothing in progress
+    LFS_GC_COUNT  = 1, // Counting dirs and collecting moves
+    LFS_GC_MAP    = 2, // Mapping dirs to their parents
+    LFS_GC_ORPHAN = 3, // Checking dirs for orphans
+    LFS_GC_SCAN   = 4, // Filling the lookahead
+};
+
+typedef struct lfs_gc {
+    uint8_t state;
+    uint32_t gen;
+    lfs_size_t count;
+    lfs_size_t n;
+    lfs_size_t limit;
+    lfs_dir_t pdir;
+    lfs_dir_t cwd;
+    lfs_pmap_t pmap;
+} lfs_gc_t;
+
+typedef struct lfs_log {
+    lfs_block_t block;
+    lfs_off_t end;
+} lfs_log_t;
+
+typedef struct lfs_pack {
+    lfs_block_t block;
+    lfs_off_t off;
+    bool busy;
+} lfs_pack_t;
+
+typedef struct lfs_lookup {
+    lfs_block_t parent[2];
+    uint32_t hash;
+    lfs_dir_t dir;
+    lfs_entry_t entry;
+} lfs_lookup_t;
+
 // The littlefs type
+typedef struct lfs_cache_stats {
+    uint32_t hit_count;
+    uint32_t miss_count;
+} lfs_cache_stats_t;
+
+typedef struct lfs_erase_stats {
+    uint32_t erase_count;
+    uint32_t skip_count;
+} lfs_erase_stats_t;
+
 typedef struct lfs {
     const struct lfs_config *cfg;
 
@@ -250,9 +571,30 @@ typedef struct lfs {
     lfs_file_t *files;
 
     lfs_cache_t rcache;
+    lfs_cache_t *rlines;
+    lfs_cache_stats_t rstats;
     lfs_cache_t pcache;
 
+    lfs_line_t *plines;
+    lfs_line_t *lines;
+    uint32_t aseq;
+    lfs_size_t abusy;
+
+    lfs_lookup_t *lookups;
+    lfs_size_t lcount;
+    lfs_cache_stats_t lstats;
+
     lfs_free_t free;
+    uint32_t *emap;
+    lfs_erase_stats_t estats;
+    lfs_moves_t moves;
+    lfs_log_t logs[LFS_LOGS];
+    lfs_pack_t pack;
+    lfs_gc_t gc;
+    uint32_t gen;
+    uint32_t version;
+    lfs_off_t ckoff;
+    bool checkpointed;
     bool deorphaned;
 } lfs_t;
 
@@ -278,7 +620,8 @@ int lfs_mount(lfs_t *lfs, const struct lfs_config *config);
 
 // Unmounts a littlefs
 //
-// Does nothing besides releasing any allocated resources.
+// If the filesystem was modified while mounted, a checkpoint is written
+// as with lfs_checkpoint, then any allocated resources are released.
 // Returns a negative error code on failure.
 int lfs_unmount(lfs_t *lfs);
 
@@ -317,6 +660,11 @@ int lfs_stat(lfs_t *lfs, const char *path, struct lfs_info *info);
 // by the flags, which are values from the enum lfs_open_flags
 // that are bitwise-ored together.
 //
+// Files created or truncated with LFS_O_EXTENT are laid out in runs of
+// contiguous blocks instead of a CTZ skip-list. If free space is too
+// fragmented to fit in the extents its entry has room for, the file is
+// copied out into a CTZ skip-list and carries on as a regular file.
+//
 // Returns a negative error code on failure.
 int lfs_file_open(lfs_t *lfs, lfs_file_t *file,
         const char *path, int flags);
@@ -335,6 +683,16 @@ int lfs_file_close(lfs_t *lfs, lfs_file_t *file);
 // Returns a negative error code on failure.
 int lfs_file_sync(lfs_t *lfs, lfs_file_t *file);
 
+// Mark a file as waiting on a sync
+//
+// With group commits, a marked file is committed along with the next file
+// in its directory to be synced or closed, so syncs from several threads
+// can share a commit. The file still has to be synced or closed itself to
+// find out if its writes made it to storage, which clears the mark.
+//
+// Returns a negative error code on failure.
+int lfs_file_marksync(lfs_t *lfs, lfs_file_t *file);
+
 // Read data from file
 //
 // Takes a buffer and size indicating where to store the read data.
@@ -444,7 +802,44 @@ int lfs_traverse(lfs_t *lfs, int (*cb)(void*, lfs_block_t), void *data);
 // Returns a negative error code on failure.
 int lfs_deorphan(lfs_t *lfs);
 
-// TODO doc
+// Does a bounded slice of background work
+//
+// Work that would otherwise stall whichever call first needs it, such as
+// deorphaning after power-loss or filling the lookahead, is done a few
+// metadata pairs at a time, with the position kept in the littlefs object.
+// A step visits at most budget metadata pairs along with the files they
+// contain. Once that's done, steps top up the erase-ahead pool, erasing at
+// most budget blocks. Work is restarted if the filesystem changes in
+// between steps, and any call that needs the work finished simply
+// finishes it itself.
+//
+// Returns 1 if there is more work to do, 0 if there is nothing left to do,
+// or a negative error code on failure.
+int lfs_gc_step(lfs_t *lfs, lfs_size_t budget);
+
+// Records that the filesystem is consistent in the superblock
+//
+// Writes a small record holding the allocator's position and, if it fits
+// in a quarter of the superblock's free space, the lookahead, so the next
+// mount can skip lfs_deorphan and pick up allocating where we left off.
+// The record is cleared again before the next change to the filesystem,
+// so a mount after power-loss falls back to scanning. Note the superblock
+// can't be relocated, the checkpoint and its clearing are appended to it
+// where possible, but the first change after each mount costs an erase of
+// a superblock block. If the superblock wears out, writes fail rather
+// than leave a stale checkpoint behind. This is already called by
+// lfs_unmount, and does nothing on v1 filesystems.
+//
+// Returns a negative error code on failure.
+int lfs_checkpoint(lfs_t *lfs);
+
+// Resolves any entries left behind by interrupted moves
+//
+// Entries marked as moving are removed if their move completed, otherwise
+// the move is undone. All pending moves are found in a single pass over
+// the filesystem. This is already called by lfs_deorphan.
+//
+// Returns a negative error code on failure.
 int lfs_deduplicate(lfs_t *lfs);
 
 
@@ -85,6 +85,11 @@ static inline int lfs_scmp(uint32_t a, uint32_t b) {
 }
 
 // CRC-32 with polynomial = 0x04c11db7
+//
+// The backend is selected at compile time, trading code size for speed:
+// - default:        16-entry nibble table, 64 bytes
+// - LFS_CRC_BYTE:   256-entry byte table, 1KiB
+// - LFS_CRC_SLICE8: slicing-by-8 tables, 8KiB
 void lfs_crc(uint32_t *crc, const void *buffer, size_t size);
 
 
@@ -0,0 +1,282 @@
+/// AUTOGENERATED TEST ///
+#include "lfs.h"
+#include "emubd/lfs_emubd.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+// test stuff
+void test_log(const char *s, uintmax_t v) {
+    printf("%s: %jd\n", s, v);
+}
+
+void test_assert(const char *file, unsigned line,
+        const char *s, uintmax_t v, uintmax_t e) {
+    static const char *last[6] = {0, 0};
+    if (v != e || !(last[0] == s || last[1] == s ||
+            last[2] == s || last[3] == s ||
+            last[4] == s || last[5] == s)) {
+        test_log(s, v);
+        last[0] = last[1];
+        last[1] = last[2];
+        last[2] = last[3];
+        last[3] = last[4];
+        last[4] = last[5];
+        last[5] = s;
+    }
+
+    if (v != e) {
+        fprintf(stderr, "\033[31m%s:%u: assert %s failed with %jd, "
+                "expected %jd\033[0m\n", file, line, s, v, e);
+        exit(-2);
+    }
+}
+
+#define test_assert(s, v, e) test_assert(__FILE__, __LINE__, s, v, e)
+
+
+// utility functions for traversals
+int test_count(void *p, lfs_block_t b) {
+    unsigned *u = (unsigned*)p;
+    *u += 1;
+    return 0;
+}
+
+
+// block device hooks implemented on top of reads
+int test_bd_cmp(const struct lfs_config *c, lfs_block_t block,
+        lfs_off_t off, const void *buffer, lfs_size_t size) {
+    const uint8_t *data = buffer;
+    uint8_t dat[c->read_size];
+    while (size > 0) {
+        lfs_off_t aoff = off - (off % c->read_size);
+        lfs_size_t diff = c->read_size - (off - aoff);
+        diff = size < diff ? size : diff;
+        int err = lfs_emubd_read(c, block, aoff, dat, c->read_size);
+        if (err) {
+            return err;
+        }
+
+        if (memcmp(&dat[off - aoff], data, diff) != 0) {
+            return false;
+        }
+
+        data += diff;
+        off += diff;
+        size -= diff;
+    }
+
+    return true;
+}
+
+int test_bd_crc(const struct lfs_config *c, lfs_block_t block,
+        lfs_off_t off, lfs_size_t size, uint32_t *crc) {
+    uint8_t dat[c->read_size];
+    while (size > 0) {
+        lfs_off_t aoff = off - (off % c->read_size);
+        lfs_size_t diff = c->read_size - (off - aoff);
+        diff = size < diff ? size : diff;
+        int err = lfs_emubd_read(c, block, aoff, dat, c->read_size);
+        if (err) {
+            return err;
+        }
+
+        lfs_crc(crc, &dat[off - aoff], diff);
+
+        off += diff;
+        size -= diff;
+    }
+
+    return 0;
+}
+
+int test_bd_copy(const struct lfs_config *c, lfs_block_t block,
+        lfs_off_t off, lfs_block_t src, lfs_off_t srcoff, lfs_size_t size) {
+    uint8_t dat[c->prog_size];
+    while (size > 0) {
+        int err = lfs_emubd_read(c, src, srcoff, dat, c->prog_size);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_emubd_prog(c, block, off, dat, c->prog_size);
+        if (err) {
+            return err;
+        }
+
+        off += c->prog_size;
+        srcoff += c->prog_size;
+        size -= c->prog_size;
+    }
+
+    return 0;
+}
+
+
+// lfs declarations
+lfs_t lfs;
+lfs_emubd_t bd;
+lfs_file_t file[4];
+lfs_dir_t dir[4];
+struct lfs_info info;
+
+uint8_t buffer[1024];
+uint8_t wbuffer[1024];
+uint8_t rbuffer[1024];
+lfs_size_t size;
+lfs_size_t wsize;
+lfs_size_t rsize;
+
+uintmax_t res;
+
+#ifndef LFS_READ_SIZE
+#define LFS_READ_SIZE 16
+#endif
+
+#ifndef LFS_PROG_SIZE
+#define LFS_PROG_SIZE 16
+#endif
+
+#ifndef LFS_BLOCK_SIZE
+#define LFS_BLOCK_SIZE 512
+#endif
+
+#ifndef LFS_BLOCK_COUNT
+#define LFS_BLOCK_COUNT 1024
+#endif
+
+#ifndef LFS_LOOKAHEAD
+#define LFS_LOOKAHEAD 128
+#endif
+
+#ifndef LFS_READ_LINES
+#define LFS_READ_LINES 1
+#endif
+
+#ifndef LFS_READ_AHEAD
+#define LFS_READ_AHEAD (8*LFS_READ_SIZE)
+#endif
+
+#ifndef LFS_LOOKUP_CACHE
+#define LFS_LOOKUP_CACHE 8
+#endif
+
+#ifndef LFS_PROG_LINES
+#define LFS_PROG_LINES 2
+#endif
+
+#ifndef LFS_ERASE_AHEAD
+#define LFS_ERASE_AHEAD 0
+#endif
+
+#ifndef LFS_ERASE_MAP
+#define LFS_ERASE_MAP false
+#endif
+
+#ifndef LFS_GROUP_COMMIT
+#define LFS_GROUP_COMMIT false
+#endif
+
+#ifndef LFS_INLINE_SIZE
+#define LFS_INLINE_SIZE 0
+#endif
+
+#ifndef LFS_PACK_SIZE
+#define LFS_PACK_SIZE 0
+#endif
+
+#ifndef LFS_SPAN_READS
+#define LFS_SPAN_READS false
+#endif
+
+const struct lfs_config cfg = {
+    .context = &bd,
+    .read  = &lfs_emubd_read,
+    .prog  = &lfs_emubd_prog,
+    .erase = &lfs_emubd_erase,
+    .sync  = &lfs_emubd_sync,
+#ifdef LFS_BD_HOOKS
+    .cmp   = &test_bd_cmp,
+    .crc   = &test_bd_crc,
+    .copy  = &test_bd_copy,
+#endif
+#ifdef LFS_BD_ASYNC
+    .prog_async = &lfs_emubd_prog_async,
+    .wait  = &lfs_emubd_wait,
+#endif
+
+    .read_size   = LFS_READ_SIZE,
+    .prog_size   = LFS_PROG_SIZE,
+    .block_size  = LFS_BLOCK_SIZE,
+    .block_count = LFS_BLOCK_COUNT,
+    .lookahead   = LFS_LOOKAHEAD,
+    .read_lines  = LFS_READ_LINES,
+    .prog_lines  = LFS_PROG_LINES,
+    .erase_ahead = LFS_ERASE_AHEAD,
+    .erase_map   = LFS_ERASE_MAP,
+    .group_commit = LFS_GROUP_COMMIT,
+    .read_ahead  = LFS_READ_AHEAD,
+    .span_reads  = LFS_SPAN_READS,
+    .lookup_cache = LFS_LOOKUP_CACHE,
+    .inline_size = LFS_INLINE_SIZE,
+    .pack_size   = LFS_PACK_SIZE,
+};
+
+
+// Entry point
+int main() {
+    lfs_emubd_create(&cfg, "blocks");
+
+    static uint8_t model[65536];
+    srand(0);
+    for (int i = 0; i < 65536; i++) {
+        model[i] = rand() & 0xff;
+    }
+
+    clock_t start = clock();
+    res = lfs_mount(&lfs, &cfg);
+    test_assert("lfs_mount", res, 0);
+    res = lfs_file_open(&lfs, &file[0], "config", LFS_O_RDWR);
+    test_assert("lfs_file_open", res, 0);
+    for (int i = 0; i < 64; i++) {
+        lfs_off_t off = rand() % (65536 - 16);
+        size = 1 + rand() % 16;
+        for (int j = 0; j < size; j++) {
+            model[off+j] = rand() & 0xff;
+        }
+        res = lfs_file_seek(&lfs, &file[0], off, LFS_SEEK_SET);
+        test_assert("lfs_file_seek", res, off);
+        res = lfs_file_write(&lfs, &file[0], &model[off], size);
+        test_assert("lfs_file_write", res, size);
+        res = lfs_file_sync(&lfs, &file[0]);
+        test_assert("lfs_file_sync", res, 0);
+    }
+    res = lfs_file_close(&lfs, &file[0]);
+    test_assert("lfs_file_close", res, 0);
+    res = lfs_unmount(&lfs);
+    test_assert("lfs_unmount", res, 0);
+    clock_t ticks = clock() - start;
+    printf("overwrite: %ld us for 64 writes\n",
+            (long)(ticks * 1000000 / CLOCKS_PER_SEC));
+    res = lfs_mount(&lfs, &cfg);
+    test_assert("lfs_mount", res, 0);
+    res = lfs_file_open(&lfs, &file[0], "config", LFS_O_RDONLY);
+    test_assert("lfs_file_open", res, 0);
+    res = lfs_file_size(&lfs, &file[0]);
+    test_assert("lfs_file_size", res, 65536);
+    for (int i = 0; i < 65536; i += sizeof(buffer)) {
+        res = lfs_file_read(&lfs, &file[0], buffer, sizeof(buffer));
+        test_assert("lfs_file_read", res, sizeof(buffer));
+        res = memcmp(buffer, &model[i], sizeof(buffer));
+        test_assert("memcmp", res, 0);
+    }
+    res = lfs_file_close(&lfs, &file[0]);
+    test_assert("lfs_file_close", res, 0);
+    res = lfs_unmount(&lfs);
+    test_assert("lfs_unmount", res, 0);
+
+
+    lfs_emubd_destroy(&cfg);
+}
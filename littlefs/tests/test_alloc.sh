@@ -114,6 +114,90 @@ echo "--- Cleanup ---"
 lfs_remove multiprocreuse
 lfs_remove singleprocreuse
 
+echo "--- Erase-ahead test ---"
+tests/test.py << TEST
+    struct lfs_config ecfg = cfg;
+    ecfg.erase_ahead = 4;
+    ecfg.pack_size = 0;
+    lfs_mount(&lfs, &ecfg) => 0;
+    while (lfs_gc_step(&lfs, 1) == 1);
+    lfs.free.eready => 4;
+
+    uint64_t erases = bd.stats.erase_count;
+    lfs_file_open(&lfs, &file[0], "eraseahead",
+            LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    size = strlen("eraseahead");
+    memcpy(buffer, "eraseahead", size);
+    for (int i = 0; i < 100; i++) {
+        lfs_file_write(&lfs, &file[0], buffer, size) => size;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+
+    // only metadata commits needed an erase, clearing the checkpoint,
+    // creating the file and closing it, unless the close could be
+    // appended to the dir
+    bool room = (4*cfg.prog_size <= cfg.block_size);
+    bd.stats.erase_count - erases => room ? 2 : 3;
+    lfs.free.eready => 2;
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_open(&lfs, &file[0], "eraseahead", LFS_O_RDONLY) => 0;
+    size = strlen("eraseahead");
+    for (int i = 0; i < 100; i++) {
+        lfs_file_read(&lfs, &file[0], buffer, size) => size;
+        memcmp(buffer, "eraseahead", size) => 0;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_remove(&lfs, "eraseahead") => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Erase map test ---"
+tests/test.py << TEST
+    struct lfs_config ecfg = cfg;
+    ecfg.erase_ahead = 4;
+    ecfg.erase_map = true;
+    lfs_mount(&lfs, &ecfg) => 0;
+    while (lfs_gc_step(&lfs, 1) == 1);
+    lfs_mkdir(&lfs, "erasemap") => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    struct lfs_config ecfg = cfg;
+    ecfg.erase_map = true;
+    lfs_mount(&lfs, &ecfg) => 0;
+    uint64_t erases = bd.stats.erase_count;
+    lfs_file_open(&lfs, &file[0], "erasemap/file",
+            LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    size = strlen("erasemap");
+    memcpy(buffer, "erasemap", size);
+    for (int i = 0; i < 100; i++) {
+        lfs_file_write(&lfs, &file[0], buffer, size) => size;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+
+    // the unused half of the new directory was still erased when the
+    // checkpoint was saved, so its first commit didn't need an erase
+    lfs.estats.skip_count => 1;
+    bd.stats.erase_count - erases => lfs.estats.erase_count;
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_open(&lfs, &file[0], "erasemap/file", LFS_O_RDONLY) => 0;
+    size = strlen("erasemap");
+    for (int i = 0; i < 100; i++) {
+        lfs_file_read(&lfs, &file[0], buffer, size) => size;
+        memcmp(buffer, "erasemap", size) => 0;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_remove(&lfs, "erasemap/file") => 0;
+    lfs_remove(&lfs, "erasemap") => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
 echo "--- Exhaustion test ---"
 tests/test.py << TEST
     lfs_mount(&lfs, &cfg) => 0;
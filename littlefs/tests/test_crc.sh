@@ -0,0 +1,68 @@
+#!/bin/bash
+set -eu
+
+echo "=== CRC tests ==="
+
+SIZE=1048576
+
+lfs_crc_check() {
+rm -f lfs_util.o
+CFLAGS="${CFLAGS:-} $1" tests/test.py << TEST
+    uint32_t rtable[256];
+    for (int i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) {
+            c = (c >> 1) ^ ((c & 1) ? 0xedb88320 : 0);
+        }
+        rtable[i] = c;
+    }
+
+    // known value
+    uint32_t crc = 0xffffffff;
+    lfs_crc(&crc, "123456789", 9);
+    crc ^ 0xffffffff => 0xcbf43926;
+
+    // against bitwise reference for all sizes and alignments
+    srand(1);
+    for (int i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = rand();
+    }
+
+    for (int off = 0; off < 8; off++) {
+        for (size = 0; size < 128; size++) {
+            uint32_t expected = 0xffffffff;
+            for (int i = 0; i < size; i++) {
+                expected = (expected >> 8)
+                        ^ rtable[(expected ^ buffer[off+i]) & 0xff];
+            }
+
+            crc = 0xffffffff;
+            lfs_crc(&crc, &buffer[off], size);
+            crc => expected;
+
+            crc = 0xffffffff;
+            lfs_crc(&crc, &buffer[off], size/3);
+            lfs_crc(&crc, &buffer[off+size/3], size - size/3);
+            crc => expected;
+        }
+    }
+
+    // throughput
+    clock_t start = clock();
+    crc = 0xffffffff;
+    for (int i = 0; i < $SIZE/sizeof(buffer); i++) {
+        lfs_crc(&crc, buffer, sizeof(buffer));
+    }
+    clock_t ticks = clock() - start;
+    printf("$2: %ld us for $SIZE bytes\n",
+            (long)(ticks * 1000000 / CLOCKS_PER_SEC));
+TEST
+}
+
+echo "--- Nibble table ---"
+lfs_crc_check "" nibble
+echo "--- Byte table ---"
+lfs_crc_check "-DLFS_CRC_BYTE" byte
+echo "--- Slicing-by-8 ---"
+lfs_crc_check "-DLFS_CRC_SLICE8" slice8
+rm -f lfs_util.o
@@ -315,5 +315,122 @@ tests/test.py << TEST
     lfs_unmount(&lfs) => 0;
 TEST
 
+echo "--- Unhashed entries ---"
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_mkdir(&lfs, "logs") => 0;
+
+    // write entries as a v1.1 littlefs would
+    lfs.version = 0x00010001;
+    for (int i = 0; i < 16; i += 2) {
+        sprintf((char*)buffer, "logs/log%04d", i);
+        lfs_file_open(&lfs, &file[0], (char*)buffer,
+                LFS_O_WRONLY | LFS_O_CREAT) => 0;
+        lfs_file_close(&lfs, &file[0]) => 0;
+    }
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    for (int i = 1; i < 16; i += 2) {
+        sprintf((char*)buffer, "logs/log%04d", i);
+        lfs_file_open(&lfs, &file[0], (char*)buffer,
+                LFS_O_WRONLY | LFS_O_CREAT) => 0;
+        lfs_file_write(&lfs, &file[0], buffer, i) => i;
+        lfs_file_close(&lfs, &file[0]) => 0;
+    }
+    lfs_rename(&lfs, "logs/log0001", "logs/log0000") => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_stat(&lfs, "logs/log0000", &info) => 0;
+    info.size => 1;
+    lfs_stat(&lfs, "logs/log0001", &info) => LFS_ERR_NOENT;
+    for (int i = 2; i < 16; i++) {
+        sprintf((char*)buffer, "logs/log%04d", i);
+        lfs_stat(&lfs, (char*)buffer, &info) => 0;
+        info.size => (i % 2) ? i : 0;
+    }
+    lfs_stat(&lfs, "logs/log0016", &info) => LFS_ERR_NOENT;
+
+    lfs_dir_open(&lfs, &dir[0], "logs") => 0;
+    lfs_dir_read(&lfs, &dir[0], &info) => 1;
+    lfs_dir_read(&lfs, &dir[0], &info) => 1;
+    for (int i = 0; i < 16; i += 2) {
+        sprintf((char*)buffer, "log%04d", i);
+        lfs_dir_read(&lfs, &dir[0], &info) => 1;
+        strcmp(info.name, (char*)buffer) => 0;
+    }
+    for (int i = 3; i < 16; i += 2) {
+        sprintf((char*)buffer, "log%04d", i);
+        lfs_dir_read(&lfs, &dir[0], &info) => 1;
+        strcmp(info.name, (char*)buffer) => 0;
+    }
+    lfs_dir_read(&lfs, &dir[0], &info) => 0;
+    lfs_dir_close(&lfs, &dir[0]) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Appended commits ---"
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_mkdir(&lfs, "appended") => 0;
+    lfs_file_open(&lfs, &file[0], "appended/counter",
+            LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    lfs_file_sync(&lfs, &file[0]) => 0;
+
+    // syncs only append to the dir until its block fills up, so only
+    // each sync's new data block needs erasing
+    uint64_t erases = bd.stats.erase_count;
+    lfs_file_write(&lfs, &file[0], "a", 1) => 1;
+    lfs_file_sync(&lfs, &file[0]) => 0;
+    lfs_file_write(&lfs, &file[0], "a", 1) => 1;
+    lfs_file_sync(&lfs, &file[0]) => 0;
+    bool room = (4*cfg.prog_size <= cfg.block_size);
+    if (room) {
+        bd.stats.erase_count - erases => 2;
+    }
+
+    for (int i = 2; i < 100; i++) {
+        lfs_file_write(&lfs, &file[0], "a", 1) => 1;
+        lfs_file_sync(&lfs, &file[0]) => 0;
+    }
+    // the dir's other block only needs erasing once appended commits,
+    // each at most 48 bytes before alignment, fill up the current one,
+    // rewriting the pair on every sync would double the erases
+    if (room) {
+        lfs_size_t rewrites = 100*(48 + cfg.prog_size) / cfg.block_size;
+        bd.stats.erase_count - erases <= 100 + rewrites => true;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_stat(&lfs, "appended/counter", &info) => 0;
+    info.size => 100;
+    lfs_file_open(&lfs, &file[0], "appended/counter", LFS_O_RDONLY) => 0;
+    lfs_file_read(&lfs, &file[0], buffer, 200) => 100;
+    lfs_file_close(&lfs, &file[0]) => 0;
+
+    // v1 littlefs can't read appended commits, so keep rewriting pairs
+    lfs.version = 0x00010002;
+    lfs_file_open(&lfs, &file[0], "appended/counter",
+            LFS_O_WRONLY | LFS_O_APPEND) => 0;
+    lfs_file_write(&lfs, &file[0], "a", 1) => 1;
+    lfs_file_sync(&lfs, &file[0]) => 0;
+    uint64_t erases = bd.stats.erase_count;
+    lfs_file_write(&lfs, &file[0], "a", 1) => 1;
+    lfs_file_sync(&lfs, &file[0]) => 0;
+    bd.stats.erase_count - erases => 2;
+    lfs_file_close(&lfs, &file[0]) => 0;
+
+    lfs_rename(&lfs, "appended/counter", "appended/renamed") => 0;
+    lfs_remove(&lfs, "appended/renamed") => 0;
+    lfs_remove(&lfs, "appended") => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
 echo "--- Results ---"
 tests/stats.py
@@ -53,7 +53,7 @@ tests/test.py << TEST
     lfs_size_t chunk = 29;
     srand(0);
     lfs_mount(&lfs, &cfg) => 0;
-    lfs_file_open(&lfs, &file[0], "$2", LFS_O_RDONLY) => 0;
+    lfs_file_open(&lfs, &file[0], "$2", ${3:-LFS_O_RDONLY}) => 0;
     for (lfs_size_t i = 0; i < size; i += chunk) {
         chunk = (chunk < size - i) ? chunk : size - i;
         lfs_file_read(&lfs, &file[0], buffer, chunk) => chunk;
@@ -83,6 +83,35 @@ r_test $SMALLSIZE smallavacado
 r_test $MEDIUMSIZE mediumavacado
 r_test $LARGESIZE largeavacado
 
+echo "--- Sequential read test ---"
+r_test $SMALLSIZE smallavacado "LFS_O_RDONLY | LFS_O_SEQUENTIAL"
+r_test $MEDIUMSIZE mediumavacado "LFS_O_RDONLY | LFS_O_SEQUENTIAL"
+r_test $LARGESIZE largeavacado "LFS_O_RDONLY | LFS_O_SEQUENTIAL"
+
+echo "--- Sequential seek test ---"
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_open(&lfs, &file[0], "largeavacado",
+            LFS_O_RDONLY | LFS_O_SEQUENTIAL) => 0;
+    lfs_file_open(&lfs, &file[1], "largeavacado", LFS_O_RDONLY) => 0;
+    srand(1);
+    for (int i = 0; i < 256; i++) {
+        if (i % 16 == 0) {
+            lfs_soff_t off = rand() % ($LARGESIZE - 64);
+            lfs_file_seek(&lfs, &file[0], off, LFS_SEEK_SET) => off;
+            lfs_file_seek(&lfs, &file[1], off, LFS_SEEK_SET) => off;
+        }
+
+        size = 1 + rand() % 64;
+        rsize = lfs_file_read(&lfs, &file[0], rbuffer, size);
+        lfs_file_read(&lfs, &file[1], wbuffer, size) => rsize;
+        memcmp(rbuffer, wbuffer, rsize) => 0;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_file_close(&lfs, &file[1]) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
 echo "--- Dir check ---"
 tests/test.py << TEST
     lfs_mount(&lfs, &cfg) => 0;
@@ -110,5 +139,473 @@ tests/test.py << TEST
     lfs_unmount(&lfs) => 0;
 TEST
 
+echo "--- Inline file test ---"
+tests/test.py << TEST
+    struct lfs_config icfg = cfg;
+    icfg.inline_size = 64;
+    icfg.pack_size = 0;
+    lfs_mount(&lfs, &icfg) => 0;
+    lfs_mkdir(&lfs, "inline") => 0;
+    unsigned before = 0;
+    lfs_traverse(&lfs, test_count, &before) => 0;
+
+    // small files take up no blocks of their own
+    lfs_file_open(&lfs, &file[0], "inline/small",
+            LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    size = strlen("Hello World!\n");
+    memcpy(wbuffer, "Hello World!\n", size);
+    for (int i = 0; i < 4; i++) {
+        lfs_file_write(&lfs, &file[0], wbuffer, size) => size;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_file_open(&lfs, &file[0], "inline/other",
+            LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    lfs_file_write(&lfs, &file[0], wbuffer, size) => size;
+    lfs_file_close(&lfs, &file[0]) => 0;
+
+    unsigned after = 0;
+    lfs_traverse(&lfs, test_count, &after) => 0;
+    after => before;
+    lfs_stat(&lfs, "inline/small", &info) => 0;
+    info.type => LFS_TYPE_REG;
+    info.size => 4*size;
+
+    // rewriting in place keeps it inline
+    lfs_file_open(&lfs, &file[0], "inline/small", LFS_O_RDWR) => 0;
+    lfs_file_seek(&lfs, &file[0], size, LFS_SEEK_SET) => size;
+    lfs_file_write(&lfs, &file[0], "HELLO", 5) => 5;
+    lfs_file_close(&lfs, &file[0]) => 0;
+    after = 0;
+    lfs_traverse(&lfs, test_count, &after) => 0;
+    after => before;
+
+    // growing past the inline size moves it out to blocks
+    lfs_file_open(&lfs, &file[0], "inline/other",
+            LFS_O_WRONLY | LFS_O_APPEND) => 0;
+    for (int i = 0; i < 8; i++) {
+        lfs_file_write(&lfs, &file[0], wbuffer, size) => size;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+    after = 0;
+    lfs_traverse(&lfs, test_count, &after) => 0;
+    after => before+1;
+    lfs_stat(&lfs, "inline/other", &info) => 0;
+    info.size => 9*size;
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    size = strlen("Hello World!\n");
+    lfs_file_open(&lfs, &file[0], "inline/small", LFS_O_RDONLY) => 0;
+    lfs_file_read(&lfs, &file[0], rbuffer, sizeof(rbuffer)) => 4*size;
+    memcmp(rbuffer, "Hello World!\nHELLO World!\n", 2*size) => 0;
+    memcmp(&rbuffer[2*size], "Hello World!\nHello World!\n", 2*size) => 0;
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_file_open(&lfs, &file[0], "inline/other", LFS_O_RDONLY) => 0;
+    for (int i = 0; i < 9; i++) {
+        lfs_file_read(&lfs, &file[0], rbuffer, size) => size;
+        memcmp(rbuffer, "Hello World!\n", size) => 0;
+    }
+    lfs_file_read(&lfs, &file[0], rbuffer, size) => 0;
+    lfs_file_close(&lfs, &file[0]) => 0;
+
+    // inline files can be renamed and listed like any other
+    lfs_rename(&lfs, "inline/small", "inline/other") => 0;
+    lfs_stat(&lfs, "inline/small", &info) => LFS_ERR_NOENT;
+    lfs_dir_open(&lfs, &dir[0], "inline") => 0;
+    lfs_dir_read(&lfs, &dir[0], &info) => 1;
+    lfs_dir_read(&lfs, &dir[0], &info) => 1;
+    lfs_dir_read(&lfs, &dir[0], &info) => 1;
+    strcmp(info.name, "other") => 0;
+    info.type => LFS_TYPE_REG;
+    info.size => 4*size;
+    lfs_dir_read(&lfs, &dir[0], &info) => 0;
+    lfs_dir_close(&lfs, &dir[0]) => 0;
+    lfs_file_open(&lfs, &file[0], "inline/other", LFS_O_RDONLY) => 0;
+    lfs_file_read(&lfs, &file[0], rbuffer, sizeof(rbuffer)) => 4*size;
+    memcmp(rbuffer, "Hello World!\nHELLO World!\n", 2*size) => 0;
+    lfs_file_close(&lfs, &file[0]) => 0;
+
+    // without an inline size, writes move files out to blocks
+    lfs_file_open(&lfs, &file[0], "inline/other",
+            LFS_O_WRONLY | LFS_O_APPEND) => 0;
+    lfs_file_write(&lfs, &file[0], "!", 1) => 1;
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_stat(&lfs, "inline/other", &info) => 0;
+    info.size => 4*size+1;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Inline dir spill test ---"
+tests/test.py << TEST
+    struct lfs_config icfg = cfg;
+    icfg.inline_size = 64;
+    icfg.pack_size = 0;
+    lfs_mount(&lfs, &icfg) => 0;
+    lfs_mkdir(&lfs, "inspill") => 0;
+
+    // inline entries fill up a dir block quickly, so these spill over
+    // into more dir blocks
+    for (int i = 0; i < 12; i++) {
+        sprintf((char*)buffer, "inspill/f%d", i);
+        lfs_file_open(&lfs, &file[0], (char*)buffer,
+                LFS_O_WRONLY | LFS_O_CREAT) => 0;
+        memset(wbuffer, 'a' + i, 60);
+        lfs_file_write(&lfs, &file[0], wbuffer, 60) => 60;
+        lfs_file_close(&lfs, &file[0]) => 0;
+    }
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    for (int i = 0; i < 12; i++) {
+        sprintf((char*)buffer, "inspill/f%d", i);
+        lfs_stat(&lfs, (char*)buffer, &info) => 0;
+        info.size => 60;
+        lfs_file_open(&lfs, &file[0], (char*)buffer, LFS_O_RDONLY) => 0;
+        memset(wbuffer, 'a' + i, 60);
+        lfs_file_read(&lfs, &file[0], rbuffer, 64) => 60;
+        memcmp(rbuffer, wbuffer, 60) => 0;
+        lfs_file_close(&lfs, &file[0]) => 0;
+    }
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Packed file test ---"
+tests/test.py << TEST
+    struct lfs_config pcfg = cfg;
+    pcfg.inline_size = 0;
+    pcfg.pack_size = 256;
+    lfs_mount(&lfs, &pcfg) => 0;
+    lfs_mkdir(&lfs, "packed") => 0;
+    bool room = (pcfg.pack_size + pcfg.prog_size <= pcfg.block_size);
+
+    // small files share a pack block
+    size = strlen("Hello World!\n");
+    memcpy(wbuffer, "Hello World!\n", size);
+    for (int i = 0; i < 4; i++) {
+        sprintf((char*)buffer, "packed/small%d", i);
+        lfs_file_open(&lfs, &file[0], (char*)buffer,
+                LFS_O_WRONLY | LFS_O_CREAT) => 0;
+        for (int j = 0; j < i+1; j++) {
+            lfs_file_write(&lfs, &file[0], wbuffer, size) => size;
+        }
+        lfs_file_close(&lfs, &file[0]) => 0;
+    }
+    lfs_file_open(&lfs, &file[0], "packed/small0", LFS_O_RDONLY) => 0;
+    lfs_file_open(&lfs, &file[1], "packed/small3", LFS_O_RDONLY) => 0;
+    if (room) {
+        file[0].head => file[1].head;
+        file[0].head => lfs.pack.block;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_file_close(&lfs, &file[1]) => 0;
+
+    // appending copies the file to the end of the pack
+    lfs_file_open(&lfs, &file[0], "packed/small0",
+            LFS_O_WRONLY | LFS_O_APPEND) => 0;
+    lfs_file_write(&lfs, &file[0], wbuffer, size) => size;
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_file_open(&lfs, &file[0], "packed/small0", LFS_O_RDONLY) => 0;
+    if (room) {
+        file[0].head => lfs.pack.block;
+    }
+    file[0].size => 2*size;
+    lfs_file_close(&lfs, &file[0]) => 0;
+
+    // growing past the pack size moves it out to blocks
+    lfs_file_open(&lfs, &file[0], "packed/small1",
+            LFS_O_WRONLY | LFS_O_APPEND) => 0;
+    for (int i = 0; i < 20; i++) {
+        lfs_file_write(&lfs, &file[0], wbuffer, size) => size;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_file_open(&lfs, &file[0], "packed/small1", LFS_O_RDONLY) => 0;
+    file[0].head != lfs.pack.block => true;
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    size = strlen("Hello World!\n");
+    lfs_size_t sizes[4] = {2, 22, 3, 4};
+    for (int i = 0; i < 4; i++) {
+        sprintf((char*)buffer, "packed/small%d", i);
+        lfs_stat(&lfs, (char*)buffer, &info) => 0;
+        info.type => LFS_TYPE_REG;
+        info.size => sizes[i]*size;
+        lfs_file_open(&lfs, &file[0], (char*)buffer, LFS_O_RDONLY) => 0;
+        for (lfs_size_t j = 0; j < sizes[i]; j++) {
+            lfs_file_read(&lfs, &file[0], rbuffer, size) => size;
+            memcmp(rbuffer, "Hello World!\n", size) => 0;
+        }
+        lfs_file_read(&lfs, &file[0], rbuffer, size) => 0;
+        lfs_file_close(&lfs, &file[0]) => 0;
+    }
+
+    // packed files can be renamed, and modifying them moves them out
+    lfs_rename(&lfs, "packed/small2", "packed/small3") => 0;
+    lfs_file_open(&lfs, &file[0], "packed/small3", LFS_O_RDWR) => 0;
+    lfs_file_write(&lfs, &file[0], "HELLO", 5) => 5;
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_file_open(&lfs, &file[0], "packed/small3", LFS_O_RDONLY) => 0;
+    lfs_file_read(&lfs, &file[0], rbuffer, sizeof(rbuffer)) => 3*size;
+    memcmp(rbuffer, "HELLO World!\nHello World!\n", 2*size) => 0;
+    lfs_file_close(&lfs, &file[0]) => 0;
+
+    lfs_remove(&lfs, "packed/small0") => 0;
+    lfs_remove(&lfs, "packed/small1") => 0;
+    lfs_remove(&lfs, "packed/small3") => 0;
+    lfs_remove(&lfs, "packed") => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Extent file test ---"
+rm -rf blocks
+tests/test.py << TEST
+    lfs_format(&lfs, &cfg) => 0;
+TEST
+tests/test.py << TEST
+    struct lfs_config xcfg = cfg;
+    xcfg.span_reads = true;
+    lfs_mount(&lfs, &xcfg) => 0;
+    lfs_mkdir(&lfs, "extent") => 0;
+
+    // a new file's blocks come out of the allocator in a single run
+    size = 8*xcfg.block_size;
+    lfs_file_open(&lfs, &file[0], "extent/large",
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_EXTENT) => 0;
+    for (lfs_size_t i = 0; i < size; i += 64) {
+        memset(wbuffer, 'a' + (i/64)%26, 64);
+        lfs_file_write(&lfs, &file[0], wbuffer, 64) => 64;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_file_open(&lfs, &file[0], "extent/large", LFS_O_RDONLY) => 0;
+    file[0].ecount => 1;
+    file[0].extents[0].count => 8;
+    file[0].head => file[0].extents[0].block;
+
+    // so reads across blocks take a single read
+    uint64_t reads = bd.stats.read_count;
+    lfs_file_read(&lfs, &file[0], rbuffer, 1024) => 1024;
+    bd.stats.read_count - reads => 1;
+    for (lfs_size_t i = 0; i < 1024; i += 64) {
+        memset(wbuffer, 'a' + (i/64)%26, 64);
+        memcmp(&rbuffer[i], wbuffer, 64) => 0;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+
+    // modifying the middle keeps the whole blocks before it
+    lfs_file_open(&lfs, &file[0], "extent/large", LFS_O_RDWR) => 0;
+    lfs_file_seek(&lfs, &file[0], 3*xcfg.block_size + 100,
+            LFS_SEEK_SET) => 3*xcfg.block_size + 100;
+    lfs_file_write(&lfs, &file[0], "HELLO", 5) => 5;
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_file_open(&lfs, &file[0], "extent/large", LFS_O_RDONLY) => 0;
+    lfs_file_size(&lfs, &file[0]) => size;
+    file[0].ecount => 2;
+    file[0].extents[0].count => 3;
+    file[0].extents[1].count => 5;
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_stat(&lfs, "extent/large", &info) => 0;
+    info.type => LFS_TYPE_REG;
+    info.size => 8*cfg.block_size;
+
+    // extent files can be renamed and read back in small pieces
+    lfs_rename(&lfs, "extent/large", "extent/moved") => 0;
+    lfs_file_open(&lfs, &file[0], "extent/moved", LFS_O_RDONLY) => 0;
+    for (lfs_size_t i = 0; i < 8*cfg.block_size; i += 64) {
+        memset(wbuffer, 'a' + (i/64)%26, 64);
+        if (i == 3*cfg.block_size + 64) {
+            memcpy(&wbuffer[36], "HELLO", 5);
+        }
+        lfs_file_read(&lfs, &file[0], rbuffer, 64) => 64;
+        memcmp(rbuffer, wbuffer, 64) => 0;
+    }
+    lfs_file_read(&lfs, &file[0], rbuffer, 64) => 0;
+    lfs_file_close(&lfs, &file[0]) => 0;
+
+    // and stay extent files when opened without LFS_O_EXTENT
+    lfs_file_open(&lfs, &file[0], "extent/moved",
+            LFS_O_WRONLY | LFS_O_APPEND) => 0;
+    lfs_file_write(&lfs, &file[0], "tail", 4) => 4;
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_file_open(&lfs, &file[0], "extent/moved", LFS_O_RDONLY) => 0;
+    (file[0].flags & LFS_F_EXTENT) != 0 => true;
+    lfs_file_seek(&lfs, &file[0], 8*cfg.block_size,
+            LFS_SEEK_SET) => 8*cfg.block_size;
+    lfs_file_read(&lfs, &file[0], rbuffer, 64) => 4;
+    memcmp(rbuffer, "tail", 4) => 0;
+    lfs_file_close(&lfs, &file[0]) => 0;
+
+    unsigned before = 0;
+    lfs_traverse(&lfs, test_count, &before) => 0;
+    lfs_remove(&lfs, "extent/moved") => 0;
+    unsigned after = 0;
+    lfs_traverse(&lfs, test_count, &after) => 0;
+    int diff = before - after;
+    diff => 9;
+    lfs_remove(&lfs, "extent") => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Fragmented extent test ---"
+rm -rf blocks
+tests/test.py << TEST
+    lfs_format(&lfs, &cfg) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    size = 16*cfg.block_size;
+    lfs_file_open(&lfs, &file[0], "frag1",
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_EXTENT) => 0;
+    for (lfs_size_t i = 0; i < size; i += 64) {
+        memset(wbuffer, 'a' + (i/64)%26, 64);
+        lfs_file_write(&lfs, &file[0], wbuffer, 64) => 64;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+
+    // files written in turn take every other block, more runs than
+    // they have extents for, so they carry on in skip-lists
+    lfs_file_open(&lfs, &file[0], "frag1", LFS_O_WRONLY) => 0;
+    lfs_file_open(&lfs, &file[1], "frag2",
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_EXTENT) => 0;
+    for (lfs_size_t i = 0; i < 12*cfg.block_size; i += 64) {
+        memset(wbuffer, 'A' + (i/64)%26, 64);
+        lfs_file_write(&lfs, &file[0], wbuffer, 64) => 64;
+        lfs_file_write(&lfs, &file[1], wbuffer, 64) => 64;
+    }
+    (file[0].flags & LFS_F_EXTENT) != 0 => false;
+    (file[1].flags & LFS_F_EXTENT) != 0 => false;
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_file_close(&lfs, &file[1]) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_stat(&lfs, "frag1", &info) => 0;
+    info.size => 16*cfg.block_size;
+    lfs_stat(&lfs, "frag2", &info) => 0;
+    info.size => 12*cfg.block_size;
+
+    lfs_file_open(&lfs, &file[0], "frag1", LFS_O_RDONLY) => 0;
+    (file[0].flags & LFS_F_EXTENT) != 0 => false;
+    for (lfs_size_t i = 0; i < 16*cfg.block_size; i += 64) {
+        memset(wbuffer, (i < 12*cfg.block_size ? 'A' : 'a') + (i/64)%26, 64);
+        lfs_file_read(&lfs, &file[0], rbuffer, 64) => 64;
+        memcmp(rbuffer, wbuffer, 64) => 0;
+    }
+    lfs_file_read(&lfs, &file[0], rbuffer, 64) => 0;
+    lfs_file_close(&lfs, &file[0]) => 0;
+
+    lfs_file_open(&lfs, &file[0], "frag2", LFS_O_RDONLY) => 0;
+    for (lfs_size_t i = 0; i < 12*cfg.block_size; i += 64) {
+        memset(wbuffer, 'A' + (i/64)%26, 64);
+        lfs_file_read(&lfs, &file[0], rbuffer, 64) => 64;
+        memcmp(rbuffer, wbuffer, 64) => 0;
+    }
+    lfs_file_read(&lfs, &file[0], rbuffer, 64) => 0;
+    lfs_file_close(&lfs, &file[0]) => 0;
+
+    lfs_remove(&lfs, "frag1") => 0;
+    lfs_remove(&lfs, "frag2") => 0;
+    unsigned count = 0;
+    lfs_traverse(&lfs, test_count, &count) => 0;
+    count => 4;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Extent dir spill test ---"
+rm -rf blocks
+tests/test.py << TEST
+    lfs_format(&lfs, &cfg) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_mkdir(&lfs, "spill") => 0;
+
+    // extent entries are large, so these spill over into more dir blocks
+    for (int i = 0; i < 12; i++) {
+        sprintf((char*)buffer, "spill/f%d", i);
+        lfs_file_open(&lfs, &file[0], (char*)buffer,
+                LFS_O_WRONLY | LFS_O_CREAT | LFS_O_EXTENT) => 0;
+        memset(wbuffer, 'a' + i, 100);
+        lfs_file_write(&lfs, &file[0], wbuffer, 100) => 100;
+        lfs_file_close(&lfs, &file[0]) => 0;
+    }
+
+    // as may renames within the last dir block
+    lfs_rename(&lfs, "spill/f11", "spill/g11") => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_stat(&lfs, "spill/f11", &info) => LFS_ERR_NOENT;
+    for (int i = 0; i < 12; i++) {
+        sprintf((char*)buffer, "spill/%c%d", (i < 11) ? 'f' : 'g', i);
+        lfs_stat(&lfs, (char*)buffer, &info) => 0;
+        info.size => 100;
+        lfs_file_open(&lfs, &file[0], (char*)buffer, LFS_O_RDONLY) => 0;
+        memset(wbuffer, 'a' + i, 100);
+        lfs_file_read(&lfs, &file[0], rbuffer, 100) => 100;
+        memcmp(rbuffer, wbuffer, 100) => 0;
+        lfs_file_close(&lfs, &file[0]) => 0;
+    }
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Extent rename over test ---"
+rm -rf blocks
+tests/test.py << TEST
+    lfs_format(&lfs, &cfg) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_mkdir(&lfs, "full") => 0;
+
+    // fill the first dir block up with small entries
+    for (int i = 0; i < 33; i++) {
+        sprintf((char*)buffer, "full/r%02d", i);
+        lfs_file_open(&lfs, &file[0], (char*)buffer,
+                LFS_O_WRONLY | LFS_O_CREAT) => 0;
+        lfs_file_close(&lfs, &file[0]) => 0;
+    }
+
+    lfs_file_open(&lfs, &file[0], "full/e",
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_EXTENT) => 0;
+    for (int i = 0; i < 1000; i++) {
+        wbuffer[i] = 'a' + (i % 26);
+    }
+    lfs_file_write(&lfs, &file[0], wbuffer, 1000) => 1000;
+    lfs_file_close(&lfs, &file[0]) => 0;
+
+    // no room for the extents, so they get moved out to a skip-list
+    lfs_rename(&lfs, "full/e", "full/r00") => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_stat(&lfs, "full/e", &info) => LFS_ERR_NOENT;
+    lfs_stat(&lfs, "full/r00", &info) => 0;
+    info.size => 1000;
+    lfs_file_open(&lfs, &file[0], "full/r00", LFS_O_RDONLY) => 0;
+    for (int i = 0; i < 1000; i++) {
+        wbuffer[i] = 'a' + (i % 26);
+    }
+    lfs_file_read(&lfs, &file[0], rbuffer, 1000) => 1000;
+    memcmp(rbuffer, wbuffer, 1000) => 0;
+    lfs_file_close(&lfs, &file[0]) => 0;
+    for (int i = 1; i < 33; i++) {
+        sprintf((char*)buffer, "full/r%02d", i);
+        lfs_stat(&lfs, (char*)buffer, &info) => 0;
+        info.size => 0;
+    }
+    lfs_unmount(&lfs) => 0;
+TEST
+
 echo "--- Results ---"
 tests/stats.py
@@ -57,8 +57,8 @@ echo "--- Move file corrupt source ---"
 tests/test.py << TEST
     lfs_mount(&lfs, &cfg) => 0;
     lfs_rename(&lfs, "b/hello", "c/hello") => 0;
-    lfs_unmount(&lfs) => 0;
 TEST
+# no unmount, a clean unmount would checkpoint the corrupted filesystem
 rm -v blocks/7
 tests/test.py << TEST
     lfs_mount(&lfs, &cfg) => 0;
@@ -84,7 +84,6 @@ echo "--- Move file corrupt source and dest ---"
 tests/test.py << TEST
     lfs_mount(&lfs, &cfg) => 0;
     lfs_rename(&lfs, "c/hello", "d/hello") => 0;
-    lfs_unmount(&lfs) => 0;
 TEST
 rm -v blocks/8
 rm -v blocks/a
@@ -138,7 +137,6 @@ echo "--- Move dir corrupt source ---"
 tests/test.py << TEST
     lfs_mount(&lfs, &cfg) => 0;
     lfs_rename(&lfs, "b/hi", "c/hi") => 0;
-    lfs_unmount(&lfs) => 0;
 TEST
 rm -v blocks/7
 tests/test.py << TEST
@@ -167,7 +165,6 @@ echo "--- Move dir corrupt source and dest ---"
 tests/test.py << TEST
     lfs_mount(&lfs, &cfg) => 0;
     lfs_rename(&lfs, "c/hi", "d/hi") => 0;
-    lfs_unmount(&lfs) => 0;
 TEST
 rm -v blocks/9
 rm -v blocks/a
@@ -193,7 +190,7 @@ tests/test.py << TEST
     lfs_unmount(&lfs) => 0;
 TEST
 
-echo "--- Move check ---"
+move_check() {
 tests/test.py << TEST
     lfs_mount(&lfs, &cfg) => 0;
 
@@ -230,7 +227,20 @@ tests/test.py << TEST
 
     lfs_unmount(&lfs) => 0;
 TEST
+}
 
+echo "--- Move check ---"
+move_check
+
+echo "--- Move deduplicate ---"
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_deduplicate(&lfs) => 0;
+    lfs.moves.count => 0;
+    lfs_deduplicate(&lfs) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+move_check
 
 echo "--- Results ---"
 tests/stats.py
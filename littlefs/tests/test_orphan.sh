@@ -1,23 +1,55 @@
 #!/bin/bash
 set -eu
 
-echo "=== Orphan tests ==="
-rm -rf blocks
-tests/test.py << TEST
-    lfs_format(&lfs, &cfg) => 0;
-TEST
-
-echo "--- Orphan test ---"
+lfs_mkorphan() {
 tests/test.py << TEST
     lfs_mount(&lfs, &cfg) => 0;
     lfs_mkdir(&lfs, "parent") => 0;
     lfs_mkdir(&lfs, "parent/orphan") => 0;
     lfs_mkdir(&lfs, "parent/child") => 0;
+
+    // find the orphan's predecessor in the linked-list of dirs
+    lfs_dir_open(&lfs, &dir[0], "parent/orphan") => 0;
+    lfs_dir_open(&lfs, &dir[1], "parent") => 0;
+    lfs_dir_open(&lfs, &dir[2], "parent/child") => 0;
+    int i = (dir[1].d.tail[0] == dir[0].pair[0] ||
+             dir[1].d.tail[0] == dir[0].pair[1]) ? 1 : 2;
+    const char *pred = (i == 1) ? "parent" : "parent/child";
+    lfs_block_t block = dir[i].pair[0];
+    lfs_off_t lend = dir[i].lend;
+    lfs_dir_close(&lfs, &dir[0]) => 0;
+    lfs_dir_close(&lfs, &dir[1]) => 0;
+    lfs_dir_close(&lfs, &dir[2]) => 0;
+
     lfs_remove(&lfs, "parent/orphan") => 0;
+
+    // drop the most recent commit, the update to the predecessor, which
+    // orphans the removed dir, the commit was either appended to the
+    // predecessor's block or written to the other block in its pair
+    lfs_dir_open(&lfs, &dir[0], pred) => 0;
+    sprintf((char*)buffer, "blocks/%x", dir[0].pair[0]);
+    if (dir[0].pair[0] == block) {
+        FILE *f = fopen((char*)buffer, "r+b");
+        fseek(f, lend, SEEK_SET) => 0;
+        for (lfs_off_t off = lend; off < cfg.block_size; off++) {
+            fputc(0, f);
+        }
+        fclose(f) => 0;
+    } else {
+        remove((char*)buffer) => 0;
+    }
+    lfs_dir_close(&lfs, &dir[0]) => 0;
 TEST
-# remove most recent file, this should be the update to the previous
-# linked-list entry and should orphan the child
-rm -v blocks/8
+}
+
+echo "=== Orphan tests ==="
+rm -rf blocks
+tests/test.py << TEST
+    lfs_format(&lfs, &cfg) => 0;
+TEST
+
+echo "--- Orphan test ---"
+lfs_mkorphan
 tests/test.py << TEST
     lfs_mount(&lfs, &cfg) => 0;
     lfs_stat(&lfs, "parent/orphan", &info) => LFS_ERR_NOENT;
@@ -37,5 +69,161 @@ tests/test.py << TEST
     lfs_unmount(&lfs) => 0;
 TEST
 
+echo "--- Checkpoint test ---"
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_mkdir(&lfs, "checkpoint") => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs.deorphaned => true;
+    lfs.checkpointed => true;
+    lfs_file_open(&lfs, &file[0], "checkpoint/a",
+            LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    size = strlen("aaaa");
+    for (int i = 0; i < 512; i++) {
+        lfs_file_write(&lfs, &file[0], "aaaa", size) => size;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs.checkpointed => false;
+TEST
+# no unmount, so the next mount has to deorphan again
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs.deorphaned => false;
+    lfs_file_open(&lfs, &file[0], "checkpoint/b",
+            LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    size = strlen("bbbb");
+    for (int i = 0; i < 512; i++) {
+        lfs_file_write(&lfs, &file[0], "bbbb", size) => size;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs.deorphaned => true;
+    lfs_file_open(&lfs, &file[0], "checkpoint/c",
+            LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    size = strlen("cccc");
+    for (int i = 0; i < 512; i++) {
+        lfs_file_write(&lfs, &file[0], "cccc", size) => size;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+
+    lfs_file_open(&lfs, &file[0], "checkpoint/a", LFS_O_RDONLY) => 0;
+    size = strlen("aaaa");
+    for (int i = 0; i < 512; i++) {
+        lfs_file_read(&lfs, &file[0], buffer, size) => size;
+        memcmp(buffer, "aaaa", size) => 0;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_file_open(&lfs, &file[0], "checkpoint/b", LFS_O_RDONLY) => 0;
+    size = strlen("bbbb");
+    for (int i = 0; i < 512; i++) {
+        lfs_file_read(&lfs, &file[0], buffer, size) => size;
+        memcmp(buffer, "bbbb", size) => 0;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Checkpoint append test ---"
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_open(&lfs, &file[0], "checkpoint/a",
+            LFS_O_WRONLY | LFS_O_TRUNC) => 0;
+    lfs_file_write(&lfs, &file[0], "aaaa", 4) => 4;
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_checkpoint(&lfs) => 0;
+
+    // once the superblock has been rewritten, clearing and writing the
+    // checkpoint are appended to it, so only the file's block is erased
+    uint64_t erases = bd.stats.erase_count;
+    lfs_file_open(&lfs, &file[0], "checkpoint/a",
+            LFS_O_WRONLY | LFS_O_TRUNC) => 0;
+    lfs_file_write(&lfs, &file[0], "aaaa", 4) => 4;
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_checkpoint(&lfs) => 0;
+    lfs.checkpointed => true;
+    if (4*cfg.prog_size <= cfg.block_size && !cfg.erase_ahead) {
+        bd.stats.erase_count - erases <= 1 => true;
+    }
+
+    // v1 drivers don't know to clear checkpoints, so none are written
+    lfs.version = 0x00010002;
+    lfs_mkdir(&lfs, "checkpoint/v1") => 0;
+    lfs.checkpointed => false;
+    lfs_checkpoint(&lfs) => 0;
+    lfs.checkpointed => false;
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs.deorphaned => false;
+    lfs.checkpointed => false;
+    lfs_stat(&lfs, "checkpoint/v1", &info) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Incremental orphan test ---"
+rm -rf blocks
+tests/test.py << TEST
+    lfs_format(&lfs, &cfg) => 0;
+TEST
+lfs_mkorphan
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    unsigned before = 0;
+    lfs_traverse(&lfs, test_count, &before) => 0;
+
+    int steps = 0;
+    while (lfs_gc_step(&lfs, 1) == 1) {
+        steps += 1;
+    }
+    lfs.deorphaned => true;
+    steps > 1 => true;
+    lfs_gc_step(&lfs, 1) => 0;
+
+    unsigned after = 0;
+    lfs_traverse(&lfs, test_count, &after) => 0;
+    int diff = before - after;
+    diff => 2;
+
+    lfs_mkdir(&lfs, "parent/sibling") => 0;
+    lfs_stat(&lfs, "parent/child", &info) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_gc_step(&lfs, 1) => 1;
+    lfs_mkdir(&lfs, "interrupted") => 0;
+    lfs.deorphaned => true;
+    while (lfs_gc_step(&lfs, 1) == 1);
+    lfs_gc_step(&lfs, 1) => 0;
+
+    lfs_file_open(&lfs, &file[0], "interrupted/file",
+            LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    size = strlen("gcgc");
+    for (int i = 0; i < 512; i++) {
+        lfs_file_write(&lfs, &file[0], "gcgc", size) => size;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_stat(&lfs, "parent/child", &info) => 0;
+    lfs_stat(&lfs, "parent/sibling", &info) => 0;
+    lfs_file_open(&lfs, &file[0], "interrupted/file", LFS_O_RDONLY) => 0;
+    size = strlen("gcgc");
+    for (int i = 0; i < 512; i++) {
+        lfs_file_read(&lfs, &file[0], buffer, size) => size;
+        memcmp(buffer, "gcgc", size) => 0;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
 echo "--- Results ---"
 tests/stats.py
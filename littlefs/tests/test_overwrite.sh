@@ -0,0 +1,67 @@
+#!/bin/bash
+set -eu
+
+SIZE=65536
+COUNT=64
+
+echo "=== Overwrite tests ==="
+rm -rf blocks
+tests/test.py << TEST
+    lfs_format(&lfs, &cfg) => 0;
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_open(&lfs, &file[0], "config",
+            LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    srand(0);
+    for (int i = 0; i < $SIZE; i += sizeof(buffer)) {
+        for (int j = 0; j < sizeof(buffer); j++) {
+            buffer[j] = rand() & 0xff;
+        }
+        lfs_file_write(&lfs, &file[0], buffer, sizeof(buffer))
+                => sizeof(buffer);
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Random overwrite ---"
+tests/test.py << TEST
+    static uint8_t model[$SIZE];
+    srand(0);
+    for (int i = 0; i < $SIZE; i++) {
+        model[i] = rand() & 0xff;
+    }
+
+    clock_t start = clock();
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_open(&lfs, &file[0], "config", LFS_O_RDWR) => 0;
+    for (int i = 0; i < $COUNT; i++) {
+        lfs_off_t off = rand() % ($SIZE - 16);
+        size = 1 + rand() % 16;
+        for (int j = 0; j < size; j++) {
+            model[off+j] = rand() & 0xff;
+        }
+
+        lfs_file_seek(&lfs, &file[0], off, LFS_SEEK_SET) => off;
+        lfs_file_write(&lfs, &file[0], &model[off], size) => size;
+        lfs_file_sync(&lfs, &file[0]) => 0;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_unmount(&lfs) => 0;
+    clock_t ticks = clock() - start;
+    printf("overwrite: %ld us for $COUNT writes\n",
+            (long)(ticks * 1000000 / CLOCKS_PER_SEC));
+
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_open(&lfs, &file[0], "config", LFS_O_RDONLY) => 0;
+    lfs_file_size(&lfs, &file[0]) => $SIZE;
+    for (int i = 0; i < $SIZE; i += sizeof(buffer)) {
+        lfs_file_read(&lfs, &file[0], buffer, sizeof(buffer))
+                => sizeof(buffer);
+        memcmp(buffer, &model[i], sizeof(buffer)) => 0;
+    }
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Results ---"
+tests/stats.py
@@ -182,5 +182,114 @@ tests/test.py << TEST
     lfs_unmount(&lfs) => 0;
 TEST
 
+echo "--- Group commit test ---"
+tests/test.py << TEST
+    struct lfs_config gcfg = cfg;
+    gcfg.group_commit = true;
+    lfs_mount(&lfs, &gcfg) => 0;
+    lfs_file_open(&lfs, &file[0], "e", LFS_O_WRONLY | LFS_O_APPEND) => 0;
+    lfs_file_open(&lfs, &file[1], "g", LFS_O_WRONLY | LFS_O_APPEND) => 0;
+    lfs_file_open(&lfs, &file[2], "h", LFS_O_WRONLY | LFS_O_CREAT) => 0;
+
+    for (int i = 0; i < 5; i++) {
+        lfs_file_write(&lfs, &file[0], (const void*)"e", 1) => 1;
+        lfs_file_write(&lfs, &file[1], (const void*)"g", 1) => 1;
+        lfs_file_write(&lfs, &file[2], (const void*)"h", 1) => 1;
+    }
+
+    // syncing one file commits the others in the same directory that are
+    // waiting on a sync too, but leaves the rest alone
+    lfs_file_marksync(&lfs, &file[1]) => 0;
+    lfs_file_sync(&lfs, &file[0]) => 0;
+    uint64_t erases = bd.stats.erase_count;
+    lfs_stat(&lfs, "e", &info) => 0;
+    info.size => 15;
+    lfs_stat(&lfs, "g", &info) => 0;
+    info.size => 15;
+    lfs_stat(&lfs, "h", &info) => 0;
+    info.size => 0;
+
+    lfs_file_sync(&lfs, &file[1]) => 0;
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_file_close(&lfs, &file[1]) => 0;
+    bd.stats.erase_count => erases;
+
+    // marks don't outlive the sync that consumed them
+    lfs_file_open(&lfs, &file[0], "e", LFS_O_WRONLY | LFS_O_APPEND) => 0;
+    lfs_file_write(&lfs, &file[0], (const void*)"e", 1) => 1;
+    lfs_file_write(&lfs, &file[2], (const void*)"h", 1) => 1;
+    lfs_file_sync(&lfs, &file[2]) => 0;
+    lfs_stat(&lfs, "e", &info) => 0;
+    info.size => 15;
+    lfs_stat(&lfs, "h", &info) => 0;
+    info.size => 6;
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_file_close(&lfs, &file[2]) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_open(&lfs, &file[0], "e", LFS_O_RDONLY) => 0;
+    lfs_file_open(&lfs, &file[1], "g", LFS_O_RDONLY) => 0;
+    lfs_file_open(&lfs, &file[2], "h", LFS_O_RDONLY) => 0;
+
+    for (int i = 0; i < 15; i++) {
+        lfs_file_read(&lfs, &file[1], buffer, 1) => 1;
+        buffer[0] => 'g';
+    }
+
+    for (int i = 0; i < 16; i++) {
+        lfs_file_read(&lfs, &file[0], buffer, 1) => 1;
+        buffer[0] => 'e';
+    }
+
+    for (int i = 0; i < 6; i++) {
+        lfs_file_read(&lfs, &file[2], buffer, 1) => 1;
+        buffer[0] => 'h';
+    }
+
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_file_close(&lfs, &file[1]) => 0;
+    lfs_file_close(&lfs, &file[2]) => 0;
+    lfs_remove(&lfs, "h") => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Group commit same file test ---"
+tests/test.py << TEST
+    struct lfs_config gcfg = cfg;
+    gcfg.group_commit = true;
+    lfs_mount(&lfs, &gcfg) => 0;
+    lfs_file_open(&lfs, &file[0], "s", LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    lfs_file_open(&lfs, &file[1], "s", LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    lfs_file_write(&lfs, &file[0], (const void*)"aaaa", 4) => 4;
+    lfs_file_write(&lfs, &file[1], (const void*)"bb", 2) => 2;
+
+    // only one handle can be written to the entry, the other still has
+    // to commit on its own
+    lfs_file_marksync(&lfs, &file[1]) => 0;
+    lfs_file_sync(&lfs, &file[0]) => 0;
+    lfs_stat(&lfs, "s", &info) => 0;
+    info.size => 4;
+    lfs_file_sync(&lfs, &file[1]) => 0;
+    lfs_stat(&lfs, "s", &info) => 0;
+    info.size => 2;
+
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_file_close(&lfs, &file[1]) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_stat(&lfs, "s", &info) => 0;
+    info.size => 2;
+    lfs_file_open(&lfs, &file[0], "s", LFS_O_RDONLY) => 0;
+    lfs_file_read(&lfs, &file[0], buffer, 4) => 2;
+    memcmp(buffer, "bb", 2) => 0;
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_remove(&lfs, "s") => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
 echo "--- Results ---"
 tests/stats.py
@@ -119,5 +119,47 @@ tests/test.py << TEST
     lfs_unmount(&lfs) => 0;
 TEST
 
+echo "--- Cached path tests ---"
+tests/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    for (int i = 0; i < 4; i++) {
+        sprintf((char*)buffer, "tea/hottea/cup%d", i);
+        lfs_file_open(&lfs, &file[0], (char*)buffer,
+                LFS_O_WRONLY | LFS_O_CREAT) => 0;
+        lfs_file_write(&lfs, &file[0], buffer, i+1) => i+1;
+        lfs_file_close(&lfs, &file[0]) => 0;
+
+        for (int j = 0; j <= i; j++) {
+            sprintf((char*)buffer, "tea/hottea/cup%d", j);
+            lfs_stat(&lfs, (char*)buffer, &info) => 0;
+            info.size => j+1;
+        }
+    }
+
+    lfs_rename(&lfs, "tea/hottea/cup1", "coffee/cup1") => 0;
+    lfs_stat(&lfs, "tea/hottea/cup1", &info) => LFS_ERR_NOENT;
+    lfs_stat(&lfs, "coffee/cup1", &info) => 0;
+    info.size => 2;
+    lfs_remove(&lfs, "tea/hottea/cup0") => 0;
+    lfs_stat(&lfs, "tea/hottea/cup0", &info) => LFS_ERR_NOENT;
+    lfs_stat(&lfs, "tea/hottea/cup2", &info) => 0;
+    info.size => 3;
+    lfs_stat(&lfs, "tea/hottea/cup3", &info) => 0;
+    info.size => 4;
+
+    lfs_file_open(&lfs, &file[0], "tea/hottea/cup3",
+                LFS_O_WRONLY | LFS_O_APPEND) => 0;
+    lfs_file_write(&lfs, &file[0], "more", 4) => 4;
+    lfs_file_close(&lfs, &file[0]) => 0;
+    lfs_stat(&lfs, "tea/hottea/cup3", &info) => 0;
+    info.size => 8;
+
+    lfs.lstats.hit_count = 0;
+    lfs_stat(&lfs, "tea", &info) => 0;
+    lfs_stat(&lfs, "tea", &info) => 0;
+    lfs.lstats.hit_count > 0 => (LFS_LOOKUP_CACHE > 0);
+    lfs_unmount(&lfs) => 0;
+TEST
+
 echo "--- Results ---"
 tests/stats.py